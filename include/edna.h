@@ -74,6 +74,28 @@ typedef void (*power_down)(void);
  */
 edna_rv edna_lib_connect(const unsigned char* aid_data, size_t aid_len);
 
+/**
+ * Connect to a (remote) daemon over TCP and register an AID
+ * @param host_port the host and port the daemon listens on ("host:port", "[v6-address]:port"
+ *                  or just "host" for the default port)
+ * @param aid_data the AID data
+ * @param aid_len the length of the AID data
+ * @return ERV_OK if the connection was established, an appropriate error otherwise
+ */
+edna_rv edna_lib_connect_tcp(const char* host_port, const unsigned char* aid_data, size_t aid_len);
+
+/**
+ * Enable or disable automatic reconnection; when enabled, the event loop
+ * does not return ERV_DISCONNECTED if the connection with the daemon is
+ * lost, but reconnects (with exponential backoff), re-registers the AID
+ * and resumes processing. If the card was powered up when the connection
+ * was lost, the power down callback is called first.
+ * @param enable non-zero to enable automatic reconnection
+ * @param max_backoff_ms the maximum delay in ms between attempts (0 for the default)
+ * @return ERV_OK if the setting was changed, an appropriate error otherwise
+ */
+edna_rv edna_lib_set_reconnect(int enable, unsigned int max_backoff_ms);
+
 /**
  * Disconnect from the daemon (unregisters the previously registered AID)
  * @return ERV_OK if disconnect was successful, an appropriate error otherwise
@@ -0,0 +1,29 @@
+# $Id$
+
+# ACX_CXX_STD(VERSION)
+# Make sure the C++ compiler supports the specified C++ standard (11, 14, ...)
+AC_DEFUN([ACX_CXX_STD],[
+	AC_LANG_PUSH([C++])
+	AC_MSG_CHECKING([for C++$1 support])
+	acx_cxx_std_ok="no"
+	acx_cxx_std_save_cxxflags="${CXXFLAGS}"
+	for acx_cxx_std_flag in "" "-std=c++$1" "-std=gnu++$1"; do
+		CXXFLAGS="${acx_cxx_std_save_cxxflags} ${acx_cxx_std_flag}"
+		AC_COMPILE_IFELSE(
+			[AC_LANG_PROGRAM([],[
+#if __cplusplus < ]m4_case([$1], [11], [201103L], [14], [201402L], [17], [201703L])[
+#error C++$1 is not supported
+#endif
+			])],
+			[acx_cxx_std_ok="yes"; break]
+		)
+	done
+	if test "${acx_cxx_std_ok}" = "yes"; then
+		AC_MSG_RESULT([yes ${acx_cxx_std_flag}])
+	else
+		CXXFLAGS="${acx_cxx_std_save_cxxflags}"
+		AC_MSG_RESULT([no])
+		AC_MSG_ERROR([A compiler with support for C++$1 is required])
+	fi
+	AC_LANG_POP([C++])
+])
@@ -0,0 +1,91 @@
+/*
+ * Copyright (c) 2013 Roland van Rijswijk-Deij
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+ * IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * The Emulator Daemon for NFC Applications (EDNA)
+ * Heap allocation statistics (configure --enable-alloc-stats)
+ */
+
+#include "config.h"
+#include "edna_alloc_stats.h"
+#include <stdlib.h>
+#include <new>
+
+#ifdef EDNA_ALLOC_STATS
+
+/* Counted per thread, so counting needs no synchronisation */
+static thread_local unsigned long long thread_allocs = 0;
+
+void* operator new(size_t size)
+{
+	thread_allocs++;
+	
+	void* mem = malloc((size > 0) ? size : 1);
+	
+	if (mem == NULL) throw std::bad_alloc();
+	
+	return mem;
+}
+
+void* operator new[](size_t size)
+{
+	return operator new(size);
+}
+
+void operator delete(void* mem) noexcept
+{
+	free(mem);
+}
+
+void operator delete[](void* mem) noexcept
+{
+	free(mem);
+}
+
+void operator delete(void* mem, size_t) noexcept
+{
+	free(mem);
+}
+
+void operator delete[](void* mem, size_t) noexcept
+{
+	free(mem);
+}
+
+unsigned long long edna_thread_allocs(void)
+{
+	return thread_allocs;
+}
+
+#else // !EDNA_ALLOC_STATS
+
+unsigned long long edna_thread_allocs(void)
+{
+	return 0;
+}
+
+#endif // EDNA_ALLOC_STATS
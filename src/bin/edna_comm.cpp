@@ -35,20 +35,119 @@
 #include "edna_log.h"
 #include "edna_proto.h"
 #include "edna_config.h"
+#include "edna_route.h"
+#include "edna_time.h"
+#include "edna_net.h"
+#include "edna_handoff.h"
+#include "edna_supervisor.h"
 #include <unistd.h>
 #include <stdio.h>
 #include <errno.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <sys/types.h>
+#include <poll.h>
+#include <netdb.h>
+#include <string.h>
+#include <string>
+#include <vector>
 
-#define NO_APP_SELECTED		-1
 #define EDNA_BACKLOG		5			/* number of pending connections in the backlog */
+#define POLL_INTERVAL		10			/* maximum time in ms between checks for termination */
+
+#define DEFAULT_PING_TIMEOUT	500		/* ms */
+#define HANDSHAKE_TIMEOUT	2000		/* ms a new client gets to register */
+
+/* Events that indicate that a client has gone away */
+#ifdef POLLRDHUP
+#define POLL_HANGUP_EVENTS	(POLLHUP | POLLERR | POLLRDHUP)
+#else // !POLLRDHUP
+#define POLL_HANGUP_EVENTS	(POLLHUP | POLLERR)
+#endif // POLLRDHUP
+
+edna_client::edna_client(int fd, const bytestring& aid)
+{
+	this->fd = fd;
+	this->aid = aid;
+	unregistered = false;
+	powered = false;
+	pending_replies = 0;
+	reply_deadline = 0;
+}
+
+edna_client::edna_client(std::shared_ptr<edna_relay> relay, const bytestring& aid)
+{
+	this->fd = -1;
+	this->relay = relay;
+	this->aid = aid;
+	unregistered = false;
+	powered = false;
+	pending_replies = 0;
+	reply_deadline = 0;
+}
+
+bool edna_client::has_buffered_message() const
+{
+	const unsigned char* buf = rx.const_byte_str();
+	
+	return (rx.size() >= 2) && (rx.size() >= (size_t) ((buf[0] << 8) + buf[1]) + 2);
+}
+
+edna_client::~edna_client()
+{
+	if (fd < 0) return;
+	
+	INFO_MSG("Closing socket %d", fd);
+	
+	close(fd);
+}
 
 edna_comm_thread::edna_comm_thread()
 {
 	should_run = true;
-	selected_application = NO_APP_SELECTED;
+	socket_fd = -1;
+	tcp_fd = -1;
+	handoff_fd = -1;
+	listening = false;
+	socket_activated = false;
+	handed_off = false;
+	handoff_callback = NULL;
+	supervisor = NULL;
+	
+	/* Number of standby registrations allowed per AID */
+	edna_conf_get_int("comm", "max_standby", max_standby, 0);
+	
+	/* Deadline for clients to respond to an APDU (0 = wait indefinitely) */
+	edna_conf_get_int("comm", "apdu_timeout", apdu_timeout, 0);
+	
+	/* Optional liveness checks of idle clients */
+	edna_conf_get_int("comm", "ping_interval", ping_interval, 0);
+	edna_conf_get_int("comm", "ping_timeout", ping_timeout, DEFAULT_PING_TIMEOUT);
+	
+	if (ping_interval > 0)
+	{
+		INFO_MSG("Pinging idle clients every %dms (timeout %dms)", ping_interval, ping_timeout);
+	}
+	
+	/* Check if a default application should be selected implicitly at power up */
+	std::string default_aid_str;
+	
+	if ((edna_conf_get_string("emulation", "default_aid", default_aid_str, NULL) == ERV_OK) && !default_aid_str.empty())
+	{
+		if ((strspn(default_aid_str.c_str(), "0123456789abcdefABCDEF") != default_aid_str.size()) || (default_aid_str.size() % 2 != 0))
+		{
+			ERROR_MSG("Invalid default AID %s in the configuration, ignoring", default_aid_str.c_str());
+		}
+		else
+		{
+			default_aid = bytestring(default_aid_str.c_str());
+			
+			INFO_MSG("Application with AID %s will be selected by default", default_aid.hex_str().c_str());
+		}
+	}
+	
+	/* Compile the APDU routing table */
+	router.load_config();
 }
 
 edna_comm_thread::~edna_comm_thread()
@@ -66,40 +165,492 @@ void edna_comm_thread::terminate()
 	waitexit();
 }
 
-void edna_comm_thread::unregister_by_socket(int client_socket)
+void edna_comm_thread::attach_session(edna_session* session)
+{
+	comm_mutex.lock();
+	
+	sessions.insert(session);
+	
+	comm_mutex.unlock();
+}
+
+void edna_comm_thread::detach_session(edna_session* session)
 {
-	for (std::map<bytestring, int>::iterator i = application_registry.begin(); i != application_registry.end(); i++)
+	comm_mutex.lock();
+	
+	sessions.erase(session);
+	
+	session->selected.reset();
+	
+	comm_mutex.unlock();
+}
+
+void edna_comm_thread::unregister_client(const edna_client_ptr& client)
+{
+	if (client->unregistered) return;
+	
+	client->unregistered = true;
+	
+	edna_client_registry::iterator i = application_registry.find(client->aid);
+	
+	if ((i != application_registry.end()) && (i->second == client))
 	{
-		if (i->second == client_socket)
+		INFO_MSG("Unregistering application with AID %s on socket %d", client->aid.hex_str().c_str(), client->fd);
+		
+		/* Promote the longest waiting standby registration for the AID, if any */
+		edna_standby_registry::iterator standby = standby_registry.find(client->aid);
+		edna_client_ptr promoted;
+		
+		if (standby != standby_registry.end())
 		{
-			INFO_MSG("Closing socket %d", client_socket);
+			promoted = standby->second;
 			
-			close(client_socket);
+			INFO_MSG("Failing over AID %s to standby client on socket %d", client->aid.hex_str().c_str(), promoted->fd);
 			
-			INFO_MSG("Unregistering application with AID %s", i->first.hex_str().c_str());
+			i->second = promoted;
 			
+			standby_registry.erase(standby);
+		}
+		else
+		{
 			application_registry.erase(i);
+		}
+		
+		/* The standby takes over the selection on every reader instantly */
+		for (std::set<edna_session*>::iterator s = sessions.begin(); s != sessions.end(); s++)
+		{
+			if ((*s)->selected == client) (*s)->selected = promoted;
+		}
+		
+		return;
+	}
+	
+	std::pair<edna_standby_registry::iterator, edna_standby_registry::iterator> range = standby_registry.equal_range(client->aid);
+	
+	for (edna_standby_registry::iterator j = range.first; j != range.second; j++)
+	{
+		if (j->second == client)
+		{
+			INFO_MSG("Unregistering standby application with AID %s on socket %d", client->aid.hex_str().c_str(), client->fd);
+			
+			standby_registry.erase(j);
 			
 			break;
 		}
-	}	
+	}
 }
 
-/*virtual*/ void edna_comm_thread::threadproc()
+std::vector<edna_client_ptr> edna_comm_thread::all_clients()
 {
-	DEBUG_MSG("Entering communications thread");
+	std::vector<edna_client_ptr> clients;
+	
+	for (edna_client_registry::iterator i = application_registry.begin(); i != application_registry.end(); i++)
+	{
+		clients.push_back(i->second);
+	}
+	
+	for (edna_standby_registry::iterator i = standby_registry.begin(); i != standby_registry.end(); i++)
+	{
+		clients.push_back(i->second);
+	}
+	
+	return clients;
+}
+
+bool edna_comm_thread::any_card_powered()
+{
+	for (std::set<edna_session*>::iterator i = sessions.begin(); i != sessions.end(); i++)
+	{
+		if ((*i)->card_powered) return true;
+	}
+	
+	return false;
+}
+
+void edna_comm_thread::client_event(const edna_client_ptr& client)
+{
+	bool drop = false;
+	
+	client->io_mutex.lock();
+	
+	/* 
+	 * Re-check the socket now that we hold the lock; an APDU exchange
+	 * may have consumed the data or unregistered the client meanwhile
+	 */
+	struct pollfd client_sock = { client->fd, POLLIN | POLL_HANGUP_EVENTS, 0 };
+	
+	/* A message may also have arrived along with the AID registration */
+	bool buffered = client->has_buffered_message();
+	
+	if (client->unregistered || ((poll(&client_sock, 1, 0) <= 0) && !buffered))
+	{
+		client->io_mutex.unlock();
+		
+		return;
+	}
+	
+	if (client_sock.revents & (POLL_HANGUP_EVENTS | POLLNVAL))
+	{
+		INFO_MSG("Client on socket %d hung up", client->fd);
+		
+		drop = true;
+	}
+	else if ((client_sock.revents & POLLIN) && (client->pending_replies > 0))
+	{
+		/* This should be the response to the PING we sent */
+		if (!collect_replies(client, false))
+		{
+			WARNING_MSG("Client on socket %d failed to respond to PING", client->fd);
+			
+			drop = true;
+		}
+	}
+	else if ((client_sock.revents & POLLIN) || buffered)
+	{
+		/* A command was received outside of an APDU exchange */
+		bytestring rx;
+		
+		if (!recv_from_client(*client, rx))
+		{
+			INFO_MSG("Connection to client on socket %d was closed", client->fd);
+			
+			drop = true;
+		}
+		else if ((rx.size() > 0) && (rx[0] == DISCONNECT))
+		{
+			INFO_MSG("Client ask for disconnect");
+			
+			drop = true;
+		}
+		else
+		{
+			WARNING_MSG("Ignoring unexpected data from client on socket %d", client->fd);
+		}
+	}
+	
+	client->io_mutex.unlock();
+	
+	if (drop)
+	{
+		comm_mutex.lock();
+		
+		unregister_client(client);
+		
+		comm_mutex.unlock();
+	}
+}
+
+void edna_comm_thread::ping_clients()
+{
+	comm_mutex.lock();
+	
+	/* Only ping between transactions, never while a card session is active */
+	if (any_card_powered())
+	{
+		comm_mutex.unlock();
+		
+		return;
+	}
+	
+	std::vector<edna_client_ptr> clients = all_clients();
+	
+	comm_mutex.unlock();
+	
+	std::vector<edna_client_ptr> dead_clients;
+	unsigned long long deadline = edna_time_ms() + ping_timeout;
+	
+	for (std::vector<edna_client_ptr>::iterator i = clients.begin(); i != clients.end(); i++)
+	{
+		edna_client_ptr client = *i;
+		
+		/* The built-in relay is always alive */
+		if (client->relay) continue;
+		
+		client->io_mutex.lock();
+		
+		if (!client->unregistered && (client->pending_replies == 0))
+		{
+			if (send_to_client(client->fd, PING, bytestring_view()))
+			{
+				client->pending_replies = 1;
+				client->reply_deadline = deadline;
+			}
+			else
+			{
+				WARNING_MSG("Failed to send PING to client on socket %d", client->fd);
+				
+				dead_clients.push_back(client);
+			}
+		}
+		
+		client->io_mutex.unlock();
+	}
+	
+	comm_mutex.lock();
+	
+	for (std::vector<edna_client_ptr>::iterator i = dead_clients.begin(); i != dead_clients.end(); i++)
+	{
+		unregister_client(*i);
+	}
+	
+	comm_mutex.unlock();
+}
+
+void edna_comm_thread::expire_pings()
+{
+	comm_mutex.lock();
+	
+	std::vector<edna_client_ptr> clients = all_clients();
+	
+	comm_mutex.unlock();
+	
+	std::vector<edna_client_ptr> dead_clients;
+	unsigned long long now = edna_time_ms();
+	
+	for (std::vector<edna_client_ptr>::iterator i = clients.begin(); i != clients.end(); i++)
+	{
+		edna_client_ptr client = *i;
+		
+		client->io_mutex.lock();
+		
+		/* A response that arrived in the meantime is still accepted */
+		if (!client->unregistered && (client->pending_replies > 0) && (now >= client->reply_deadline) && !collect_replies(client, true))
+		{
+			WARNING_MSG("Client on socket %d failed to respond to PING within %dms", client->fd, ping_timeout);
+			
+			dead_clients.push_back(client);
+		}
+		
+		client->io_mutex.unlock();
+	}
+	
+	comm_mutex.lock();
+	
+	for (std::vector<edna_client_ptr>::iterator i = dead_clients.begin(); i != dead_clients.end(); i++)
+	{
+		unregister_client(*i);
+	}
+	
+	comm_mutex.unlock();
+}
+
+bool edna_comm_thread::collect_replies(const edna_client_ptr& client, bool wait)
+{
+	while (client->pending_replies > 0)
+	{
+		unsigned long long now = edna_time_ms();
+		int timeout = (wait && (now < client->reply_deadline)) ? (int) (client->reply_deadline - now) : 0;
+		struct pollfd client_sock = { client->fd, POLLIN, 0 };
+		unsigned char status = UNKNOWN_COMMAND;
+		edna_apdu_buf rsp;
+		
+		if (poll(&client_sock, 1, timeout) <= 0)
+		{
+			if (!wait) return true;
+			
+			client->pending_replies = 0;
+			
+			return false;
+		}
+		
+		/* Any status proves liveness; clients that do not know PING respond with UNKNOWN_COMMAND */
+		if (!recv_from_client(*client, status, rsp))
+		{
+			client->pending_replies = 0;
+			
+			return false;
+		}
+		
+		client->pending_replies--;
+	}
+	
+	return true;
+}
+
+int edna_comm_thread::open_tcp_listener(const std::string& listen_addr)
+{
+	std::string host;
+	std::string port;
+	
+	if (!edna_split_host_port(listen_addr.c_str(), host, port))
+	{
+		ERROR_MSG("Invalid TCP listen address %s", listen_addr.c_str());
+		
+		return -1;
+	}
+	
+	struct addrinfo hints;
+	struct addrinfo* res = NULL;
+	
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	
+	int gai_rv = getaddrinfo((host == "*") ? NULL : host.c_str(), port.c_str(), &hints, &res);
+	
+	if (gai_rv != 0)
+	{
+		ERROR_MSG("Failed to resolve TCP listen address %s (%s)", listen_addr.c_str(), gai_strerror(gai_rv));
+		
+		return -1;
+	}
+	
+	int listen_fd = -1;
+	
+	for (struct addrinfo* ai = res; ai != NULL; ai = ai->ai_next)
+	{
+		listen_fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		
+		if (listen_fd < 0) continue;
+		
+		int on = 1;
+		
+		setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+		
+		if ((bind(listen_fd, ai->ai_addr, ai->ai_addrlen) == 0) && (listen(listen_fd, EDNA_BACKLOG) == 0))
+		{
+			break;
+		}
+		
+		close(listen_fd);
+		listen_fd = -1;
+	}
+	
+	freeaddrinfo(res);
+	
+	if (listen_fd < 0)
+	{
+		ERROR_MSG("Failed to listen for remote applets on %s, only accepting local applets", listen_addr.c_str());
+	}
+	else
+	{
+		INFO_MSG("Listening for remote applets on %s", listen_addr.c_str());
+	}
+	
+	return listen_fd;
+}
+
+void edna_comm_thread::accept_client(int listen_fd, bool is_tcp)
+{
+	struct sockaddr_storage peer;
+	socklen_t peer_len = sizeof(peer);
+	
+	int new_client_fd = accept(listen_fd, (struct sockaddr*) &peer, &peer_len);
+	
+	if (new_client_fd >= 0)
+	{
+		if (is_tcp)
+		{
+			char peer_host[NI_MAXHOST] = { 0 };
+			char peer_port[NI_MAXSERV] = { 0 };
+			
+			getnameinfo((struct sockaddr*) &peer, peer_len, peer_host, sizeof(peer_host), peer_port, sizeof(peer_port), NI_NUMERICHOST | NI_NUMERICSERV);
+			
+			INFO_MSG("New remote client socket %d open from %s port %s", new_client_fd, peer_host, peer_port);
+			
+			edna_set_tcp_options(new_client_fd);
+		}
+		else
+		{
+			INFO_MSG("New client socket %d open", new_client_fd);
+		}
+		
+		/* The client registers from the poll loop, so a silent peer cannot stall this thread */
+		edna_handshake handshake;
+		
+		handshake.fd = new_client_fd;
+		handshake.deadline = edna_time_ms() + HANDSHAKE_TIMEOUT;
+		handshake.version_sent = false;
+		
+		handshakes.push_back(handshake);
+	}
+	else
+	{
+		switch(errno)
+		{
+		case EAGAIN:
+			break;
+		case ECONNABORTED:
+			WARNING_MSG("Incoming connection aborted");
+			break;
+		case EINTR:
+			WARNING_MSG("Interrupted by signal");
+			break;
+		default:
+			ERROR_MSG("Error accepting new incoming connections (%d)", errno);
+			break;
+		}
+	}
+}
+
+void edna_comm_thread::adopt(const std::vector<edna_handoff_fd>& fds, bool activated)
+{
+	socket_activated = activated;
+	
+	for (std::vector<edna_handoff_fd>::const_iterator i = fds.begin(); i != fds.end(); i++)
+	{
+		switch(i->type)
+		{
+		case HANDOFF_LISTENER:
+			socket_fd = i->fd;
+			break;
+		case HANDOFF_ACTIVATED:
+			socket_fd = i->fd;
+			socket_activated = true;
+			break;
+		case HANDOFF_TCP_LISTENER:
+			tcp_fd = i->fd;
+			break;
+		case HANDOFF_ACTIVE:
+			INFO_MSG("Adopted application with AID %s on socket %d", i->aid.hex_str().c_str(), i->fd);
+			
+			application_registry[i->aid] = edna_client_ptr(new edna_client(i->fd, i->aid));
+			break;
+		case HANDOFF_STANDBY:
+			INFO_MSG("Adopted standby application with AID %s on socket %d", i->aid.hex_str().c_str(), i->fd);
+			
+			standby_registry.insert(std::pair<bytestring, edna_client_ptr>(i->aid, edna_client_ptr(new edna_client(i->fd, i->aid))));
+			break;
+		case HANDOFF_APPLET:
+			/* Applet processes are adopted by the supervisor */
+			break;
+		default:
+			WARNING_MSG("Ignoring handed over socket of unknown type 0x%02X", i->type);
+			
+			close(i->fd);
+			break;
+		}
+	}
+}
+
+void edna_comm_thread::set_handoff_callback(void (*callback)(void))
+{
+	handoff_callback = callback;
+}
+
+void edna_comm_thread::set_supervisor(edna_supervisor* supervisor)
+{
+	comm_mutex.lock();
+	
+	this->supervisor = supervisor;
 	
+	comm_mutex.unlock();
+}
+
+bool edna_comm_thread::open_unix_listener()
+{
 	/* Clean up lingering old socket */
 	unlink(EDNA_SOCKET);
 	
 	/* Set up UNIX domain socket for communications */
-	int socket_fd = socket(PF_UNIX, SOCK_STREAM, 0);
+	socket_fd = socket(PF_UNIX, SOCK_STREAM, 0);
 	
 	if (socket_fd < 0)
 	{
 		ERROR_MSG("Fatal: unable to create a socket");
 		
-		return;
+		return false;
 	}
 	
 	DEBUG_MSG("Opened socket %d", socket_fd);
@@ -114,10 +665,11 @@ void edna_comm_thread::unregister_by_socket(int client_socket)
 		ERROR_MSG("Fatal: failed to bind socket to %s", EDNA_SOCKET);
 		
 		close(socket_fd);
+		socket_fd = -1;
 		
 		unlink(EDNA_SOCKET);
 		
-		return;
+		return false;
 	}
 	
 	INFO_MSG("Bound socket to %s", EDNA_SOCKET);
@@ -127,163 +679,410 @@ void edna_comm_thread::unregister_by_socket(int client_socket)
 		ERROR_MSG("Fatal: failed to listen on socket %d (%s)", socket_fd, EDNA_SOCKET);
 		
 		close(socket_fd);
+		socket_fd = -1;
 		
 		unlink(EDNA_SOCKET);
 		
-		return;
+		return false;
 	}
 	
 	INFO_MSG("Socket listening for connection requests");
 	
+	return true;
+}
+
+bool edna_comm_thread::open_listeners()
+{
+	if (listening) return true;
+	
+	/* Listening sockets may have been handed over by another daemon or the service manager */
+	if (socket_fd < 0)
+	{
+		if (!open_unix_listener())
+		{
+			return false;
+		}
+	}
+	else
+	{
+		INFO_MSG("Took over socket %d listening for local applets", socket_fd);
+	}
+	
+	/* Optionally also accept remote applets over TCP */
+	std::string tcp_listen;
+	
+	if ((tcp_fd < 0) && (edna_conf_get_string("comm", "tcp_listen", tcp_listen, NULL) == ERV_OK) && !tcp_listen.empty())
+	{
+		tcp_fd = open_tcp_listener(tcp_listen);
+	}
+	
+	/* Accept requests from a new daemon to take over our sockets */
+	handoff_fd = edna_handoff_listen();
+	
+	listening = true;
+	
+	return true;
+}
+
+void edna_comm_thread::handoff_to_peer(int conn_fd)
+{
+#ifdef SO_PEERCRED
+	/* Only hand our sockets to a daemon running as the same user */
+	struct ucred peer_cred;
+	socklen_t cred_len = sizeof(peer_cred);
+	
+	if ((getsockopt(conn_fd, SOL_SOCKET, SO_PEERCRED, &peer_cred, &cred_len) != 0) || (peer_cred.uid != geteuid()))
+	{
+		WARNING_MSG("Refusing handoff request from a process running as a different user");
+		
+		return;
+	}
+	
+	INFO_MSG("Handing over sockets to new daemon with process ID %d", peer_cred.pid);
+#endif // SO_PEERCRED
+	
+	comm_mutex.lock();
+	
+	std::vector<edna_handoff_fd> fds;
+	edna_handoff_fd listener;
+	
+	/* The new daemon must not remove the socket path if the service manager owns it */
+	listener.type = socket_activated ? HANDOFF_ACTIVATED : HANDOFF_LISTENER;
+	listener.fd = socket_fd;
+	
+	fds.push_back(listener);
+	
+	if (tcp_fd >= 0)
+	{
+		listener.type = HANDOFF_TCP_LISTENER;
+		listener.fd = tcp_fd;
+		
+		fds.push_back(listener);
+	}
+	
+	for (edna_client_registry::iterator i = application_registry.begin(); i != application_registry.end(); i++)
+	{
+		edna_handoff_fd client;
+		
+		/* The new daemon sets up its own relay */
+		if (i->second->relay) continue;
+		
+		client.type = HANDOFF_ACTIVE;
+		client.fd = i->second->fd;
+		client.aid = i->first;
+		
+		fds.push_back(client);
+	}
+	
+	for (edna_standby_registry::iterator i = standby_registry.begin(); i != standby_registry.end(); i++)
+	{
+		edna_handoff_fd client;
+		
+		client.type = HANDOFF_STANDBY;
+		client.fd = i->second->fd;
+		client.aid = i->first;
+		
+		fds.push_back(client);
+	}
+	
+	/* The new daemon supervises the running applets instead of starting its own */
+	if (supervisor != NULL)
+	{
+		supervisor->hand_over(fds);
+	}
+	
+	/* Wait for APDU exchanges in progress on any reader to complete */
+	std::vector<edna_client_ptr> clients = all_clients();
+	
+	for (std::vector<edna_client_ptr>::iterator i = clients.begin(); i != clients.end(); i++)
+	{
+		(*i)->io_mutex.lock();
+		
+		/* Do not leave a PING response behind for the new daemon to trip over */
+		collect_replies(*i, true);
+	}
+	
+	bool sent = edna_handoff_send(conn_fd, fds);
+	
+	if (supervisor != NULL)
+	{
+		supervisor->hand_over_done(sent);
+	}
+	
+	/*
+	 * On success, the new daemon holds its own references to all sockets, so
+	 * closing ours does not affect the connections; clients are marked as
+	 * unregistered so that no more commands are sent to them
+	 */
+	for (std::vector<edna_client_ptr>::iterator i = clients.begin(); i != clients.end(); i++)
+	{
+		if (sent) (*i)->unregistered = true;
+		
+		(*i)->io_mutex.unlock();
+	}
+	
+	if (!sent)
+	{
+		ERROR_MSG("Handoff failed, continuing to serve applications");
+		
+		comm_mutex.unlock();
+		
+		return;
+	}
+	
+	application_registry.clear();
+	standby_registry.clear();
+	
+	for (std::set<edna_session*>::iterator i = sessions.begin(); i != sessions.end(); i++)
+	{
+		(*i)->selected.reset();
+	}
+	
+	handed_off = true;
+	should_run = false;
+	
+	comm_mutex.unlock();
+	
+	INFO_MSG("Handed over %zd socket(s) to the new daemon", fds.size());
+	
+	if (handoff_callback != NULL)
+	{
+		handoff_callback();
+	}
+}
+
+/*virtual*/ void edna_comm_thread::threadproc()
+{
+	DEBUG_MSG("Entering communications thread");
+	
+	if (!listening && !open_listeners())
+	{
+		return;
+	}
+	
+	unsigned long long last_ping = edna_time_ms();
+	
 	while (should_run)
 	{
-		struct sockaddr_un peer;
-		socklen_t peer_len = sizeof(struct sockaddr_un);
-		fd_set wait_socks;
+		std::vector<struct pollfd> wait_socks;
+		struct pollfd listen_sock = { socket_fd, POLLIN, 0 };
+		struct pollfd tcp_listen_sock = { tcp_fd, POLLIN, 0 };
+		struct pollfd handoff_sock = { handoff_fd, POLLIN, 0 };
+		
+		/* Negative descriptors are ignored by poll() */
+		wait_socks.push_back(listen_sock);
+		wait_socks.push_back(tcp_listen_sock);
+		wait_socks.push_back(handoff_sock);
+		
+		/* Watch open connections for commands and hang-ups */
+		comm_mutex.lock();
+		
+		std::vector<edna_client_ptr> clients = all_clients();
+		
+		comm_mutex.unlock();
 		
-		/* Wait for incoming connections and commands on open connections */		
-		while (should_run)
+		for (std::vector<edna_client_ptr>::iterator i = clients.begin(); i != clients.end(); i++)
 		{
-			struct timeval timeout = { 0, 1000 }; // 1ms
-			FD_ZERO(&wait_socks);
-			FD_SET(socket_fd, &wait_socks);
+			struct pollfd client_sock = { (*i)->fd, POLLIN | POLL_HANGUP_EVENTS, 0 };
 			
-			/* Add sockets for open connections */
-			for (std::map<bytestring, int>::iterator i = application_registry.begin(); i != application_registry.end(); i++)
-			{
-				FD_SET(i->second, &wait_socks);
-			}
-	
-			comm_mutex.lock();
-			
-			int rv = select(FD_SETSIZE, &wait_socks, NULL, NULL, &timeout);
-			
-			comm_mutex.unlock();
+			wait_socks.push_back(client_sock);
+		}
+		
+		/* And connections that are still registering */
+		size_t first_handshake = wait_socks.size();
+		
+		for (std::vector<edna_handshake>::iterator i = handshakes.begin(); i != handshakes.end(); i++)
+		{
+			struct pollfd handshake_sock = { i->fd, POLLIN, 0 };
 			
-			if (rv > 0) break;
+			wait_socks.push_back(handshake_sock);
 		}
 		
+		/* Wait without holding the lock so APDU exchanges are never delayed */
+		int rv = poll(&wait_socks[0], wait_socks.size(), POLL_INTERVAL);
+		
 		if (!should_run) break;
 		
-		if (FD_ISSET(socket_fd, &wait_socks))
+		if ((rv < 0) && (errno != EINTR))
 		{
-			/* Accept new connection */
-			int new_client_fd = accept(socket_fd, (struct sockaddr*) &peer, &peer_len);
-			
-			if (new_client_fd >= 0)
-			{
-				INFO_MSG("New client socket %d open", new_client_fd);
-				
-				new_client(new_client_fd);
-			}
-			else
+			ERROR_MSG("Error waiting for socket events (%d)", errno);
+		}
+		
+		if (rv > 0)
+		{
+			for (size_t i = 3; i < first_handshake; i++)
 			{
-				switch(errno)
+				if (wait_socks[i].revents != 0)
 				{
-				case EAGAIN:
-					continue;
-				case ECONNABORTED:
-					WARNING_MSG("Incoming connection aborted");
-					continue;
-				case EINTR:
-					WARNING_MSG("Interrupted by signal");
-					break;
-				default:
-					ERROR_MSG("Error accepting new incoming connections (%d)", errno);
-					break;
+					client_event(clients[i - 3]);
 				}
 			}
 		}
-		else
+		
+		if (!handshakes.empty())
+		{
+			process_handshakes(&wait_socks[first_handshake]);
+		}
+		
+		/* Check client liveness between transactions */
+		if (ping_interval > 0)
 		{
-			/* A command was received on one of the open connections */
-			bytestring rx;
+			expire_pings();
 			
-			for (std::map<bytestring, int>::iterator i = application_registry.begin(); i != application_registry.end(); i++)
+			if (edna_time_ms() - last_ping >= (unsigned long long) ping_interval)
 			{
-				if (FD_ISSET(i->second, &wait_socks))
-				{
-					if (!recv_from_client(i->second, rx))
-					{
-						INFO_MSG("Connection to client on socket %d was closed");
-						
-						unregister_by_socket(i->second);
-					}
-					else
-					{
-						if ((rx.size() > 0) && (rx[0] == DISCONNECT))
-						{
-							INFO_MSG("Client ask for disconnect");
-							
-							unregister_by_socket(i->second);
-						}
-					}
-					
-					break;
-				}
+				ping_clients();
+				
+				last_ping = edna_time_ms();
+			}
+		}
+		
+		if ((rv > 0) && (wait_socks[0].revents & POLLIN))
+		{
+			accept_client(socket_fd, false);
+		}
+		
+		if ((rv > 0) && (wait_socks[1].revents & POLLIN))
+		{
+			accept_client(tcp_fd, true);
+		}
+		
+		if ((rv > 0) && (wait_socks[2].revents & POLLIN))
+		{
+			int conn_fd = accept(handoff_fd, NULL, NULL);
+			
+			if (conn_fd >= 0)
+			{
+				handoff_to_peer(conn_fd);
+				
+				close(conn_fd);
 			}
 		}
 	}
 	
-	/* Close open connections to clients */
-	for (std::map<bytestring, int>::iterator i = application_registry.begin(); i != application_registry.end(); i++)
+	/* Close open connections to clients once they are no longer in use */
+	comm_mutex.lock();
+	
+	std::vector<edna_client_ptr> clients = all_clients();
+	
+	for (std::vector<edna_client_ptr>::iterator i = clients.begin(); i != clients.end(); i++)
+	{
+		(*i)->unregistered = true;
+	}
+	
+	application_registry.clear();
+	standby_registry.clear();
+	
+	/* Connections that did not finish registering are dropped */
+	for (std::vector<edna_handshake>::iterator i = handshakes.begin(); i != handshakes.end(); i++)
 	{
-		close(i->second);
+		close(i->fd);
 	}
 	
-	/* Clean up socket */
+	handshakes.clear();
+	
+	for (std::set<edna_session*>::iterator i = sessions.begin(); i != sessions.end(); i++)
+	{
+		(*i)->selected.reset();
+	}
+	
+	comm_mutex.unlock();
+	
+	/* Clean up sockets; after a handoff the socket paths belong to the new daemon */
+	if (tcp_fd >= 0) close(tcp_fd);
+	if (handoff_fd >= 0) close(handoff_fd);
+	
 	close(socket_fd);
-	unlink(EDNA_SOCKET);
+	
+	if (!handed_off)
+	{
+		/* An activated socket is owned by the service manager */
+		if (!socket_activated) unlink(EDNA_SOCKET);
+		
+		if (handoff_fd >= 0) unlink(EDNA_HANDOFF_SOCKET);
+	}
 	
 	DEBUG_MSG("Leaving communications thread");
 }
 
-bool edna_comm_thread::recv_from_client(int client_socket, bytestring& rx)
+bool edna_comm_thread::read_from_client(edna_client& client, unsigned char* buf, size_t len)
 {
-	unsigned short rx_size = 0;
+	size_t buffered = (client.rx.size() < len) ? client.rx.size() : len;
+	
+	/* Data received along with the AID registration comes first */
+	if (buffered > 0)
+	{
+		memcpy(buf, client.rx.const_byte_str(), buffered);
+		
+		client.rx.consume(buffered);
+	}
+	
+	return (buffered == len) || edna_read_fully(client.fd, buf + buffered, len - buffered);
+}
+
+bool edna_comm_thread::recv_from_client(edna_client& client, bytestring& rx)
+{
+	unsigned char len_buf[2];
+	
+	/* Read the length of the data to receive */
+	if (!read_from_client(client, len_buf, 2))
+	{
+		return false;
+	}
+	
+	size_t rx_size = (len_buf[0] << 8) + len_buf[1];
+	
+	rx.resize(rx_size);
 	
-	size_t rx_index = 0;
+	/* Now receive the actual data */
+	return (rx_size == 0) || read_from_client(client, rx.byte_str(), rx_size);
+}
+
+bool edna_comm_thread::recv_from_client(edna_client& client, unsigned char& status, edna_apdu_buf& rx)
+{
+	size_t rx_size;
 	
-	unsigned char buf[512] = { 0 };
+	if (client.rx.size() > 0)
+	{
+		/* The response starts with data received along with the AID registration */
+		bytestring frame;
+		
+		if (!recv_from_client(client, frame) || (frame.size() < 1))
+		{
+			return false;
+		}
+		
+		status = frame[0];
+		rx.assign(frame.const_byte_str() + 1, frame.size() - 1);
+		
+		return true;
+	}
 	
-	/*
-	 * Read the length of the data to receive
-	 * 
-	 * FIXME: this will fail if the process receives a signal!
-	 */
-	if ((read(client_socket, &buf[0], 1) != 1) ||
-	    (read(client_socket, &buf[1], 1) != 1))
+	/* Read the length of the data to receive and the status byte */
+	if (!edna_recv_frame_header(client.fd, status, rx_size))
 	{
 		return false;
 	}
 	
-	rx_size = (buf[0] << 8) + buf[1];
-	
 	rx.resize(rx_size);
 	
-	/* 
-	 * Now receive the actual data 
-	 * 
-	 * FIXME: again, will not deal well with POSIX signals!
-	 */
-	while (rx_size > 0)
+	/* Now receive the data that follows the status byte */
+	return (rx_size == 0) || edna_read_fully(client.fd, rx.byte_str(), rx_size);
+}
+
+bool edna_comm_thread::send_to_client(int client_socket, unsigned char cmd, const bytestring_view& data)
+{
+	/* Send the length, the command byte and the data in one go without copying the data */
+	if (!edna_send_frame(client_socket, cmd, data.const_byte_str(), data.size()))
 	{
-		int received = read(client_socket, &buf[0], (rx_size < 512) ? rx_size : 512);
-		
-		if (received < 0)
-		{
-			return false;
-		}
+		ERROR_MSG("Failed to send command 0x%02X with %zd byte(s) of data to client on socket %d", cmd, data.size(), client_socket);
 		
-		memcpy(&rx[rx_index], buf, received);
-		
-		rx_index += received;
-		rx_size -= received;
+		return false;
 	}
 	
 	return true;
 }
-	
+
 bool edna_comm_thread::send_to_client(int client_socket, bytestring& tx)
 {
 	if (tx.size() > 0xffff) return -1;
@@ -319,101 +1118,191 @@ bool edna_comm_thread::send_to_client(int client_socket, bytestring& tx)
 	return true;
 }
 
-void edna_comm_thread::new_client(int client_fd)
+void edna_comm_thread::process_handshakes(const struct pollfd* handshake_socks)
 {
-	INFO_MSG("New client on socket %d", client_fd);
+	std::vector<edna_handshake> in_progress;
+	unsigned long long now = edna_time_ms();
 	
-	/* First, wait for the client to send the "request API version" command */
-	bytestring req_api_ver;
-	
-	if (!recv_from_client(client_fd, req_api_ver))
+	for (size_t i = 0; i < handshakes.size(); i++)
 	{
-		ERROR_MSG("Client on socket %d failed to send API version request", client_fd);
-		
-		close(client_fd);
-		
-		return;
+		if (handshake_socks[i].revents != 0)
+		{
+			if (handshake_step(handshakes[i])) in_progress.push_back(handshakes[i]);
+		}
+		else if (now >= handshakes[i].deadline)
+		{
+			ERROR_MSG("Client on socket %d did not register within %dms, disconnecting client", handshakes[i].fd, HANDSHAKE_TIMEOUT);
+			
+			close(handshakes[i].fd);
+		}
+		else
+		{
+			in_progress.push_back(handshakes[i]);
+		}
 	}
 	
-	if ((req_api_ver.size() != 1) || (req_api_ver[0] != GET_API_VERSION))
+	handshakes.swap(in_progress);
+}
+
+bool edna_comm_thread::handshake_step(edna_handshake& handshake)
+{
+	int client_fd = handshake.fd;
+	unsigned char rx_buf[256];
+	
+	ssize_t received = recv(client_fd, rx_buf, sizeof(rx_buf), MSG_DONTWAIT);
+	
+	if (received <= 0)
 	{
-		ERROR_MSG("Client on socket %d uses invalid protocol, disconnecting client", client_fd);
+		if ((received < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR))) return true;
+		
+		ERROR_MSG("Client on socket %d disconnected before registering an AID", client_fd);
 		
 		close(client_fd);
 		
-		return;
+		return false;
 	}
 	
-	bytestring send_api_ver;
-	send_api_ver += (unsigned char) API_VERSION;
+	handshake.rx += bytestring(rx_buf, received);
 	
-	if (!send_to_client(client_fd, send_api_ver))
+	/* Process complete messages only; the rest arrives with a later poll */
+	while (handshake.rx.size() >= 2)
 	{
-		ERROR_MSG("Failed to send API version to client on socket %d", client_fd);
+		size_t msg_size = (handshake.rx[0] << 8) + handshake.rx[1];
 		
-		close(client_fd);
+		if (handshake.rx.size() < msg_size + 2) break;
 		
-		return;
+		handshake.rx.consume(2);
+		
+		bytestring msg = handshake.rx.split(msg_size);
+		
+		if (!handshake.version_sent)
+		{
+			INFO_MSG("New client on socket %d", client_fd);
+			
+			/* First, the client sends the "request API version" command */
+			if ((msg.size() != 1) || (msg[0] != GET_API_VERSION))
+			{
+				ERROR_MSG("Client on socket %d uses invalid protocol, disconnecting client", client_fd);
+				
+				close(client_fd);
+				
+				return false;
+			}
+			
+			bytestring send_api_ver;
+			send_api_ver += (unsigned char) API_VERSION;
+			
+			if (!send_to_client(client_fd, send_api_ver))
+			{
+				ERROR_MSG("Failed to send API version to client on socket %d", client_fd);
+				
+				close(client_fd);
+				
+				return false;
+			}
+			
+			handshake.version_sent = true;
+			
+			continue;
+		}
+		
+		/* Then, it registers an AID */
+		if ((msg.size() < 2) || (msg[0] != REGISTER_AID))
+		{
+			ERROR_MSG("Invalid AID registration by client on socket %d", client_fd);
+			
+			close(client_fd);
+			
+			return false;
+		}
+		
+		/* Anything that followed the registration belongs to the registered client */
+		new_client(client_fd, bytestring_view(msg).substr(1).copy(), handshake.rx);
+		
+		return false;
 	}
 	
-	/* Wait for the client to register an AID */
-	bytestring reg_aid;
+	return true;
+}
+
+void edna_comm_thread::new_client(int client_fd, const bytestring& AID, const bytestring& rx)
+{
+	edna_client_ptr client(new edna_client(client_fd, AID));
+	
+	client->rx = rx;
+	
+	/* 
+	 * Register while holding the client's lock until it has been acknowledged,
+	 * so no APDU can be routed to the client before it has received the
+	 * acknowledgement
+	 */
+	comm_mutex.lock();
 	
-	if (!recv_from_client(client_fd, reg_aid))
+	/* Check if the AID is already registered */
+	if ((application_registry.find(AID) != application_registry.end()) &&
+	    (standby_registry.count(AID) >= (size_t) max_standby))
 	{
-		ERROR_MSG("Client on socket %d failed to register an AID", client_fd);
+		comm_mutex.unlock();
 		
-		close(client_fd);
+		ERROR_MSG("Client attempted to register AID %s, which is already registered", AID.hex_str().c_str());
+		
+		bytestring reg_aid_rv;
+		reg_aid_rv += (unsigned char) AID_EXISTS;
+		
+		send_to_client(client_fd, reg_aid_rv);
 		
 		return;
 	}
 	
-	if ((reg_aid.size() < 2) || (reg_aid[0] != REGISTER_AID))
+	client->io_mutex.lock();
+	
+	if (application_registry.find(AID) != application_registry.end())
 	{
-		ERROR_MSG("Invalid AID registration by client on socket %d", client_fd);
+		INFO_MSG("New client has registered AID %s as standby", AID.hex_str().c_str());
 		
-		close(client_fd);
+		standby_registry.insert(std::pair<bytestring, edna_client_ptr>(AID, client));
+	}
+	else
+	{
+		INFO_MSG("New client has registered AID %s", AID.hex_str().c_str());
 		
-		return;
+		application_registry[AID] = client;
 	}
 	
-	bytestring AID = reg_aid.substr(1);
+	comm_mutex.unlock();
 	
-	/* Check if the AID is already registered */
-	if (application_registry.find(AID) != application_registry.end())
+	bytestring reg_aid_rv;
+	reg_aid_rv += (unsigned char) EDNA_OK;
+	
+	bool acknowledged = send_to_client(client_fd, reg_aid_rv);
+	
+	client->io_mutex.unlock();
+	
+	if (!acknowledged)
 	{
-		ERROR_MSG("Client attempted to register AID %s, which is already registered", AID.hex_str().c_str());
+		ERROR_MSG("Failed to acknowledge AID registration by client on socket %d", client_fd);
 		
-		bytestring reg_aid_rv;
-		reg_aid_rv += (unsigned char) AID_EXISTS;
+		comm_mutex.lock();
 		
-		send_to_client(client_fd, reg_aid_rv);
+		unregister_client(client);
 		
-		close(client_fd);
+		comm_mutex.unlock();
 		
 		return;
 	}
-	else
+	
+	/* Handle messages the client sent right after registering (e.g. DISCONNECT) */
+	while (client->has_buffered_message() && !client->unregistered)
 	{
-		bytestring reg_aid_rv;
-		reg_aid_rv += (unsigned char) EDNA_OK;
-		
-		if (!send_to_client(client_fd, reg_aid_rv))
-		{
-			ERROR_MSG("Failed to acknowledge AID registration by client on socket %d", client_fd);
-			
-			close(client_fd);
-			
-			return;
-		}
+		size_t buffered = client->rx.size();
 		
-		INFO_MSG("New client has registered AID %s", AID.hex_str().c_str());
+		client_event(client);
 		
-		application_registry[AID] = client_fd;
+		if (client->rx.size() == buffered) break;
 	}
 }
 
-void edna_comm_thread::select_by_aid(bytestring& aid)
+void edna_comm_thread::select_by_aid(edna_session& session, const bytestring_view& aid)
 {
 	INFO_MSG("Request to select AID %s", aid.hex_str().c_str());
 	
@@ -421,9 +1310,11 @@ void edna_comm_thread::select_by_aid(bytestring& aid)
 	 * FIXME: we only support selection by full AID at present; the
 	 *        ISO 7816 standard also allows selection by partial AIDs
 	 */
-	if (application_registry.find(aid) != application_registry.end())
+	edna_client_registry::iterator i = application_registry.find(aid);
+	
+	if (i != application_registry.end())
 	{
-		selected_application = application_registry[aid];
+		session.selected = i->second;
 		
 		INFO_MSG("Application selected");
 	}
@@ -433,71 +1324,171 @@ void edna_comm_thread::select_by_aid(bytestring& aid)
 	}
 }
 
-bool edna_comm_thread::transceive(bytestring& apdu, bytestring& rdata)
+bool edna_comm_thread::select_default(edna_session& session)
 {
-	DEBUG_MSG("--> %s (%zd)", apdu.hex_str().c_str(), apdu.size());
+	if (default_aid.size() == 0) return false;
+	
+	edna_client_registry::iterator i = application_registry.find(default_aid);
+	
+	if (i == application_registry.end()) return false;
 	
-	rdata = "6d00";
+	session.selected = i->second;
 	
-	/* Check if this is a select by AID APDU */
-	if (apdu.substr(0, 3) == "00a404")
+	DEBUG_MSG("Implicitly selected default application with AID %s", default_aid.hex_str().c_str());
+	
+	return true;
+}
+
+bool edna_comm_thread::exchange_with_client(edna_client_ptr client, const edna_apdu& apdu, edna_apdu_buf& rdata)
+{
+	while (client)
 	{
-		if (apdu.size() < 5)
+		struct pollfd client_sock = { client->fd, POLLIN, 0 };
+		unsigned char status = UNKNOWN_COMMAND;
+		bool exchanged = false;
+		
+		/* Exchanges on different readers only serialise on the same client */
+		client->io_mutex.lock();
+		
+		if (client->unregistered)
 		{
-			ERROR_MSG("Malformed APDU %s", apdu.hex_str().c_str());
-			
-			rdata = "6f00";
-			
-			return true;
+			DEBUG_MSG("Client on socket %d was unregistered before the exchange", client->fd);
+		}
+		else if (!collect_replies(client, true))
+		{
+			ERROR_MSG("Client on socket %d failed to respond to PING, closing socket", client->fd);
+		}
+		else if (!send_to_client(client->fd, TRANSCEIVE_APDU, apdu.bytes()))
+		{
+			ERROR_MSG("Failed to send APDU to client on socket %d, closing socket", client->fd);
+		}
+		else if ((apdu_timeout > 0) && (poll(&client_sock, 1, apdu_timeout) <= 0))
+		{
+			ERROR_MSG("Client on socket %d missed the %dms deadline for the R-APDU, closing socket", client->fd, apdu_timeout);
+		}
+		else if (!recv_from_client(*client, status, rdata) || (status != EDNA_OK))
+		{
+			ERROR_MSG("Failed to receive R-APDU from client on socket %d, closing socket", client->fd);
+		}
+		else
+		{
+			exchanged = true;
 		}
 		
-		// Get the AID
-		bytestring aid = apdu.substr(5, apdu[4]);
+		client->io_mutex.unlock();
 		
-		select_by_aid(aid); 
-	}
-	
-	if (selected_application != NO_APP_SELECTED)
-	{
+		if (exchanged) return true;
+		
+		/* Retry the APDU on the client that now holds the AID (i.e. the standby that took over), if any */
 		comm_mutex.lock();
 		
-		bytestring apdu_cmd;
-		bytestring apdu_rsp;
+		unregister_client(client);
 		
-		apdu_cmd.resize(1);
-		apdu_cmd[0] = TRANSCEIVE_APDU;
+		edna_client_registry::iterator i = application_registry.find(client->aid);
 		
-		apdu_cmd += apdu;
+		client = (i != application_registry.end()) ? i->second : edna_client_ptr();
 		
-		if (!send_to_client(selected_application, apdu_cmd))
+		comm_mutex.unlock();
+	}
+	
+	return false;
+}
+
+bool edna_comm_thread::transceive(edna_session& session, const edna_apdu& apdu, edna_apdu_buf& rdata, edna_client_ptr* handler /* = NULL */)
+{
+	unsigned long long start_us = edna_time_us();
+	
+	DEBUG_MSG("--> %s (%zd)", apdu.bytes().hex_str().c_str(), apdu.bytes().size());
+	
+	rdata = SW_INS_NOT_SUPPORTED;
+	
+	if (handler != NULL) handler->reset();
+	
+	edna_client_ptr target_application;
+	
+	comm_mutex.lock();
+	
+	const edna_route& route = router.route(apdu.header());
+	
+	switch(route.target)
+	{
+	case ROUTE_SW:
+		/* Fixed response, no application involved */
+		rdata = route.rsp;
+		break;
+	case ROUTE_AID:
 		{
-			comm_mutex.unlock();
-			
-			ERROR_MSG("Failed to send APDU to client on socket %d, closing socket", selected_application);
+			edna_client_registry::iterator i = application_registry.find(route.aid);
 			
-			unregister_by_socket(selected_application);
+			if (i != application_registry.end())
+			{
+				target_application = i->second;
+			}
+			else
+			{
+				WARNING_MSG("No application registered for routed AID %s", route.aid.hex_str().c_str());
+			}
+		}
+		break;
+	case ROUTE_SELECT:
+		{
+			if (apdu.lc() == 0)
+			{
+				comm_mutex.unlock();
+				
+				ERROR_MSG("SELECT by AID without an AID");
+				
+				rdata = SW_WRONG_LENGTH;
+				
+				return true;
+			}
 			
-			selected_application = NO_APP_SELECTED;
+			select_by_aid(session, apdu.data_view());
 			
-			return false;
+			target_application = session.selected;
+		}
+		break;
+	case ROUTE_SELECTED:
+	default:
+		if (!session.selected)
+		{
+			/* The default application may have registered after power up */
+			select_default(session);
 		}
 		
-		if (!recv_from_client(selected_application, apdu_rsp) || (apdu_rsp.size() < 1) || (apdu_rsp[0] != EDNA_OK))
+		target_application = session.selected;
+		break;
+	}
+	
+	/* The exchange itself does not block other readers */
+	comm_mutex.unlock();
+	
+	/* Routing rules can send commands elsewhere than the selected application */
+	if (handler != NULL) *handler = target_application;
+	
+	if (target_application && target_application->relay)
+	{
+		unsigned long long card_us;
+		
+		/* Relay straight from the reader thread, without a round trip to an application */
+		if (target_application->relay->transmit(apdu, rdata, card_us))
 		{
-			comm_mutex.unlock();
-			
-			ERROR_MSG("Failed to receive R-APDU from client on socket %d, closing socket", selected_application);
-			
-			unregister_by_socket(selected_application);
-			
-			selected_application = NO_APP_SELECTED;
+			target_application->relay->record(edna_time_us() - start_us, card_us);
+		}
+		else
+		{
+			/* The card is gone, but the daemon is fine; answer as if no application handled the command */
+			rdata = SW_INS_NOT_SUPPORTED;
+		}
+	}
+	else if (target_application)
+	{
+		if (!exchange_with_client(target_application, apdu, rdata))
+		{
+			rdata = SW_INS_NOT_SUPPORTED;
 			
 			return false;
 		}
-		
-		rdata = apdu_rsp.substr(1);
-		
-		comm_mutex.unlock();
 	}
 	
 	DEBUG_MSG("<-- %s (%zd)", rdata.hex_str().c_str(), rdata.size());
@@ -505,59 +1496,140 @@ bool edna_comm_thread::transceive(bytestring& apdu, bytestring& rdata)
 	return true;
 }
 
-bool edna_comm_thread::application_selected()
+void edna_comm_thread::register_relay(std::shared_ptr<edna_relay> relay)
 {
-	return (selected_application != NO_APP_SELECTED);
+	comm_mutex.lock();
+	
+	for (std::vector<bytestring>::const_iterator i = relay->aids().begin(); i != relay->aids().end(); i++)
+	{
+		if (application_registry.find(*i) != application_registry.end())
+		{
+			WARNING_MSG("AID %s is already registered by an application, not relaying it", i->hex_str().c_str());
+			
+			continue;
+		}
+		
+		INFO_MSG("Relaying AID %s to reader %s", i->hex_str().c_str(), relay->name().c_str());
+		
+		application_registry[*i] = edna_client_ptr(new edna_client(relay, *i));
+	}
+	
+	comm_mutex.unlock();
 }
 
-void edna_comm_thread::powerup_on_select()
+bool edna_comm_thread::application_selected(edna_session& session)
 {
-	selected_application = NO_APP_SELECTED;
+	comm_mutex.lock();
+	
+	bool selected = (session.selected.get() != NULL);
 	
-	bytestring cmd;
+	comm_mutex.unlock();
+	
+	return selected;
+}
+
+void edna_comm_thread::power_all_clients(unsigned char cmd)
+{
+	bytestring tx;
 	bytestring rsp;
 	
-	cmd.resize(1);
-	cmd[0] = POWER_UP;
+	tx.resize(1);
+	tx[0] = cmd;
 	
-	/* Send POWER UP to all clients */
+	/* Standby clients are powered up as well, so they can take over at any time */
 	comm_mutex.lock();
 	
-	for (std::map<bytestring, int>::iterator i = application_registry.begin(); i != application_registry.end(); i++)
-	{		
-		if (send_to_client(i->second, cmd) && recv_from_client(i->second, rsp) && (rsp.size() == 1) && (rsp[0] == EDNA_OK))
+	std::vector<edna_client_ptr> clients = all_clients();
+	
+	comm_mutex.unlock();
+	
+	std::set<edna_relay*> powered_relays;
+	bool power_up = (cmd == POWER_UP);
+	
+	for (std::vector<edna_client_ptr>::iterator i = clients.begin(); i != clients.end(); i++)
+	{
+		(*i)->io_mutex.lock();
+		
+		/* Clients that are already in the requested state, e.g. in use on another reader, are left alone */
+		if ((*i)->unregistered || ((*i)->powered == power_up))
+		{
+			(*i)->io_mutex.unlock();
+			
+			continue;
+		}
+		
+		(*i)->powered = power_up;
+		
+		if ((*i)->relay)
 		{
-			DEBUG_MSG("Successful POWER UP of client on socket %d", i->second);
+			/* A relay handles several AIDs, but holds only one card */
+			if (powered_relays.insert((*i)->relay.get()).second)
+			{
+				(*i)->relay->power(cmd);
+			}
+		}
+		else if ((*i)->pending_replies > 0)
+		{
+			/* Do not wait for the PING response; the reply to this command is collected after it */
+			if (send_to_client((*i)->fd, tx)) (*i)->pending_replies++;
+		}
+		else if (send_to_client((*i)->fd, tx) && recv_from_client(**i, rsp) && (rsp.size() == 1) && (rsp[0] == EDNA_OK))
+		{
+			DEBUG_MSG("Successful POWER %s of client on socket %d", power_up ? "UP" : "DOWN", (*i)->fd);
 		}
 		
-		rsp.wipe();
+		(*i)->io_mutex.unlock();
+		
+		rsp.resize(0);
 	}
+}
+
+void edna_comm_thread::powerup_on_select(edna_session& session)
+{
+	power_mutex.lock();
+	
+	comm_mutex.lock();
+	
+	session.selected.reset();
+	session.card_powered = true;
+	
+	comm_mutex.unlock();
+	
+	/* Send POWER UP to all clients that are not powered up yet (e.g. by another reader) */
+	power_all_clients(POWER_UP);
+	
+	power_mutex.unlock();
+	
+	/* Power up and implicit selection of the default application are a single step */
+	comm_mutex.lock();
+	
+	select_default(session);
 	
 	comm_mutex.unlock();
 }
 
-void edna_comm_thread::powerdown_on_deselect()
+void edna_comm_thread::powerdown_on_deselect(edna_session& session)
 {
-	selected_application = NO_APP_SELECTED;
+	power_mutex.lock();
 	
-	bytestring cmd;
-	bytestring rsp;
+	comm_mutex.lock();
 	
-	cmd.resize(1);
-	cmd[0] = POWER_DOWN;
+	session.selected.reset();
+	session.card_powered = false;
 	
-	/* Send POWER DOWN to all clients */
-	comm_mutex.lock();
+	bool last_session = !any_card_powered();
+	
+	comm_mutex.unlock();
 	
-	for (std::map<bytestring, int>::iterator i = application_registry.begin(); i != application_registry.end(); i++)
+	/* Applications are shared, so only power them down once no reader has a card in the field */
+	if (last_session)
 	{
-		if (send_to_client(i->second, cmd) && recv_from_client(i->second, rsp) && (rsp.size() == 1) && (rsp[0] == EDNA_OK))
-		{
-			DEBUG_MSG("Successful POWER DOWN of client on socket %d", i->second);
-		}
-		
-		rsp.wipe();
+		power_all_clients(POWER_DOWN);
+	}
+	else
+	{
+		DEBUG_MSG("A card is still in the field on another reader, leaving applications powered up");
 	}
 	
-	comm_mutex.unlock();
+	power_mutex.unlock();
 }
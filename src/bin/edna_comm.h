@@ -36,8 +36,107 @@
 #include "config.h"
 #include "edna_thread.h"
 #include "edna_bytestring.h"
+#include "edna_bytestring_view.h"
+#include "edna_apdu.h"
+#include "edna_apdu_buf.h"
 #include "edna_mutex.h"
+#include "edna_route.h"
+#include "edna_handoff.h"
+#include "edna_relay.h"
 #include <map>
+#include <set>
+#include <vector>
+#include <string>
+#include <memory>
+
+class edna_supervisor;
+
+/* A connected application */
+class edna_client
+{
+public:
+	/**
+	 * Constructor
+	 * @param fd the socket of the connection
+	 * @param aid the AID the application registered
+	 */
+	edna_client(int fd, const bytestring& aid);
+	
+	/**
+	 * Constructor for a built-in relay
+	 * @param relay the relay that handles the APDUs
+	 * @param aid the relayed AID
+	 */
+	edna_client(std::shared_ptr<edna_relay> relay, const bytestring& aid);
+	
+	/**
+	 * Destructor; closes the connection
+	 */
+	~edna_client();
+	
+	/* The socket, or -1 for the built-in relay */
+	int fd;
+	
+	std::shared_ptr<edna_relay> relay;
+	
+	bytestring aid;
+	
+	/* Serialises exchanges with the application */
+	edna_mutex io_mutex;
+	
+	/* Set once the application has been removed from the registry */
+	bool unregistered;
+	
+	/* Set while the application is powered up (protected by io_mutex) */
+	bool powered;
+	
+	/* Responses to PING (and POWER commands queued behind it) that were not collected yet (protected by io_mutex) */
+	unsigned int pending_replies;
+	
+	/* Time in ms by which the pending responses must have arrived */
+	unsigned long long reply_deadline;
+	
+	/* Data received along with the AID registration that belongs to later messages (protected by io_mutex) */
+	bytestring rx;
+	
+	/**
+	 * Check whether a complete message was received along with the AID registration
+	 * @return true if rx holds a complete message
+	 */
+	bool has_buffered_message() const;
+};
+
+typedef std::shared_ptr<edna_client> edna_client_ptr;
+
+/* Registered applications by AID; these can be searched with a bytestring_view */
+typedef std::map<bytestring, edna_client_ptr, bytestring_less> edna_client_registry;
+
+typedef std::multimap<bytestring, edna_client_ptr, bytestring_less> edna_standby_registry;
+
+/* A connection that has not completed the registration handshake yet */
+struct edna_handshake
+{
+	int fd;
+	
+	/* Time in ms by which the client must have registered */
+	unsigned long long deadline;
+	
+	/* Set once the API version was sent, i.e. an AID registration is expected next */
+	bool version_sent;
+	
+	/* Data received so far that does not form a complete message yet */
+	bytestring rx;
+};
+
+/* The card session on one reader */
+struct edna_session
+{
+	edna_session() : card_powered(false) { }
+	
+	edna_client_ptr selected;
+	
+	bool card_powered;
+};
 
 class edna_comm_thread : public edna_thread
 {
@@ -58,28 +157,90 @@ public:
 	void terminate();
 	
 	/**
-	 * Exchange the specified APDU with the currently selected application
-	 * @param apdu the APDU
+	 * Register the card session of a reader; all sessions share the
+	 * registered applications, but each has its own selection
+	 * @param session the session
+	 */
+	void attach_session(edna_session* session);
+	
+	/**
+	 * Unregister the card session of a reader
+	 * @param session the session
+	 */
+	void detach_session(edna_session* session);
+	
+	/**
+	 * Register the AIDs of the built-in relay; AIDs that an application
+	 * has already registered are not relayed
+	 * @param relay the relay
+	 */
+	void register_relay(std::shared_ptr<edna_relay> relay);
+	
+	/**
+	 * Exchange the specified APDU with the application it is routed to
+	 * @param session the card session on the reader the APDU came from
+	 * @param apdu the parsed and validated APDU
 	 * @param rdata the data returned by the application
+	 * @param handler if not NULL, set to the application the APDU was routed
+	 *                to, or reset if no application handled it
 	 * @return true if the APDU exchange completed normally
 	 */
-	bool transceive(bytestring& apdu, bytestring& rdata);
+	bool transceive(edna_session& session, const edna_apdu& apdu, edna_apdu_buf& rdata, edna_client_ptr* handler = NULL);
 	
 	/**
 	 * Is there an application selected?
+	 * @param session the card session to check
 	 * @return true if an application is currently selected
 	 */
-	bool application_selected();
+	bool application_selected(edna_session& session);
+	
+	/**
+	 * Power up the emulated card (called upon ISO 14443 SELECT); this
+	 * also implicitly selects the default application, if configured.
+	 * Applications are shared by all readers, so they are only sent
+	 * POWER UP if they are not powered up yet
+	 * @param session the card session on the reader
+	 */
+	void powerup_on_select(edna_session& session);
 	
 	/**
-	 * Power up the emulated card (called upon ISO 14443 SELECT)
+	 * Power down the emulated card (called upon ISO 14443 DESELECT);
+	 * applications are only sent POWER DOWN once the card has left the
+	 * field on every reader, so transactions on other readers continue
+	 * @param session the card session on the reader
 	 */
-	void powerup_on_select();
+	void powerdown_on_deselect(edna_session& session);
 	
 	/**
-	 * Power down the emulated card (called upon ISO 14443 DESELECT)
+	 * Take over the listening sockets and client connections of another
+	 * daemon; must be called before the thread is started
+	 * @param fds the descriptors handed over by the other daemon
+	 * @param activated true if the sockets were passed by a service manager
+	 * (which then also owns the socket path); sockets handed over by a
+	 * daemon carry this in their type
 	 */
-	void powerdown_on_deselect();
+	void adopt(const std::vector<edna_handoff_fd>& fds, bool activated = false);
+	
+	/**
+	 * Open the sockets on which clients connect; this is done from the
+	 * thread if it was not done before the thread was started
+	 * @return true if the daemon is listening for local clients
+	 */
+	bool open_listeners();
+	
+	/**
+	 * Set the function that is called once all sockets have been handed
+	 * over to a new daemon (and this daemon should stop)
+	 * @param callback the function to call
+	 */
+	void set_handoff_callback(void (*callback)(void));
+	
+	/**
+	 * Set the supervisor whose applets are handed over to a new daemon
+	 * together with the sockets
+	 * @param supervisor the applet supervisor (or NULL)
+	 */
+	void set_supervisor(edna_supervisor* supervisor);
 	
 protected:
 	/**
@@ -89,18 +250,88 @@ protected:
 	
 private:
 	/**
-	 * Unregister the client based on its socket
-	 * @param client_socket the client to ditch
+	 * Remove a client from the registry; if it held an active registration,
+	 * the longest waiting standby client takes over its AID and selections.
+	 * The caller must hold the communications mutex
+	 * @param client the client to ditch
+	 */
+	void unregister_client(const edna_client_ptr& client);
+	
+	/**
+	 * Get all active and standby clients; the caller must hold the
+	 * communications mutex
+	 * @return the clients
 	 */
-	void unregister_by_socket(int client_socket);
+	std::vector<edna_client_ptr> all_clients();
+	
+	/**
+	 * Check if a card session is active on any reader; the caller must
+	 * hold the communications mutex
+	 * @return true if a card is powered up on any reader
+	 */
+	bool any_card_powered();
+	
+	/**
+	 * Handle a command or hang-up on an open connection
+	 * @param client the client on whose connection the event occurred
+	 */
+	void client_event(const edna_client_ptr& client);
+	
+	/**
+	 * Send a PING to all clients to check that they are still alive
+	 * (only done while no card session is active); the responses are
+	 * collected from the poll loop, so this never waits on a client
+	 */
+	void ping_clients();
+	
+	/**
+	 * Remove clients that did not respond to a PING before the deadline
+	 */
+	void expire_pings();
+	
+	/**
+	 * Collect the pending responses of a client; the caller must hold
+	 * the io_mutex of the client
+	 * @param client the client to collect responses from
+	 * @param wait whether to wait for them until the deadline
+	 * @return false if the client failed to respond in time
+	 */
+	bool collect_replies(const edna_client_ptr& client, bool wait);
+	
+	/**
+	 * Send a power command to all clients that are not in that power
+	 * state yet; the caller must hold the power mutex. Clients that
+	 * still owe a PING response are not waited for
+	 * @param cmd the command (POWER_UP or POWER_DOWN)
+	 */
+	void power_all_clients(unsigned char cmd);
+	
+	/**
+	 * Read exactly the specified number of bytes from a client, starting
+	 * with the data received along with its AID registration
+	 * @param client the client to read from
+	 * @param buf buffer for the data
+	 * @param len the number of bytes to read
+	 * @return true if all bytes were read
+	 */
+	bool read_from_client(edna_client& client, unsigned char* buf, size_t len);
 	
 	/**
 	 * Receive data from a client
-	 * @param client_socket the client socket to receive data from
+	 * @param client the client to receive data from
 	 * @param rx buffer for the received data
 	 * @return true if data was received succesfully
 	 */
-	bool recv_from_client(int client_socket, bytestring& rx);
+	bool recv_from_client(edna_client& client, bytestring& rx);
+	
+	/**
+	 * Receive a response from a client
+	 * @param client the client to receive data from
+	 * @param status the status byte that precedes the response data
+	 * @param rx buffer for the received data (without the status byte)
+	 * @return true if data was received successfully
+	 */
+	bool recv_from_client(edna_client& client, unsigned char& status, edna_apdu_buf& rx);
 	
 	/**
 	 * Send data to a client
@@ -109,26 +340,136 @@ private:
 	 * @return true if data was sent successfully
 	 */
 	bool send_to_client(int client_socket, bytestring& tx);
+	
+	/**
+	 * Send a command to a client
+	 * @param client_socket the client socket to send data to
+	 * @param cmd the command byte
+	 * @param data the data that follows the command byte
+	 * @return true if data was sent successfully
+	 */
+	bool send_to_client(int client_socket, unsigned char cmd, const bytestring_view& data);
 
 	/**
-	 * Process a new client
+	 * Open the UNIX domain socket listening for local applets
+	 * @return true if the socket is listening
+	 */
+	bool open_unix_listener();
+	
+	/**
+	 * Open a TCP socket listening for remote applets
+	 * @param listen_addr the address and port to listen on ("host:port")
+	 * @return the listening socket, or -1 on failure
+	 */
+	int open_tcp_listener(const std::string& listen_addr);
+	
+	/**
+	 * Accept a new connection; the client registers from the poll loop
+	 * @param listen_fd the listening socket with a pending connection
+	 * @param is_tcp true if the connection is a remote (TCP) connection
+	 */
+	void accept_client(int listen_fd, bool is_tcp);
+	
+	/**
+	 * Advance the registration handshakes in progress and disconnect
+	 * clients that did not register in time
+	 * @param handshake_socks the poll results for the handshakes, in order
+	 */
+	void process_handshakes(const struct pollfd* handshake_socks);
+	
+	/**
+	 * Read the data waiting on the socket of a registration handshake
+	 * and process the messages that are complete; this never waits for
+	 * the rest of a message
+	 * @param handshake the handshake with data waiting on its socket
+	 * @return true if the handshake is still in progress
+	 */
+	bool handshake_step(edna_handshake& handshake);
+	
+	/**
+	 * Register a new client
 	 * @param client_fd new client socket
+	 * @param AID the AID the client registered
+	 * @param rx data received after the AID registration, which is kept for later reads
+	 */
+	void new_client(int client_fd, const bytestring& AID, const bytestring& rx);
+	
+	/**
+	 * Hand all sockets over to a new daemon that connected to the
+	 * handoff socket
+	 * @param conn_fd the connection to the new daemon
 	 */
-	void new_client(int client_fd);
+	void handoff_to_peer(int conn_fd);
 	
 	/**
-	 * Perform selection by AID
+	 * Exchange an APDU with a specific client; if the client fails, the
+	 * APDU is retried on the standby client that takes over its AID
+	 * @param client the client to send the APDU to
+	 * @param apdu the APDU
+	 * @param rdata the data returned by the client
+	 * @return true if the APDU exchange completed normally
+	 */
+	bool exchange_with_client(edna_client_ptr client, const edna_apdu& apdu, edna_apdu_buf& rdata);
+	
+	/**
+	 * Perform selection by AID; the caller must hold the communications mutex
+	 * @param session the card session in which to select
 	 * @param aid the AID to attempt to select
 	 */
-	void select_by_aid(bytestring& aid);
+	void select_by_aid(edna_session& session, const bytestring_view& aid);
+	
+	/**
+	 * Implicitly select the default application (if one is configured
+	 * and the application has registered with the daemon); the caller
+	 * must hold the communications mutex
+	 * @param session the card session in which to select
+	 * @return true if the default application is now selected
+	 */
+	bool select_default(edna_session& session);
 
-	std::map<bytestring, int> application_registry;
+	edna_client_registry application_registry;
 	
-	int selected_application;
+	edna_standby_registry standby_registry;
+	
+	std::set<edna_session*> sessions;
+	
+	/* Connections that are still registering (only used by the communications thread) */
+	std::vector<edna_handshake> handshakes;
+	
+	int max_standby;
+	
+	int apdu_timeout;
+	
+	int ping_interval;
+	
+	int ping_timeout;
+	
+	bytestring default_aid;
+	
+	edna_router router;
+	
+	int socket_fd;
+	
+	int tcp_fd;
+	
+	int handoff_fd;
+	
+	bool listening;
+	
+	bool socket_activated;
+	
+	bool handed_off;
+	
+	void (*handoff_callback)(void);
+	
+	edna_supervisor* supervisor;
 
 	bool should_run;
 	
 	edna_mutex comm_mutex;
+	
+	/* Serialises power changes, so that a power down for one reader cannot overtake a power up for another */
+	edna_mutex power_mutex;
 };
 
 #endif /* !_EDNA_COMM_H */
@@ -39,6 +39,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string>
+#include <vector>
 
 /* The configuration */
 config_t configuration;
@@ -166,3 +167,47 @@ edna_rv edna_conf_get_string(const char* base_path, const char* sub_path, std::s
 
 	return ERV_OK;
 }
+
+/* Get an array of string values */
+edna_rv edna_conf_get_string_array(const char* base_path, const char* sub_path, std::vector<std::string>& value)
+{
+	static char path_buf[8192];
+
+	if ((base_path == NULL) || (sub_path == NULL))
+	{
+		return ERV_PARAM_INVALID;
+	}
+
+	snprintf(path_buf, 8192, "%s.%s", base_path, sub_path);
+
+	value.clear();
+
+	config_setting_t* array = config_lookup(&configuration, path_buf);
+
+	if (array == NULL)
+	{
+		/* An absent array is treated as an empty one */
+		return ERV_OK;
+	}
+
+	if (!config_setting_is_array(array) && !config_setting_is_list(array))
+	{
+		return ERV_CONFIG_NO_ARRAY;
+	}
+
+	for (int i = 0; i < config_setting_length(array); i++)
+	{
+		config_setting_t* elem = config_setting_get_elem(array, i);
+
+		if ((elem == NULL) || (config_setting_type(elem) != CONFIG_TYPE_STRING))
+		{
+			value.clear();
+
+			return ERV_CONFIG_NO_STRING;
+		}
+
+		value.push_back(std::string(config_setting_get_string(elem)));
+	}
+
+	return ERV_OK;
+}
@@ -36,6 +36,7 @@
 #include "config.h"
 #include "edna.h"
 #include <string>
+#include <vector>
 
 /* Initialise the configuration handler */
 edna_rv edna_init_config_handling(const char* config_path);
@@ -49,6 +50,9 @@ edna_rv edna_conf_get_bool(const char* base_path, const char* sub_path, bool& va
 /* Get a string value */
 edna_rv edna_conf_get_string(const char* base_path, const char* sub_path, std::string& value, const char* def_val);
 
+/* Get an array of string values */
+edna_rv edna_conf_get_string_array(const char* base_path, const char* sub_path, std::vector<std::string>& value);
+
 /* Release the configuration handler */
 edna_rv edna_uninit_config_handling(void);
 
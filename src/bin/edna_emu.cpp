@@ -34,70 +34,87 @@
 #include "edna_config.h"
 #include "edna_emu.h"
 #include "edna_log.h"
-#include <winscard.h>
-#include <reader.h>
-#include <unistd.h>
+#include "edna_apdu.h"
+#include "edna_time.h"
+#include "edna_reader_thread.h"
+#include "edna_alloc_stats.h"
 
 #define DEFAULT_ATQ					0x0004
 #define DEFAULT_SAK					0x28
-#define IOCTL_CCID_ESCAPE_DIRECT	SCARD_CTL_CODE(1)
+#define EVENT_WAIT					100			/* ms between checks for cancellation */
+#define DEFAULT_REARM_MAX_ERRORS	3
+#define DEFAULT_RECOVERY_BACKOFF	5000		/* ms */
 
-edna_emulator::edna_emulator(edna_comm_thread* comm_thread)
+/* What to do to the reader after a DESELECT */
+#define REARM_IMMEDIATE				0			/* nothing, wait for the next tap straight away */
+#define REARM_MINIMAL				1			/* leave and re-enter emulation mode */
+#define REARM_FULL					2			/* reconfigure the card and re-enter emulation mode */
+#define REARM_ADAPTIVE				3			/* immediate, full only once the reader reported errors */
+
+edna_emulator::edna_emulator(edna_comm_thread* comm_thread, const std::string& reader_name)
 {
 	this->comm_thread = comm_thread;
+	this->reader_name = reader_name;
 	should_cancel = false;
+	has_stopped = false;
+	ready = false;
 	
-	pcsc_context = 0;
+	reader = NULL;
+	reader_thread = NULL;
 	
-	edna_conf_get_int("emulation", "cmd_delay", cmd_delay, 0);
+	latency.load_config();
 	
-	DEBUG_MSG("Setting delay between C-APDU and R-APDU to %dms", cmd_delay);
+	std::string rearm;
 	
-	edna_conf_get_bool("emulation", "delay_success_only", delay_success_only, false);
+	edna_conf_get_string("emulation", "rearm", rearm, "adaptive");
 	
-	if (delay_success_only)
+	if (rearm == "immediate")
+	{
+		rearm_policy = REARM_IMMEDIATE;
+	}
+	else if (rearm == "minimal")
 	{
-		DEBUG_MSG("Only delaying successful commands");
+		rearm_policy = REARM_MINIMAL;
 	}
+	else if (rearm == "full")
+	{
+		rearm_policy = REARM_FULL;
+	}
+	else
+	{
+		if (rearm != "adaptive")
+		{
+			WARNING_MSG("Unknown re-arm policy '%s', using adaptive re-arming", rearm.c_str());
+		}
+		
+		rearm_policy = REARM_ADAPTIVE;
+	}
+	
+	edna_conf_get_int("emulation", "rearm_max_errors", rearm_max_errors, DEFAULT_REARM_MAX_ERRORS);
+	
+	reader_errors = 0;
 }
 	
 edna_emulator::~edna_emulator()
 {
+	delete reader_thread;
+	delete reader;
 }
 
-bool edna_emulator::transceive_control(SCARDHANDLE reader, const bytestring& cmd, bytestring& rdata)
+/*virtual*/ void edna_emulator::threadproc()
 {
-	DWORD pcsc_rv;
-	DWORD rlen;
+	/* Each reader has its own card session, the applications are shared */
+	comm_thread->attach_session(&session);
 	
-	rdata.resize(512);
-	if ((pcsc_rv = SCardControl(reader, IOCTL_CCID_ESCAPE_DIRECT, cmd.const_byte_str(), cmd.size(), rdata.byte_str(), 512, &rlen)) != SCARD_S_SUCCESS)
-	{
-		ERROR_MSG("Failed to exchange control command (0x%08X)", pcsc_rv);
-		
-		SCardDisconnect(reader, SCARD_UNPOWER_CARD);
-		SCardReleaseContext(pcsc_context);
-		
-		return false;
-	}
+	run_emulation();
 	
-	rdata.resize(rlen);
+	comm_thread->detach_session(&session);
 	
-	return true;
+	has_stopped = true;
 }
-	
-void edna_emulator::run()
+
+void edna_emulator::run_emulation()
 {
-	/* Determine the card reader to connect to */
-	std::string reader;
-	
-	if ((edna_conf_get_string("emulation", "reader", reader, NULL) != ERV_OK) || reader.empty())
-	{
-		ERROR_MSG("No smart card reader configured, giving up!");
-		
-		return;
-	}
-	
 	/* Read emulation parameters from the configuration */
 	unsigned short atq;
 	unsigned char sak;
@@ -121,217 +138,224 @@ void edna_emulator::run()
 	
 	sak = (unsigned char) conf_val;
 	
-	/* Establish PC/SC context and connect to the card reader */
-	SCARDHANDLE pcsc_reader;
-	DWORD pcsc_rv;
-	DWORD active_protocol;
-	
-	if ((pcsc_rv = SCardEstablishContext(SCARD_SCOPE_USER, NULL, NULL, &pcsc_context)) != SCARD_S_SUCCESS)
-	{
-		ERROR_MSG("Failed to establish a PC/SC context, giving up!");
-		
-		return;
-	}
+	/* Connect to the reader; from here on, only the reader thread talks to it */
+	DEBUG_MSG("Startup: connecting to reader after %llums", edna_uptime_ms());
 	
-	if ((pcsc_rv = SCardConnect(pcsc_context, reader.c_str(), SCARD_SHARE_DIRECT, SCARD_PROTOCOL_T0 | SCARD_PROTOCOL_T1, &pcsc_reader, &active_protocol)) != SCARD_S_SUCCESS)
+	if ((reader = edna_reader::create(reader_name)) == NULL)
 	{
-		ERROR_MSG("Failed to connect to PC/SC reader %s, giving up!", reader.c_str());
-		
-		SCardReleaseContext(pcsc_context);
-		
 		return;
 	}
 	
-	INFO_MSG("Connected to PC/SC reader %s", reader.c_str());
-	
-	/* Switch the reader to emulation mode */
-	bytestring 	start_emu 	= "83100100";
-	bytestring	set_atq_sak	= "588de3";
-	bytestring	buzzer_off	= "588dcc00";
-	bytestring 	end_emu 	= "83100000";
-	bytestring	rdata;
-	DWORD		rlen 		= 0;
+	int max_backoff;
 	
-	rdata.resize(512);
+	edna_conf_get_int("emulation", "recovery_max_backoff", max_backoff, DEFAULT_RECOVERY_BACKOFF);
 	
-	set_atq_sak += atq;
-	set_atq_sak += sak;
+	reader_thread = new edna_reader_thread(reader, atq, sak, (max_backoff > 0) ? max_backoff : DEFAULT_RECOVERY_BACKOFF);
 	
-	INFO_MSG("Setting emulator card ATQ to 0x%04X and SAK to 0x%02X", atq, sak);
+	int poll_min;
+	int poll_max;
+	int poll_stats;
 	
-	if (!transceive_control(pcsc_reader, set_atq_sak, rdata)) return;
+	edna_conf_get_int("emulation", "poll_min", poll_min, DEFAULT_POLL_MIN);
+	edna_conf_get_int("emulation", "poll_max", poll_max, DEFAULT_POLL_MAX);
+	edna_conf_get_int("emulation", "poll_stats_interval", poll_stats, 0);
 	
-	INFO_MSG("Disabling reader buzzer");
+	reader_thread->set_poll_policy((poll_min > 0) ? poll_min : DEFAULT_POLL_MIN, (poll_max > 0) ? poll_max : DEFAULT_POLL_MAX, (poll_stats > 0) ? poll_stats : 0);
 	
-	if (!transceive_control(pcsc_reader, buzzer_off, rdata)) return;
-	
-	INFO_MSG("Entering emulation mode on reader %s", reader.c_str());
+	if (!reader_thread->start())
+	{
+		ERROR_MSG("Failed to start the reader thread");
+		
+		reader_thread->cancel();
+		
+		return;
+	}
 	
-	if (!transceive_control(pcsc_reader, start_emu, rdata)) return;
+	bool first_transaction = true;
+	bool reader_stopped = false;
+	unsigned long apdu_count = 0;
+	unsigned long long apdu_allocs = 0;
 	
-	/* Main emulation loop */
-	while(!should_cancel)
+	/* Main dispatch loop */
+	while (!should_cancel && !reader_stopped)
 	{
-		/* Wait for an event on the reader; by default we wait 100ms per call */
-		bytestring	wait_event	= "83000064";
-		bool		aborted		= false;
+		edna_reader_event event;
 		
-		do
+		if (!reader_thread->next_event(event, EVENT_WAIT))
 		{
-			if (!transceive_control(pcsc_reader, wait_event, rdata))
-			{
-				aborted = true;
-				should_cancel = true;
-				break;
-			}
-			
-			if (rdata.size() != 3) continue;
+			continue;
 		}
-		while ((rdata[1] == 0x00) && !should_cancel);
 		
-		if (aborted || should_cancel) break;
-		
-		switch(rdata[1])
+		switch(event.type)
 		{
-		case 0x01:	/* ISO 14443A SELECT */
-			DEBUG_MSG("ISO 14443A SELECT event received on reader %s", reader.c_str());
+		case READER_EVENT_READY:
+			ready = true;
+			
+			DEBUG_MSG("Reader %s is in emulation mode", reader->name().c_str());
+			break;
+		case READER_EVENT_STOPPED:
+			reader_stopped = true;
+			break;
+		case READER_EVENT_SELECT:
+			DEBUG_MSG("ISO 14443A SELECT event received on reader %s", reader->name().c_str());
 			
 			INFO_MSG("Sending POWER UP to running emulations");
 			
-			comm_thread->powerup_on_select();
+			comm_thread->powerup_on_select(session);
 			break;
-		case 0x04:	/* ISO 14443A DESELECT */
-			INFO_MSG("ISO 14443A DESELECT event received on reader %s", reader.c_str());
+		case READER_EVENT_DESELECT:
+			INFO_MSG("ISO 14443A DESELECT event received on reader %s", reader->name().c_str());
 			
-			if (comm_thread->application_selected())
-			{
-				INFO_MSG("Sending POWER DOWN to running emulations");
-				
-				comm_thread->powerdown_on_deselect();
-				
-				INFO_MSG("Sleeping 2 seconds then resetting emulation on reader");
-				sleep(2);
-				
-				// Reset the emulation in the hope that this makes
-				// everything more stable
-				if (!transceive_control(pcsc_reader, end_emu, rdata)) return;
-				if (!transceive_control(pcsc_reader, set_atq_sak, rdata)) return;
-				if (!transceive_control(pcsc_reader, buzzer_off, rdata)) return;
-				if (!transceive_control(pcsc_reader, start_emu, rdata)) return;
-				
-				INFO_MSG("Emulation successfully reset");
-			}
-			else
+			/* Let the reader re-arm while the applications are powered down */
+			reader_thread->respond(rearm_request(comm_thread->application_selected(session)));
+			
+			INFO_MSG("Sending POWER DOWN to running emulations");
+			
+			comm_thread->powerdown_on_deselect(session);
+			break;
+		case READER_EVENT_LOST:
+			WARNING_MSG("Reader %s failed, emulation is suspended until it recovers", reader->name().c_str());
+			
+			/* The card has effectively left the field */
+			if (session.card_powered)
 			{
 				INFO_MSG("Sending POWER DOWN to running emulations");
 				
-				comm_thread->powerdown_on_deselect();
+				comm_thread->powerdown_on_deselect(session);
 			}
+			
+			reader_errors = 0;
 			break;
-		case 0x02:	/* C-APDU received */
+		case READER_EVENT_ERROR:
+			reader_errors++;
+			
+			DEBUG_MSG("Reader %s reported error 0x%02X (%d since the last reset)", reader->name().c_str(), event.data.const_byte_str()[0], reader_errors);
+			break;
+		case READER_EVENT_CAPDU:
 			{
-				/* Retrieve the C-APDU */
-				bytestring get_capdu = "84";
-				
-				if (!transceive_control(pcsc_reader, get_capdu, rdata))
-				{
-					aborted = true;
-					should_cancel = true;
-					break;
-				}
+				/* Decode the C-APDU */
+				edna_apdu capdu;
+				unsigned long long allocs = edna_thread_allocs();
+				edna_apdu_buf send_to_ifd;
+				edna_client_ptr handler;
+				unsigned long long received_us = edna_time_us();
+				unsigned long long delay_us = 0;
 				
-				/* Check status byte */
-				if ((rdata.size() > 0) && (rdata[0] != 0x00))
+				if (!capdu.parse(event.data.const_byte_str(), event.data.size()))
 				{
-					switch(rdata[0])
-					{
-					case 0x03:	// No C-APDU available
-						continue;
-					case 0x13:	// FIFO overflow
-						ERROR_MSG("Card reader received APDU exceeding 280 bytes");
-						continue;
-					case 0x3B:	// Wrong mode
-						ERROR_MSG("Card reader is in wrong mode, aborting");
-						aborted = true;
-						should_cancel = true;
-						continue;
-					case 0x3C:	// Wrong parameter
-						ERROR_MSG("Card reader reported wrong parameter set, aborting");
-						aborted = true;
-						should_cancel = true;
-						continue;
-					case 0x70:	// Buffer overflow
-						ERROR_MSG("Reader internal buffer overflow");
-						continue;
-					case 0x7D:	// Wrong length
-						ERROR_MSG("Reader reports wrong length");
-						continue;
-					}
+					ERROR_MSG("Malformed C-APDU %s received", event.data.hex_str().c_str());
+					
+					reader_errors++;
+					
+					/* Reject the command without involving any application */
+					send_to_ifd = SW_WRONG_LENGTH;
 				}
-				
-				/* Cut off status byte */
-				rdata = rdata.substr(1);
-				
-				bytestring send_to_ifd;
-				
-				//DEBUG_MSG("--> %s", rdata.hex_str().c_str());
-				
-				if (!comm_thread->transceive(rdata, send_to_ifd))
+				else if (!comm_thread->transceive(session, capdu, send_to_ifd, &handler))
 				{
 					ERROR_MSG("Failed to exchange data with communications thread!");
 					
-					send_to_ifd = "6f00";
+					send_to_ifd = SW_UNKNOWN;
 				}
 				
-				//DEBUG_MSG("<-- %s", send_to_ifd.hex_str().c_str());
+				/* Rules for an AID apply to the application that handled the command, which a routing rule may have picked */
+				if (capdu.valid() && latency.active())
+				{
+					delay_us = latency.apply(handler ? bytestring_view(handler->aid) : bytestring_view(), capdu, send_to_ifd);
+				}
 				
-				if (cmd_delay)
+				/* Injected latency counts from the arrival of the C-APDU */
+				if (delay_us > 0)
 				{
-					if (!delay_success_only || (send_to_ifd.substr(send_to_ifd.size() - 2) == "9000"))
-					{
-						DEBUG_MSG("Delaying %dms", cmd_delay);
-						
-						usleep(cmd_delay * 1000);
-					}
+					DEBUG_MSG("Releasing R-APDU %lluus after the C-APDU", delay_us);
 				}
 				
-				bytestring send_rapdu = "84";
-				send_rapdu += send_to_ifd;
+				reader_thread->respond(READER_REQ_RAPDU, send_to_ifd, (delay_us > 0) ? received_us + delay_us : 0);
+				
+				apdu_count++;
+				apdu_allocs += edna_thread_allocs() - allocs;
 				
-				if (!transceive_control(pcsc_reader, send_rapdu, rdata))
+				if (first_transaction)
 				{
-					aborted = true;
-					should_cancel = true;
-					break;
+					INFO_MSG("Startup: first transaction completed after %llums", edna_uptime_ms());
+					
+					first_transaction = false;
 				}
-				
-				rdata.resize(rlen);
 			}
 			break;
-		case 0x03:	/* R-APDU processing complete */
-			DEBUG_MSG("R-APDU processing complete on reader %s", reader.c_str());
+		case READER_EVENT_RAPDU_DONE:
+			DEBUG_MSG("R-APDU processing complete on reader %s", reader->name().c_str());
 			break;
 		}
 	}
 	
-	/* Leave emulation mode */
-	INFO_MSG("Leaving emulation mode on reader %s", reader.c_str());
-	
-	if (!transceive_control(pcsc_reader, end_emu, rdata)) return;
+	/* Stop the reader thread, which leaves emulation mode */
+	reader_thread->terminate();
 	
-	/* Disconnect from reader and release PC/SC context */
-	SCardDisconnect(pcsc_reader, SCARD_UNPOWER_CARD);
+	INFO_MSG("Ending emulation on reader %s", reader->name().c_str());
 	
-	SCardReleaseContext(pcsc_context);
+#ifdef EDNA_ALLOC_STATS
+	if (apdu_count > 0)
+	{
+		INFO_MSG("Reader %s: %llu heap allocation(s) for %lu C-APDU(s) on the dispatch thread, %lu APDU buffer(s) overflowed to the heap", reader->name().c_str(), apdu_allocs, apdu_count, edna_apdu_buf::heap_allocations());
+	}
+#endif // EDNA_ALLOC_STATS
+}
+
+unsigned char edna_emulator::rearm_request(bool application_selected)
+{
+	/* Without a selected application nothing happened that could upset the reader */
+	if (!application_selected && (rearm_policy != REARM_ADAPTIVE))
+	{
+		return READER_REQ_CONTINUE;
+	}
 	
-	INFO_MSG("Disconnected from PC/SC reader %s, ending emulation", reader.c_str());
+	switch(rearm_policy)
+	{
+	case REARM_MINIMAL:
+		return READER_REQ_REARM;
+	case REARM_FULL:
+		return READER_REQ_RESET;
+	case REARM_ADAPTIVE:
+		if (reader_errors >= rearm_max_errors)
+		{
+			INFO_MSG("Reader %s reported %d error(s), resetting emulation", reader->name().c_str(), reader_errors);
+			
+			reader_errors = 0;
+			
+			return READER_REQ_RESET;
+		}
+		return READER_REQ_CONTINUE;
+	case REARM_IMMEDIATE:
+	default:
+		return READER_REQ_CONTINUE;
+	}
 }
 
 void edna_emulator::cancel()
 {
-	INFO_MSG("Canceling emulation");
+	INFO_MSG("Canceling emulation%s%s", reader_name.empty() ? "" : " on reader ", reader_name.c_str());
 	
 	should_cancel = true;
 	
-	SCardCancel(pcsc_context);
+	if (reader_thread != NULL)
+	{
+		reader_thread->cancel();
+	}
+}
+
+void edna_emulator::terminate()
+{
+	if (!has_stopped) cancel();
+	
+	waitexit();
+}
+
+bool edna_emulator::stopped()
+{
+	return has_stopped;
+}
+
+bool edna_emulator::was_ready()
+{
+	return ready;
 }
@@ -35,16 +35,24 @@
 
 #include "config.h"
 #include "edna_comm.h"
-#include <winscard.h>
+#include "edna_reader.h"
+#include "edna_reader_thread.h"
+#include "edna_thread.h"
+#include "edna_latency.h"
+#include <atomic>
+#include <string>
 
-class edna_emulator
+/* Emulates a card on a single reader */
+class edna_emulator : public edna_thread
 {
 public:
 	/**
 	 * Constructor
 	 * @param comm_thread pointer to the communications thread
+	 * @param reader_name the reader to emulate on; if empty, the reader
+	 *                    specified in the configuration is used
 	 */
-	edna_emulator(edna_comm_thread* comm_thread);
+	edna_emulator(edna_comm_thread* comm_thread, const std::string& reader_name);
 	
 	/**
 	 * Destructor
@@ -52,30 +60,62 @@ public:
 	~edna_emulator();
 	
 	/**
-	 * Run the emulator
+	 * Cancel command
 	 */
-	void run();
+	void cancel();
 	
 	/**
-	 * Cancel command
+	 * Stop emulation and wait for the thread to exit
 	 */
-	void cancel();
-		
+	void terminate();
+	
+	/**
+	 * Check if emulation on the reader has ended (e.g. because the
+	 * reader was removed)
+	 * @return true if the emulator thread has finished
+	 */
+	bool stopped();
+	
+	/**
+	 * Check if the reader ever entered emulation mode
+	 * @return true if emulation started on the reader
+	 */
+	bool was_ready();
+	
+protected:
+	/**
+	 * Run the emulator
+	 */
+	virtual void threadproc();
+	
 private:
 	/**
-	 * Exchange a control command
-	 * @param reader Handle to the reader
-	 * @param cmd Control command to send
-	 * @param rdata Return data
-	 * @return true if the control command was exchange successfully
+	 * Emulate a card on the reader until cancelled or the reader stops
 	 */
-	bool transceive_control(SCARDHANDLE reader, const bytestring& cmd, bytestring& rdata);
-
+	void run_emulation();
+	
+	/**
+	 * Decide how to re-arm the reader after a DESELECT
+	 * @param application_selected true if an application was selected during the session
+	 * @return the request for the reader thread
+	 */
+	unsigned char rearm_request(bool application_selected);
+	
 	edna_comm_thread* comm_thread;
-	bool should_cancel;
-	SCARDCONTEXT pcsc_context;
-	int cmd_delay;
-	bool delay_success_only;
+	edna_session session;
+	std::string reader_name;
+	
+	/* Shared with the reader manager thread and signal handlers */
+	std::atomic<bool> should_cancel;
+	std::atomic<bool> has_stopped;
+	std::atomic<bool> ready;
+	
+	edna_reader* reader;
+	edna_reader_thread* reader_thread;
+	edna_latency latency;
+	int rearm_policy;
+	int rearm_max_errors;
+	int reader_errors;
 };
 
 #endif /* !_EDNA_EMU_H */
@@ -0,0 +1,456 @@
+/*
+ * Copyright (c) 2013 Roland van Rijswijk-Deij
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+ * IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * The Emulator Daemon for NFC Applications (EDNA)
+ * Socket handoff between daemon processes (zero-downtime restart) and
+ * socket activation by a service manager
+ */
+
+#include "config.h"
+#include "edna_handoff.h"
+#include "edna_log.h"
+#include "edna_proto.h"
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <vector>
+
+#define HANDOFF_TIMEOUT			5000		/* ms to wait for the other daemon */
+#define HANDOFF_MAX_MSG			512
+
+/* Open the socket on which the daemon accepts handoff requests */
+int edna_handoff_listen(void)
+{
+	/* Sequenced packets keep descriptors and their descriptions together */
+	int handoff_fd = socket(PF_UNIX, SOCK_SEQPACKET, 0);
+	
+	if (handoff_fd < 0)
+	{
+		ERROR_MSG("Unable to create handoff socket, restarts will not be seamless");
+		
+		return -1;
+	}
+	
+	struct sockaddr_un addr = { 0 };
+	
+	addr.sun_family = AF_UNIX;
+	snprintf(addr.sun_path, UNIX_PATH_MAX, EDNA_HANDOFF_SOCKET);
+	
+	unlink(EDNA_HANDOFF_SOCKET);
+	
+	if ((bind(handoff_fd, (struct sockaddr*) &addr, sizeof(struct sockaddr_un)) != 0) ||
+	    (listen(handoff_fd, 1) != 0))
+	{
+		ERROR_MSG("Failed to listen for handoff requests on %s, restarts will not be seamless", EDNA_HANDOFF_SOCKET);
+		
+		close(handoff_fd);
+		
+		return -1;
+	}
+	
+	DEBUG_MSG("Listening for handoff requests on %s", EDNA_HANDOFF_SOCKET);
+	
+	return handoff_fd;
+}
+
+/* Send a single message, optionally carrying a descriptor */
+static bool send_msg(int conn_fd, const unsigned char* data, size_t len, int pass_fd)
+{
+	struct msghdr msg;
+	struct iovec iov;
+	char ctrl_buf[CMSG_SPACE(sizeof(int))];
+	
+	memset(&msg, 0, sizeof(msg));
+	memset(ctrl_buf, 0, sizeof(ctrl_buf));
+	
+	iov.iov_base = (void*) data;
+	iov.iov_len = len;
+	
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	
+	if (pass_fd >= 0)
+	{
+		msg.msg_control = ctrl_buf;
+		msg.msg_controllen = sizeof(ctrl_buf);
+		
+		struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+		
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		
+		memcpy(CMSG_DATA(cmsg), &pass_fd, sizeof(int));
+	}
+	
+	ssize_t sent = 0;
+	
+	do
+	{
+		sent = sendmsg(conn_fd, &msg, MSG_NOSIGNAL);
+	}
+	while ((sent < 0) && (errno == EINTR));
+	
+	return (sent == (ssize_t) len);
+}
+
+/* Receive a single message and the descriptor it carries (if any) */
+static bool recv_msg(int conn_fd, unsigned char* data, size_t& len, int& pass_fd)
+{
+	struct pollfd conn_sock = { conn_fd, POLLIN, 0 };
+	
+	if (poll(&conn_sock, 1, HANDOFF_TIMEOUT) <= 0)
+	{
+		return false;
+	}
+	
+	struct msghdr msg;
+	struct iovec iov;
+	char ctrl_buf[CMSG_SPACE(sizeof(int))];
+	
+	memset(&msg, 0, sizeof(msg));
+	
+	iov.iov_base = data;
+	iov.iov_len = len;
+	
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ctrl_buf;
+	msg.msg_controllen = sizeof(ctrl_buf);
+	
+	ssize_t received = 0;
+	
+	do
+	{
+		received = recvmsg(conn_fd, &msg, 0);
+	}
+	while ((received < 0) && (errno == EINTR));
+	
+	if (received <= 0)
+	{
+		return false;
+	}
+	
+	len = received;
+	pass_fd = -1;
+	
+	struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+	
+	if ((cmsg != NULL) && (cmsg->cmsg_level == SOL_SOCKET) && (cmsg->cmsg_type == SCM_RIGHTS))
+	{
+		memcpy(&pass_fd, CMSG_DATA(cmsg), sizeof(int));
+	}
+	
+	return true;
+}
+
+/* Hand the specified descriptors over to a new daemon */
+bool edna_handoff_send(int conn_fd, const std::vector<edna_handoff_fd>& fds)
+{
+	unsigned char buf[HANDOFF_MAX_MSG];
+	size_t len = sizeof(buf);
+	int no_fd = -1;
+	
+	if (!recv_msg(conn_fd, buf, len, no_fd) || (len != 1) || (buf[0] != HANDOFF_REQUEST))
+	{
+		ERROR_MSG("Invalid handoff request");
+		
+		if (no_fd >= 0) close(no_fd);
+		
+		return false;
+	}
+	
+	for (std::vector<edna_handoff_fd>::const_iterator i = fds.begin(); i != fds.end(); i++)
+	{
+		size_t len = 1;
+		
+		buf[0] = i->type;
+		
+		if (i->type == HANDOFF_APPLET)
+		{
+			/* The process ID (big endian) followed by the command line */
+			if (i->command.size() + 5 > HANDOFF_MAX_MSG)
+			{
+				WARNING_MSG("Not handing over applet with process ID %d, its command is too long", i->pid);
+				
+				continue;
+			}
+			
+			buf[1] = (i->pid >> 24) & 0xff;
+			buf[2] = (i->pid >> 16) & 0xff;
+			buf[3] = (i->pid >> 8) & 0xff;
+			buf[4] = i->pid & 0xff;
+			
+			memcpy(&buf[5], i->command.c_str(), i->command.size());
+			
+			len = i->command.size() + 5;
+		}
+		else
+		{
+			if (i->aid.size() + 1 > HANDOFF_MAX_MSG)
+			{
+				continue;
+			}
+			
+			if (i->aid.size() > 0)
+			{
+				memcpy(&buf[1], i->aid.const_byte_str(), i->aid.size());
+			}
+			
+			len = i->aid.size() + 1;
+		}
+		
+		if (!send_msg(conn_fd, buf, len, i->fd))
+		{
+			ERROR_MSG("Failed to hand over socket %d", i->fd);
+			
+			return false;
+		}
+	}
+	
+	buf[0] = HANDOFF_END;
+	
+	if (!send_msg(conn_fd, buf, 1, -1))
+	{
+		return false;
+	}
+	
+	/* Only give up our own sockets once the new daemon has confirmed it holds them */
+	len = sizeof(buf);
+	
+	if (!recv_msg(conn_fd, buf, len, no_fd) || (len != 1) || (buf[0] != HANDOFF_ACK))
+	{
+		ERROR_MSG("New daemon did not acknowledge the handoff");
+		
+		if (no_fd >= 0) close(no_fd);
+		
+		return false;
+	}
+	
+	return true;
+}
+
+/* Take over the descriptors of a running daemon */
+bool edna_handoff_receive(std::vector<edna_handoff_fd>& fds, pid_t& old_pid)
+{
+	old_pid = 0;
+	
+	int conn_fd = socket(PF_UNIX, SOCK_SEQPACKET, 0);
+	
+	if (conn_fd < 0)
+	{
+		return false;
+	}
+	
+	struct sockaddr_un addr = { 0 };
+	
+	addr.sun_family = AF_UNIX;
+	snprintf(addr.sun_path, UNIX_PATH_MAX, EDNA_HANDOFF_SOCKET);
+	
+	if (connect(conn_fd, (struct sockaddr*) &addr, sizeof(struct sockaddr_un)) != 0)
+	{
+		ERROR_MSG("No running daemon to take over from on %s", EDNA_HANDOFF_SOCKET);
+		
+		close(conn_fd);
+		
+		return false;
+	}
+	
+#ifdef SO_PEERCRED
+	struct ucred peer_cred;
+	socklen_t cred_len = sizeof(peer_cred);
+	
+	if (getsockopt(conn_fd, SOL_SOCKET, SO_PEERCRED, &peer_cred, &cred_len) == 0)
+	{
+		old_pid = peer_cred.pid;
+	}
+#endif // SO_PEERCRED
+	
+	unsigned char buf[HANDOFF_MAX_MSG];
+	bool complete = false;
+	
+	buf[0] = HANDOFF_REQUEST;
+	
+	if (send_msg(conn_fd, buf, 1, -1))
+	{
+		for (;;)
+		{
+			size_t len = sizeof(buf);
+			edna_handoff_fd handed_over;
+			
+			if (!recv_msg(conn_fd, buf, len, handed_over.fd) || (len < 1))
+			{
+				break;
+			}
+			
+			if (buf[0] == HANDOFF_END)
+			{
+				complete = true;
+				
+				break;
+			}
+			
+			handed_over.type = buf[0];
+			
+			if (handed_over.type == HANDOFF_APPLET)
+			{
+				/* Applet processes come without a descriptor */
+				if ((handed_over.fd >= 0) || (len < 5))
+				{
+					if (handed_over.fd >= 0) close(handed_over.fd);
+					
+					continue;
+				}
+				
+				handed_over.pid = (pid_t) (((unsigned long) buf[1] << 24) | (buf[2] << 16) | (buf[3] << 8) | buf[4]);
+				handed_over.command = std::string((const char*) &buf[5], len - 5);
+				
+				fds.push_back(handed_over);
+				
+				continue;
+			}
+			
+			if (handed_over.fd < 0)
+			{
+				continue;
+			}
+			
+			if (len > 1)
+			{
+				handed_over.aid = bytestring(&buf[1], len - 1);
+			}
+			
+			fds.push_back(handed_over);
+		}
+	}
+	
+	buf[0] = HANDOFF_ACK;
+	
+	if (!complete || !send_msg(conn_fd, buf, 1, -1))
+	{
+		ERROR_MSG("Handoff from the running daemon failed");
+		
+		for (std::vector<edna_handoff_fd>::iterator i = fds.begin(); i != fds.end(); i++)
+		{
+			if (i->fd >= 0) close(i->fd);
+		}
+		
+		fds.clear();
+		
+		close(conn_fd);
+		
+		return false;
+	}
+	
+	close(conn_fd);
+	
+	INFO_MSG("Took over %zd socket(s) from the running daemon", fds.size());
+	
+	return true;
+}
+
+/* Take over the listening sockets passed by a service manager */
+bool edna_activation_receive(std::vector<edna_handoff_fd>& fds)
+{
+	const char* listen_pid = getenv("LISTEN_PID");
+	const char* listen_fds = getenv("LISTEN_FDS");
+	
+	if ((listen_pid == NULL) || (listen_fds == NULL))
+	{
+		return false;
+	}
+	
+	/* The sockets are only meant for us if the PID matches */
+	if (strtol(listen_pid, NULL, 10) != getpid())
+	{
+		return false;
+	}
+	
+	int fd_count = strtol(listen_fds, NULL, 10);
+	
+	/* Make sure that processes we start do not pick up the sockets */
+	unsetenv("LISTEN_PID");
+	unsetenv("LISTEN_FDS");
+	unsetenv("LISTEN_FDNAMES");
+	
+	bool have_unix = false;
+	bool have_tcp = false;
+	
+	for (int fd = LISTEN_FDS_START; fd < LISTEN_FDS_START + fd_count; fd++)
+	{
+		struct sockaddr_storage addr;
+		socklen_t addr_len = sizeof(addr);
+		int sock_type = 0;
+		socklen_t type_len = sizeof(sock_type);
+		
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+		
+		if ((getsockname(fd, (struct sockaddr*) &addr, &addr_len) != 0) ||
+		    (getsockopt(fd, SOL_SOCKET, SO_TYPE, &sock_type, &type_len) != 0) ||
+		    (sock_type != SOCK_STREAM))
+		{
+			WARNING_MSG("Ignoring activated descriptor %d, it is not a stream socket", fd);
+			
+			continue;
+		}
+		
+		edna_handoff_fd activated;
+		
+		activated.fd = fd;
+		
+		if ((addr.ss_family == AF_UNIX) && !have_unix)
+		{
+			activated.type = HANDOFF_LISTENER;
+			have_unix = true;
+		}
+		else if (((addr.ss_family == AF_INET) || (addr.ss_family == AF_INET6)) && !have_tcp)
+		{
+			activated.type = HANDOFF_TCP_LISTENER;
+			have_tcp = true;
+		}
+		else
+		{
+			WARNING_MSG("Ignoring superfluous activated socket %d", fd);
+			
+			continue;
+		}
+		
+		fds.push_back(activated);
+	}
+	
+	INFO_MSG("Using %zd socket(s) passed by the service manager", fds.size());
+	
+	return !fds.empty();
+}
@@ -0,0 +1,87 @@
+/*
+ * Copyright (c) 2013 Roland van Rijswijk-Deij
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+ * IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * The Emulator Daemon for NFC Applications (EDNA)
+ * Socket handoff between daemon processes (zero-downtime restart) and
+ * socket activation by a service manager
+ */
+
+#ifndef _EDNA_HANDOFF_H
+#define _EDNA_HANDOFF_H
+
+#include "config.h"
+#include "edna_bytestring.h"
+#include <sys/types.h>
+#include <string>
+#include <vector>
+
+/* UNIX domain socket on which a running daemon hands over its sockets */
+#define EDNA_HANDOFF_SOCKET		"/tmp/edna-handoff"
+
+/* First descriptor passed by a service manager (systemd socket activation) */
+#define LISTEN_FDS_START		3
+
+/* Handoff protocol messages */
+#define HANDOFF_REQUEST			0x01		/* new daemon -> running daemon */
+#define HANDOFF_ACK				0x02		/* new daemon -> running daemon */
+
+/* Types of handed over descriptors */
+#define HANDOFF_LISTENER		0x01		/* UNIX domain listening socket */
+#define HANDOFF_TCP_LISTENER	0x02		/* TCP listening socket */
+#define HANDOFF_ACTIVE			0x03		/* client with an active AID registration */
+#define HANDOFF_STANDBY			0x04		/* client with a standby AID registration */
+#define HANDOFF_ACTIVATED		0x05		/* UNIX domain listening socket owned by a service manager */
+#define HANDOFF_APPLET			0x06		/* supervised applet process (no descriptor) */
+#define HANDOFF_END				0xFF		/* no more descriptors follow */
+
+struct edna_handoff_fd
+{
+	edna_handoff_fd() : type(0), fd(-1), pid(0) { }
+	
+	unsigned char	type;
+	int				fd;
+	bytestring		aid;
+	
+	/* Only for HANDOFF_APPLET */
+	pid_t			pid;
+	std::string		command;
+};
+
+/* Open the socket on which the daemon accepts handoff requests */
+int edna_handoff_listen(void);
+
+/* Hand the specified descriptors over to a new daemon; returns true once the new daemon has acknowledged */
+bool edna_handoff_send(int conn_fd, const std::vector<edna_handoff_fd>& fds);
+
+/* Take over the descriptors of a running daemon; old_pid is set to the process ID of that daemon */
+bool edna_handoff_receive(std::vector<edna_handoff_fd>& fds, pid_t& old_pid);
+
+/* Take over the listening sockets passed by a service manager (LISTEN_FDS); returns true if there were any */
+bool edna_activation_receive(std::vector<edna_handoff_fd>& fds);
+
+#endif /* !_EDNA_HANDOFF_H */
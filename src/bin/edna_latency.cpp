@@ -0,0 +1,361 @@
+/*
+ * Copyright (c) 2013 Roland van Rijswijk-Deij
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+ * IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * The Emulator Daemon for NFC Applications (EDNA)
+ * Latency and failure injection for emulated card responses
+ */
+
+#include "config.h"
+#include "edna_latency.h"
+#include "edna_config.h"
+#include "edna_log.h"
+#include "edna_time.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <string>
+#include <vector>
+#include <sstream>
+#include <fstream>
+
+#define MAX_LATENCY_RULES		256
+#define DEFAULT_FAIL_SW			"6F00"
+
+/* Check that a string is a non-empty, byte-aligned hexadecimal value */
+static bool is_hex(const std::string& str)
+{
+	return !str.empty() && (str.size() % 2 == 0) && (strspn(str.c_str(), "0123456789abcdefABCDEF") == str.size());
+}
+
+/* Convert a (fractional) number of milliseconds to microseconds */
+static bool parse_ms(const std::string& str, unsigned long long& us)
+{
+	char* end = NULL;
+	double ms = strtod(str.c_str(), &end);
+	
+	if (str.empty() || (*end != '\0') || (ms < 0))
+	{
+		return false;
+	}
+	
+	us = (unsigned long long) (ms * 1000);
+	
+	return true;
+}
+
+edna_latency::edna_latency()
+{
+	seed = (unsigned int) (edna_time_us() ^ (unsigned long long) pthread_self());
+}
+
+bool edna_latency::load_samples(const std::string& path, std::vector<unsigned long long>& samples_us)
+{
+	std::ifstream in(path.c_str());
+	std::string line;
+	
+	if (!in)
+	{
+		ERROR_MSG("Failed to open recorded delays %s", path.c_str());
+		
+		return false;
+	}
+	
+	while (std::getline(in, line))
+	{
+		std::istringstream tokens(line.substr(0, line.find('#')));
+		std::string value;
+		unsigned long long us;
+		
+		if (!(tokens >> value)) continue;
+		
+		if (!parse_ms(value, us))
+		{
+			ERROR_MSG("Invalid delay \"%s\" in %s", value.c_str(), path.c_str());
+			
+			return false;
+		}
+		
+		samples_us.push_back(us);
+	}
+	
+	return !samples_us.empty();
+}
+
+bool edna_latency::parse_rule(const std::string& rule, edna_latency_rule& compiled)
+{
+	std::istringstream tokens(rule);
+	std::string match;
+	std::string delay;
+	std::string option;
+	
+	if (!(tokens >> match >> delay))
+	{
+		return false;
+	}
+	
+	compiled.ins = LATENCY_ANY_INS;
+	compiled.min_us = compiled.max_us = compiled.jitter_us = 0;
+	compiled.fail_percent = 0;
+	compiled.fail_sw = DEFAULT_FAIL_SW;
+	compiled.success_only = false;
+	
+	/* Match on the application and/or the instruction, e.g. "aid:A000000003,ins:B0" */
+	if (match != "*")
+	{
+		std::istringstream criteria(match);
+		std::string criterion;
+		
+		while (std::getline(criteria, criterion, ','))
+		{
+			if ((criterion.compare(0, 4, "aid:") == 0) && is_hex(criterion.substr(4)))
+			{
+				compiled.aid = bytestring(criterion.substr(4).c_str());
+			}
+			else if ((criterion.compare(0, 4, "ins:") == 0) && is_hex(criterion.substr(4)) && (criterion.size() == 6))
+			{
+				compiled.ins = (int) strtoul(criterion.substr(4).c_str(), NULL, 16);
+			}
+			else
+			{
+				return false;
+			}
+		}
+	}
+	
+	if (delay == "none")
+	{
+		compiled.distribution = LATENCY_NONE;
+	}
+	else if (delay.compare(0, 6, "fixed:") == 0)
+	{
+		compiled.distribution = LATENCY_FIXED;
+		
+		if (!parse_ms(delay.substr(6), compiled.min_us)) return false;
+	}
+	else if (delay.compare(0, 8, "uniform:") == 0)
+	{
+		size_t dash = delay.find('-', 8);
+		
+		compiled.distribution = LATENCY_UNIFORM;
+		
+		if ((dash == std::string::npos) ||
+		    !parse_ms(delay.substr(8, dash - 8), compiled.min_us) ||
+		    !parse_ms(delay.substr(dash + 1), compiled.max_us) ||
+		    (compiled.max_us < compiled.min_us))
+		{
+			return false;
+		}
+	}
+	else if (delay.compare(0, 9, "recorded:") == 0)
+	{
+		compiled.distribution = LATENCY_RECORDED;
+		
+		if (!load_samples(delay.substr(9), compiled.samples_us)) return false;
+	}
+	else
+	{
+		return false;
+	}
+	
+	while (tokens >> option)
+	{
+		if (option.compare(0, 7, "jitter:") == 0)
+		{
+			if (!parse_ms(option.substr(7), compiled.jitter_us)) return false;
+		}
+		else if (option.compare(0, 5, "fail:") == 0)
+		{
+			/* "fail:<percent>[/<SW>]" */
+			std::string percent = option.substr(5);
+			size_t slash = percent.find('/');
+			char* end = NULL;
+			
+			if (slash != std::string::npos)
+			{
+				std::string sw = percent.substr(slash + 1);
+				
+				if (!is_hex(sw) || (sw.size() != 4)) return false;
+				
+				compiled.fail_sw = bytestring(sw.c_str());
+				percent = percent.substr(0, slash);
+			}
+			
+			compiled.fail_percent = strtod(percent.c_str(), &end);
+			
+			if (percent.empty() || (*end != '\0') || (compiled.fail_percent < 0) || (compiled.fail_percent > 100)) return false;
+		}
+		else if (option == "ok-only")
+		{
+			compiled.success_only = true;
+		}
+		else
+		{
+			return false;
+		}
+	}
+	
+	return true;
+}
+
+bool edna_latency::load_config()
+{
+	std::vector<std::string> rule_texts;
+	bool rv = true;
+	
+	rules.clear();
+	
+	if (edna_conf_get_string_array("latency", "rules", rule_texts) != ERV_OK)
+	{
+		ERROR_MSG("Latency rules must be specified as a list of strings");
+		
+		rv = false;
+	}
+	
+	for (std::vector<std::string>::iterator i = rule_texts.begin(); i != rule_texts.end(); i++)
+	{
+		edna_latency_rule compiled;
+		
+		if (rules.size() >= MAX_LATENCY_RULES)
+		{
+			ERROR_MSG("Too many latency rules, ignoring all rules from \"%s\" onwards", i->c_str());
+			
+			rv = false;
+			
+			break;
+		}
+		
+		if (!parse_rule(*i, compiled))
+		{
+			ERROR_MSG("Invalid latency rule \"%s\", ignoring", i->c_str());
+			
+			rv = false;
+			
+			continue;
+		}
+		
+		rules.push_back(compiled);
+	}
+	
+	/* The old fixed delay setting is a rule that matches all commands */
+	int cmd_delay = 0;
+	bool delay_success_only = false;
+	
+	edna_conf_get_int("emulation", "cmd_delay", cmd_delay, 0);
+	edna_conf_get_bool("emulation", "delay_success_only", delay_success_only, false);
+	
+	if (cmd_delay > 0)
+	{
+		edna_latency_rule compiled;
+		
+		DEBUG_MSG("Setting delay between C-APDU and R-APDU to %dms%s", cmd_delay, delay_success_only ? " for successful commands" : "");
+		
+		compiled.ins = LATENCY_ANY_INS;
+		compiled.distribution = LATENCY_FIXED;
+		compiled.min_us = compiled.max_us = (unsigned long long) cmd_delay * 1000;
+		compiled.jitter_us = 0;
+		compiled.fail_percent = 0;
+		compiled.success_only = delay_success_only;
+		
+		rules.push_back(compiled);
+	}
+	
+	if (!rules.empty())
+	{
+		INFO_MSG("Loaded %zd latency rule(s)", rules.size());
+	}
+	
+	return rv;
+}
+
+unsigned long long edna_latency::draw(unsigned long long range)
+{
+	if (range <= 1) return 0;
+	
+	/* Combine two draws, rand_r() may only provide 15 random bits */
+	unsigned long long value = ((unsigned long long) rand_r(&seed) << 31) ^ (unsigned long long) rand_r(&seed);
+	
+	return value % range;
+}
+
+bool edna_latency::active()
+{
+	return !rules.empty();
+}
+
+unsigned long long edna_latency::apply(const bytestring_view& aid, const edna_apdu& capdu, edna_apdu_buf& rapdu)
+{
+	for (std::vector<edna_latency_rule>::iterator i = rules.begin(); i != rules.end(); i++)
+	{
+		if ((i->ins != LATENCY_ANY_INS) && (i->ins != capdu.ins())) continue;
+		
+		if ((i->aid.size() > 0) && (aid != i->aid)) continue;
+		
+		/* Failure injection */
+		if ((i->fail_percent > 0) && (draw(1000000) < (unsigned long long) (i->fail_percent * 10000)))
+		{
+			DEBUG_MSG("Injecting failure %s", i->fail_sw.hex_str().c_str());
+			
+			rapdu = i->fail_sw;
+		}
+		
+		if (i->success_only && (edna_apdu::status_word(rapdu) != 0x9000))
+		{
+			return 0;
+		}
+		
+		unsigned long long delay_us = 0;
+		
+		switch(i->distribution)
+		{
+		case LATENCY_FIXED:
+			delay_us = i->min_us;
+			break;
+		case LATENCY_UNIFORM:
+			delay_us = i->min_us + draw(i->max_us - i->min_us + 1);
+			break;
+		case LATENCY_RECORDED:
+			delay_us = i->samples_us[draw(i->samples_us.size())];
+			break;
+		case LATENCY_NONE:
+		default:
+			break;
+		}
+		
+		if (i->jitter_us > 0)
+		{
+			unsigned long long deviation = draw(2 * i->jitter_us + 1);
+			
+			delay_us = (delay_us + deviation > i->jitter_us) ? delay_us + deviation - i->jitter_us : 0;
+		}
+		
+		return delay_us;
+	}
+	
+	return 0;
+}
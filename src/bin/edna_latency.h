@@ -0,0 +1,125 @@
+/*
+ * Copyright (c) 2013 Roland van Rijswijk-Deij
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+ * IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * The Emulator Daemon for NFC Applications (EDNA)
+ * Latency and failure injection for emulated card responses
+ */
+
+#ifndef _EDNA_LATENCY_H
+#define _EDNA_LATENCY_H
+
+#include "config.h"
+#include "edna_bytestring.h"
+#include "edna_bytestring_view.h"
+#include "edna_apdu.h"
+#include <vector>
+#include <string>
+
+/* Delay distributions */
+#define LATENCY_NONE			0x00		/* no delay (e.g. for failure injection only) */
+#define LATENCY_FIXED			0x01		/* always the same delay */
+#define LATENCY_UNIFORM			0x02		/* uniformly distributed between a minimum and a maximum */
+#define LATENCY_RECORDED		0x03		/* drawn from delays recorded on a real card */
+
+#define LATENCY_ANY_INS			-1
+
+struct edna_latency_rule
+{
+	bytestring					aid;			/* application that handled the command to match (empty = any) */
+	int							ins;			/* INS byte to match, or LATENCY_ANY_INS */
+	int							distribution;	/* one of the LATENCY_... values */
+	unsigned long long			min_us;			/* fixed delay, or minimum of a uniform distribution */
+	unsigned long long			max_us;			/* maximum of a uniform distribution */
+	std::vector<unsigned long long>	samples_us;	/* recorded delays */
+	unsigned long long			jitter_us;		/* random deviation added to the delay (+/-) */
+	double						fail_percent;	/* chance of replacing the response by fail_sw */
+	bytestring					fail_sw;		/* status word returned on an injected failure */
+	bool						success_only;	/* only delay responses with status word 9000 */
+};
+
+class edna_latency
+{
+public:
+	/**
+	 * Constructor; without rules, responses are neither delayed nor altered
+	 */
+	edna_latency();
+	
+	/**
+	 * Load the latency rules from the configuration; the emulation.cmd_delay
+	 * and delay_success_only settings become a final catch-all rule
+	 * @return true if all rules were loaded successfully
+	 */
+	bool load_config();
+	
+	/**
+	 * Check if any rules are loaded
+	 * @return true if APDU exchanges may be delayed or failed
+	 */
+	bool active();
+	
+	/**
+	 * Apply the first matching rule to an APDU exchange
+	 * @param aid the AID of the application that handled the command (empty if none)
+	 * @param capdu the command
+	 * @param rapdu the response; replaced by a status word if a failure is injected
+	 * @return the time in microseconds the response should take, measured
+	 *         from the moment the command was received
+	 */
+	unsigned long long apply(const bytestring_view& aid, const edna_apdu& capdu, edna_apdu_buf& rapdu);
+	
+private:
+	/**
+	 * Parse a single rule of the form "<match> <delay> [<option> ...]"
+	 * @param rule the rule text
+	 * @param compiled the compiled rule
+	 * @return true if the rule was parsed successfully
+	 */
+	bool parse_rule(const std::string& rule, edna_latency_rule& compiled);
+	
+	/**
+	 * Load recorded delays (one value in milliseconds per line)
+	 * @param path the file to load the delays from
+	 * @param samples_us receives the delays in microseconds
+	 * @return true if at least one delay was loaded
+	 */
+	bool load_samples(const std::string& path, std::vector<unsigned long long>& samples_us);
+	
+	/**
+	 * Draw a random number
+	 * @param range the number of possible values
+	 * @return a value between 0 and range - 1
+	 */
+	unsigned long long draw(unsigned long long range);
+	
+	std::vector<edna_latency_rule> rules;
+	
+	unsigned int seed;
+};
+
+#endif /* !_EDNA_LATENCY_H */
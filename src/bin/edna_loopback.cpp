@@ -0,0 +1,409 @@
+/*
+ * Copyright (c) 2013 Roland van Rijswijk-Deij
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+ * IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * The Emulator Daemon for NFC Applications (EDNA)
+ * Loopback reader class; serves the virtual reader driver for local PC/SC applications
+ */
+
+#include "config.h"
+#include "edna_loopback.h"
+#include "edna_config.h"
+#include "edna_log.h"
+#include "edna_proto.h"
+#include "edna_time.h"
+#include "edna_apdu.h"
+#include "edna_net.h"
+#include <unistd.h>
+#include <stdio.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <string>
+#include <vector>
+
+#define LOOPBACK_BACKLOG	5			/* number of pending connections in the backlog */
+
+edna_loopback_conn::edna_loopback_conn(edna_loopback* loopback, int fd)
+{
+	this->loopback = loopback;
+	this->fd = fd;
+	finished = false;
+	open_us = edna_time_us();
+	apdu_count = 0;
+}
+
+void edna_loopback_conn::terminate()
+{
+	/* Makes a blocking read on the connection return */
+	shutdown(fd, SHUT_RDWR);
+	
+	waitexit();
+}
+
+/*virtual*/ void edna_loopback_conn::threadproc()
+{
+	while (loopback->conn_event(this));
+	
+	finished = true;
+	
+	/* Have the loopback thread join this thread and close the connection */
+	loopback->wake();
+}
+
+edna_loopback::edna_loopback(edna_comm_thread* comm_thread)
+{
+	this->comm_thread = comm_thread;
+	listen_fd = -1;
+	wake_fds[0] = -1;
+	wake_fds[1] = -1;
+	should_run = true;
+}
+
+edna_loopback::~edna_loopback()
+{
+	for (std::vector<edna_loopback_conn*>::iterator i = conns.begin(); i != conns.end(); i++)
+	{
+		close_conn(*i);
+	}
+	
+	if (listen_fd >= 0)
+	{
+		close(listen_fd);
+		
+		unlink(socket_path.c_str());
+	}
+	
+	if (wake_fds[0] >= 0) close(wake_fds[0]);
+	if (wake_fds[1] >= 0) close(wake_fds[1]);
+}
+
+bool edna_loopback::open_listener()
+{
+	bool enabled;
+	
+	if ((edna_conf_get_bool("loopback", "enabled", enabled, false) != ERV_OK) || !enabled)
+	{
+		return false;
+	}
+	
+	if (edna_conf_get_string("loopback", "socket", socket_path, EDNA_LOOPBACK_SOCKET) != ERV_OK)
+	{
+		ERROR_MSG("Error reading loopback socket from configuration file");
+		
+		return false;
+	}
+	
+	if (socket_path.size() >= UNIX_PATH_MAX)
+	{
+		ERROR_MSG("Loopback socket path %s is too long", socket_path.c_str());
+		
+		return false;
+	}
+	
+	if (pipe(wake_fds) != 0)
+	{
+		ERROR_MSG("Unable to create the loopback wake-up pipe (%d)", errno);
+		
+		wake_fds[0] = -1;
+		wake_fds[1] = -1;
+		
+		return false;
+	}
+	
+	/* Clean up lingering old socket */
+	unlink(socket_path.c_str());
+	
+	listen_fd = socket(PF_UNIX, SOCK_STREAM, 0);
+	
+	if (listen_fd < 0)
+	{
+		ERROR_MSG("Unable to create the loopback socket");
+		
+		return false;
+	}
+	
+	struct sockaddr_un addr = { 0 };
+	
+	addr.sun_family = AF_UNIX;
+	snprintf(addr.sun_path, UNIX_PATH_MAX, "%s", socket_path.c_str());
+	
+	if ((bind(listen_fd, (struct sockaddr*) &addr, sizeof(struct sockaddr_un)) != 0) ||
+	    (listen(listen_fd, LOOPBACK_BACKLOG) != 0))
+	{
+		ERROR_MSG("Failed to listen for the loopback reader driver on %s", socket_path.c_str());
+		
+		close(listen_fd);
+		listen_fd = -1;
+		
+		unlink(socket_path.c_str());
+		
+		return false;
+	}
+	
+	INFO_MSG("Listening for the loopback reader driver on %s", socket_path.c_str());
+	
+	return true;
+}
+
+void edna_loopback::terminate()
+{
+	should_run = false;
+	
+	wake();
+	
+	waitexit();
+}
+
+void edna_loopback::wake()
+{
+	/* Wake the thread up from poll() */
+	if (wake_fds[1] >= 0)
+	{
+		unsigned char wake = 0;
+		
+		if (write(wake_fds[1], &wake, 1) != 1)
+		{
+			WARNING_MSG("Failed to wake up the loopback thread (%d)", errno);
+		}
+	}
+}
+
+void edna_loopback::reap_conns()
+{
+	std::vector<edna_loopback_conn*> open_conns;
+	
+	for (std::vector<edna_loopback_conn*>::iterator i = conns.begin(); i != conns.end(); i++)
+	{
+		if ((*i)->finished)
+		{
+			(*i)->terminate();
+			
+			close_conn(*i);
+		}
+		else
+		{
+			open_conns.push_back(*i);
+		}
+	}
+	
+	conns.swap(open_conns);
+}
+
+/*virtual*/ void edna_loopback::threadproc()
+{
+	DEBUG_MSG("Entering loopback thread");
+	
+	std::vector<struct pollfd> wait_socks;
+	
+	while (should_run)
+	{
+		wait_socks.clear();
+		
+		struct pollfd listen_sock = { listen_fd, POLLIN, 0 };
+		struct pollfd wake_sock = { wake_fds[0], POLLIN, 0 };
+		
+		wait_socks.push_back(listen_sock);
+		wait_socks.push_back(wake_sock);
+		
+		/* Sleep until there is work; terminate() wakes the thread through the pipe */
+		int rv = poll(&wait_socks[0], wait_socks.size(), -1);
+		
+		if (!should_run) break;
+		
+		if ((rv < 0) && (errno != EINTR))
+		{
+			ERROR_MSG("Error waiting for loopback events (%d)", errno);
+		}
+		
+		if (rv <= 0) continue;
+		
+		/* Connections that have finished wake us up */
+		if (wait_socks[1].revents & POLLIN)
+		{
+			unsigned char wake[16];
+			
+			if (read(wake_fds[0], wake, sizeof(wake)) < 0)
+			{
+				WARNING_MSG("Failed to read from the loopback wake-up pipe (%d)", errno);
+			}
+			
+			reap_conns();
+		}
+		
+		if (wait_socks[0].revents & POLLIN)
+		{
+			accept_conn();
+		}
+	}
+	
+	/* Disconnect the remaining drivers and wait for their threads */
+	for (std::vector<edna_loopback_conn*>::iterator i = conns.begin(); i != conns.end(); i++)
+	{
+		(*i)->terminate();
+		
+		close_conn(*i);
+	}
+	
+	conns.clear();
+	
+	DEBUG_MSG("Leaving loopback thread");
+}
+
+void edna_loopback::accept_conn()
+{
+	int conn_fd = accept(listen_fd, NULL, NULL);
+	
+	if (conn_fd < 0) return;
+	
+	edna_loopback_conn* conn = new edna_loopback_conn(this, conn_fd);
+	
+	/* Each virtual reader has its own card session, like a physical reader */
+	comm_thread->attach_session(&conn->session);
+	
+	if (!conn->start())
+	{
+		ERROR_MSG("Failed to start a thread for the loopback reader driver on socket %d", conn_fd);
+		
+		close_conn(conn);
+		
+		return;
+	}
+	
+	conns.push_back(conn);
+	
+	INFO_MSG("Loopback reader driver connected on socket %d", conn_fd);
+}
+
+bool edna_loopback::conn_event(edna_loopback_conn* conn)
+{
+	unsigned char cmd;
+	edna_apdu_buf data;
+	edna_apdu_buf rdata;
+	
+	if (!recv_command(conn->fd, cmd, data))
+	{
+		INFO_MSG("Loopback reader driver on socket %d disconnected", conn->fd);
+		
+		return false;
+	}
+	
+	switch(cmd)
+	{
+	case POWER_UP:
+		DEBUG_MSG("Loopback POWER UP on socket %d", conn->fd);
+		
+		/* A reset by the driver powers down the running session first */
+		if (conn->session.card_powered)
+		{
+			comm_thread->powerdown_on_deselect(conn->session);
+		}
+		
+		comm_thread->powerup_on_select(conn->session);
+		
+		return send_response(conn->fd, EDNA_OK, bytestring_view());
+	case POWER_DOWN:
+		DEBUG_MSG("Loopback POWER DOWN on socket %d", conn->fd);
+		
+		if (conn->session.card_powered)
+		{
+			comm_thread->powerdown_on_deselect(conn->session);
+		}
+		
+		return send_response(conn->fd, EDNA_OK, bytestring_view());
+	case TRANSCEIVE_APDU:
+		{
+			edna_apdu capdu;
+			
+			if (!conn->session.card_powered)
+			{
+				/* The driver skipped power up; do it as a card entering the field would */
+				comm_thread->powerup_on_select(conn->session);
+			}
+			
+			if (!capdu.parse(data.const_byte_str(), data.size()))
+			{
+				ERROR_MSG("Malformed C-APDU %s received from the loopback reader driver", data.hex_str().c_str());
+				
+				rdata = SW_WRONG_LENGTH;
+			}
+			else if (!comm_thread->transceive(conn->session, capdu, rdata))
+			{
+				rdata = SW_UNKNOWN;
+			}
+			
+			conn->apdu_count++;
+			
+			return send_response(conn->fd, EDNA_OK, rdata);
+		}
+	default:
+		WARNING_MSG("Unknown command 0x%02X from the loopback reader driver", cmd);
+		
+		return send_response(conn->fd, UNKNOWN_COMMAND, bytestring_view());
+	}
+}
+
+void edna_loopback::close_conn(edna_loopback_conn* conn)
+{
+	if (conn->session.card_powered)
+	{
+		comm_thread->powerdown_on_deselect(conn->session);
+	}
+	
+	comm_thread->detach_session(&conn->session);
+	
+	unsigned long long open_ms = (edna_time_us() - conn->open_us) / 1000;
+	
+	if (conn->apdu_count > 0)
+	{
+		INFO_MSG("Loopback reader on socket %d exchanged %lu APDU(s) in %llums", conn->fd, conn->apdu_count, open_ms);
+	}
+	
+	close(conn->fd);
+	
+	delete conn;
+}
+
+bool edna_loopback::recv_command(int fd, unsigned char& cmd, edna_apdu_buf& data)
+{
+	size_t rx_size;
+	
+	if (!edna_recv_frame_header(fd, cmd, rx_size))
+	{
+		return false;
+	}
+	
+	data.resize(rx_size);
+	
+	return (rx_size == 0) || edna_read_fully(fd, data.byte_str(), rx_size);
+}
+
+bool edna_loopback::send_response(int fd, unsigned char status, const bytestring_view& data)
+{
+	return edna_send_frame(fd, status, data.const_byte_str(), data.size());
+}
@@ -0,0 +1,185 @@
+/*
+ * Copyright (c) 2013 Roland van Rijswijk-Deij
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+ * IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * The Emulator Daemon for NFC Applications (EDNA)
+ * Loopback reader class; serves the virtual reader driver for local PC/SC applications
+ */
+
+#ifndef _EDNA_LOOPBACK_H
+#define _EDNA_LOOPBACK_H
+
+#include "config.h"
+#include "edna_comm.h"
+#include "edna_thread.h"
+#include "edna_bytestring_view.h"
+#include "edna_apdu_buf.h"
+#include <atomic>
+#include <string>
+#include <vector>
+
+class edna_loopback;
+
+/*
+ * A virtual reader connected through the loopback socket; each one is
+ * served by its own thread, so that a slow application only holds up
+ * the virtual reader that is talking to it
+ */
+class edna_loopback_conn : public edna_thread
+{
+public:
+	/**
+	 * Constructor
+	 * @param loopback the loopback reader that accepted the connection
+	 * @param fd the connection socket
+	 */
+	edna_loopback_conn(edna_loopback* loopback, int fd);
+	
+	/**
+	 * End the thread; the connection is shut down if it is still open
+	 */
+	void terminate();
+	
+	int fd;
+	
+	edna_session session;
+	
+	/* Set when the driver has disconnected and the thread can be joined */
+	std::atomic<bool> finished;
+	
+	/* Statistics */
+	unsigned long long open_us;
+	unsigned long apdu_count;
+	
+protected:
+	/**
+	 * The thread body
+	 */
+	virtual void threadproc();
+	
+private:
+	edna_loopback* loopback;
+};
+
+/*
+ * Exposes the registered applications as a card in a virtual reader;
+ * the loopback driver loaded by pcscd sends POWER_UP, TRANSCEIVE_APDU
+ * and POWER_DOWN commands, like the daemon does to applications
+ */
+class edna_loopback : public edna_thread
+{
+public:
+	/**
+	 * Constructor
+	 * @param comm_thread pointer to the communications thread
+	 */
+	edna_loopback(edna_comm_thread* comm_thread);
+	
+	/**
+	 * Destructor
+	 */
+	~edna_loopback();
+	
+	/**
+	 * Open the loopback socket if it is enabled in the configuration
+	 * @return true if the socket is listening
+	 */
+	bool open_listener();
+	
+	/**
+	 * End the thread
+	 */
+	void terminate();
+	
+protected:
+	/**
+	 * The thread body
+	 */
+	virtual void threadproc();
+	
+private:
+	friend class edna_loopback_conn;
+	
+	/**
+	 * Wake the thread up from waiting for events
+	 */
+	void wake();
+	
+	/**
+	 * Join and close the connections whose driver has disconnected
+	 */
+	void reap_conns();
+	
+	/**
+	 * Accept a new virtual reader connection
+	 */
+	void accept_conn();
+	
+	/**
+	 * Handle a command or hang-up on a virtual reader connection; called
+	 * from the thread of the connection
+	 * @param conn the connection
+	 * @return false if the connection was closed
+	 */
+	bool conn_event(edna_loopback_conn* conn);
+	
+	/**
+	 * Close a virtual reader connection; a powered card is powered down
+	 * @param conn the connection
+	 */
+	void close_conn(edna_loopback_conn* conn);
+	
+	/**
+	 * Receive a command from the driver
+	 * @param fd the connection socket
+	 * @param cmd the command byte
+	 * @param data the data that follows the command byte
+	 * @return true if a command was received
+	 */
+	bool recv_command(int fd, unsigned char& cmd, edna_apdu_buf& data);
+	
+	/**
+	 * Send a response to the driver
+	 * @param fd the connection socket
+	 * @param status the status byte
+	 * @param data the data that follows the status byte
+	 * @return true if the response was sent
+	 */
+	bool send_response(int fd, unsigned char status, const bytestring_view& data);
+	
+	edna_comm_thread* comm_thread;
+	std::string socket_path;
+	int listen_fd;
+	
+	/* Written to by terminate() and finished connections, so the thread can wait for events without a timeout */
+	int wake_fds[2];
+	
+	bool should_run;
+	std::vector<edna_loopback_conn*> conns;
+};
+
+#endif /* !_EDNA_LOOPBACK_H */
@@ -36,19 +36,35 @@
 #include <unistd.h>
 #include <string.h>
 #include <signal.h>
+#include <errno.h>
 #include <sys/types.h>
 #include <string>
+#include <vector>
+#include <memory>
 #include "edna.h"
 #include "edna_config.h"
 #include "edna_log.h"
 #include "edna_comm.h"
-#include "edna_emu.h"
+#include "edna_reader_manager.h"
+#include "edna_supervisor.h"
+#include "edna_loopback.h"
+#include "edna_handoff.h"
+#include "edna_time.h"
 
 /* Communications thread object */
 static edna_comm_thread* comm_thread = NULL;
 
-/* Emulator */
-static edna_emulator* emulator = NULL;
+/* Reader manager; runs an emulator per reader */
+static edna_reader_manager* reader_manager = NULL;
+
+/* Applet supervisor */
+static edna_supervisor* supervisor = NULL;
+
+/* Loopback reader for local PC/SC applications */
+static edna_loopback* loopback = NULL;
+
+/* Time in ms to wait for the old daemon to release the reader after a takeover */
+#define TAKEOVER_WAIT			5000
 
 void version(void)
 {
@@ -63,11 +79,13 @@ void usage(void)
 {
 	printf("Emulator Daemon for NFC Applications (edna) version %s\n\n", VERSION);
 	printf("Usage:\n");
-	printf("\tedna [-f] [-c <config>] [-p <pidfile>]\n");
+	printf("\tedna [-f] [-r] [-c <config>] [-p <pidfile>]\n");
 	printf("\tedna -h\n");
 	printf("\tedna -v\n");
 	printf("\n");
 	printf("\t-f            Run in the foreground rather than forking as a daemon\n");
+	printf("\t-r            Take over from a running daemon without disconnecting\n");
+	printf("\t              its applications (zero-downtime restart)\n");
 	printf("\t-c <config>   Use <config> as configuration file\n");
 	printf("\t              Defaults to %s\n", DEFAULT_EDNA_CONF);
 	printf("\t-p <pidfile>  Specify the PID file to write the daemon process ID to\n");
@@ -135,6 +153,40 @@ void signal_unexpected(int signum)
 	}
 }
 
+/* Called once the communications thread has handed its sockets to a new daemon */
+void handoff_complete(void)
+{
+	INFO_MSG("A new daemon has taken over, stopping");
+	
+	if (reader_manager != NULL)
+	{
+		reader_manager->cancel();
+	}
+}
+
+/* Wait for the daemon we took over from to exit and release the reader */
+void wait_for_old_daemon(pid_t old_pid)
+{
+	int waited = 0;
+	
+	if (old_pid <= 0) return;
+	
+	while ((kill(old_pid, 0) == 0) || (errno == EPERM))
+	{
+		if (waited >= TAKEOVER_WAIT)
+		{
+			WARNING_MSG("Old daemon (process ID %d) has not exited yet, starting emulation anyway", old_pid);
+			
+			return;
+		}
+		
+		usleep(10000);
+		waited += 10;
+	}
+	
+	INFO_MSG("Old daemon has exited after %dms", waited);
+}
+
 /* Signal handler for normal termination */
 void signal_term(int signum)
 {
@@ -143,9 +195,9 @@ void signal_term(int signum)
 		comm_thread->terminate();
 	}
 	
-	if (emulator != NULL)
+	if (reader_manager != NULL)
 	{
-		emulator->cancel();
+		reader_manager->cancel();
 	}
 }
 
@@ -157,11 +209,17 @@ int main(int argc, char* argv[])
 	int 				c 				= 0;
 	bool 				pid_path_set 	= false;
 	bool 				daemon_set 		= false;
+	bool				takeover		= false;
 	pid_t 				pid 			= 0;
+	pid_t				old_pid			= 0;
+	std::vector<edna_handoff_fd>	handed_over;
+	std::vector<edna_handoff_fd>	activated;
+	
+	edna_time_mark_start();
 	
 	comm_thread = NULL;
 	
-	while ((c = getopt(argc, argv, "fc:p:hv")) != -1)
+	while ((c = getopt(argc, argv, "frc:p:hv")) != -1)
 	{
 		switch(c)
 		{
@@ -169,6 +227,9 @@ int main(int argc, char* argv[])
 			daemon = false;
 			daemon_set = true;
 			break;
+		case 'r':
+			takeover = true;
+			break;
 		case 'c':
 			config_path = std::string(optarg);
 
@@ -213,6 +274,14 @@ int main(int argc, char* argv[])
 
 		return ERV_LOG_INIT_FAIL;
 	}
+	
+	DEBUG_MSG("Startup: configuration and logging initialised after %llums", edna_uptime_ms());
+	
+	/* Use sockets passed by a service manager (these are only meant for the process it started) */
+	if (!takeover)
+	{
+		edna_activation_receive(activated);
+	}
 
 	/* Determine configuration settings that were not specified on the command line */
 	if (!pid_path_set)
@@ -269,6 +338,17 @@ int main(int argc, char* argv[])
 	/* If we forked, this is the child */
 	INFO_MSG("Starting the Emulator Daemon for NFC Applications (edna) version %s", VERSION);
 	INFO_MSG("edna %sprocess ID is %d", daemon ? "daemon " : "", getpid());
+	
+	/* Take over the sockets of the running daemon, if requested */
+	if (takeover && !edna_handoff_receive(handed_over, old_pid))
+	{
+		ERROR_MSG("Failed to take over from the running daemon, exiting");
+		
+		edna_uninit_config_handling();
+		edna_uninit_log();
+		
+		return ERV_GENERAL_ERROR;
+	}
 
 	/* Install signal handlers */
 	signal(SIGABRT, signal_unexpected);
@@ -288,12 +368,99 @@ int main(int argc, char* argv[])
 	/* Launch communications thread*/
 	comm_thread = new edna_comm_thread();
 	
+	if (takeover)
+	{
+		comm_thread->adopt(handed_over);
+	}
+	else if (!activated.empty())
+	{
+		comm_thread->adopt(activated, true);
+	}
+	
+	comm_thread->set_handoff_callback(handoff_complete);
+	
+	/* Relay AIDs to a physical card, if configured */
+	std::shared_ptr<edna_relay> relay(new edna_relay());
+	
+	if (relay->load_config())
+	{
+		comm_thread->register_relay(relay);
+	}
+	
+	/* Create the reader manager first so a handoff can always cancel it */
+	reader_manager = new edna_reader_manager(comm_thread);
+	
+	/* Listen before anything else so clients can register while the reader comes up */
+	comm_thread->open_listeners();
+	
+	INFO_MSG("Startup: accepting applications after %llums", edna_uptime_ms());
+	
 	comm_thread->start();
 	
-	/* Run emulation */
-	emulator = new edna_emulator(comm_thread);
+	/* Expose the applications to local PC/SC applications, if enabled */
+	loopback = new edna_loopback(comm_thread);
+	
+	if (loopback->open_listener())
+	{
+		loopback->start();
+	}
+	else
+	{
+		delete loopback;
+		loopback = NULL;
+	}
+	
+	/* Launch supervised applets, if any */
+	supervisor = new edna_supervisor();
+	
+	bool supervising = supervisor->load_config();
+	
+	/* Keep the applets the old daemon was running; those no longer configured are stopped */
+	if (takeover)
+	{
+		supervisor->adopt(handed_over);
+	}
+	
+	if (supervising)
+	{
+		comm_thread->set_supervisor(supervisor);
+		
+		supervisor->start();
+	}
+	else
+	{
+		delete supervisor;
+		supervisor = NULL;
+	}
+	
+	/* The reader can only be used once the old daemon has let go of it */
+	if (takeover)
+	{
+		wait_for_old_daemon(old_pid);
+	}
+	
+	/* Run emulation on all readers */
+	reader_manager->run();
 	
-	emulator->run();
+	/* Stop supervised applets, unless they were handed over to a new daemon */
+	if (supervisor != NULL)
+	{
+		comm_thread->set_supervisor(NULL);
+		
+		supervisor->terminate();
+		
+		delete supervisor;
+		supervisor = NULL;
+	}
+	
+	/* Stop the loopback reader before the sessions it uses go away */
+	if (loopback != NULL)
+	{
+		loopback->terminate();
+		
+		delete loopback;
+		loopback = NULL;
+	}
 	
 	/* Terminate communications thread */
 	comm_thread->terminate();
@@ -301,11 +468,11 @@ int main(int argc, char* argv[])
 	edna_comm_thread* ct_to_delete = comm_thread;
 	comm_thread = NULL;
 	
-	edna_emulator* emu_to_delete = emulator;
-	emulator = NULL;
+	edna_reader_manager* rm_to_delete = reader_manager;
+	reader_manager = NULL;
 	
 	delete ct_to_delete;
-	delete emu_to_delete;
+	delete rm_to_delete;
 	
 	/* Tell the world we're exiting */
 	INFO_MSG("The Emulator Daemon for NFC Applications (edna) version %s has now stopped", VERSION);
@@ -0,0 +1,48 @@
+/*
+ * Copyright (c) 2013 Roland van Rijswijk-Deij
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+ * IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * The Emulator Daemon for NFC Applications (EDNA)
+ * SpringCard NFC'Roll escape commands
+ */
+
+#ifndef _EDNA_NFCROLL_H
+#define _EDNA_NFCROLL_H
+
+#include "config.h"
+#include "edna_hex.h"
+
+/* Escape commands, built at compile time */
+constexpr auto NFCROLL_WAIT_EVENT		= edna_hex("83000000");	/* bytes 2 and 3 hold the timeout in ms */
+constexpr auto NFCROLL_START_EMU		= edna_hex("83100100");
+constexpr auto NFCROLL_END_EMU			= edna_hex("83100000");
+constexpr auto NFCROLL_GET_CAPDU		= edna_hex("84");		/* on its own, retrieves the C-APDU */
+constexpr auto NFCROLL_SEND_RAPDU		= edna_hex("84");		/* followed by an R-APDU, sends it */
+constexpr auto NFCROLL_BUZZER_OFF		= edna_hex("588dcc00");
+constexpr auto NFCROLL_SET_ATQ_SAK		= edna_hex("588de3");	/* followed by the ATQ and the SAK */
+
+#endif /* !_EDNA_NFCROLL_H */
@@ -0,0 +1,82 @@
+/*
+ * Copyright (c) 2013 Roland van Rijswijk-Deij
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+ * IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * The Emulator Daemon for NFC Applications (EDNA)
+ * Reader backend interface
+ */
+
+#include "config.h"
+#include "edna_reader.h"
+#include "edna_reader_pcsc.h"
+#include "edna_reader_sim.h"
+#include "edna_config.h"
+#include "edna_log.h"
+#include <string>
+
+/*virtual*/ edna_reader::~edna_reader()
+{
+}
+
+/*static*/ edna_reader* edna_reader::create(const std::string& reader_name /* = "" */)
+{
+	std::string backend;
+	
+	if (edna_conf_get_string("emulation", "backend", backend, "pcsc") != ERV_OK)
+	{
+		ERROR_MSG("Error reading reader backend from configuration file");
+		
+		return NULL;
+	}
+	
+	if (backend == "pcsc")
+	{
+		return new edna_reader_pcsc(reader_name);
+	}
+	else if (backend == "sim")
+	{
+		return new edna_reader_sim();
+	}
+	
+	ERROR_MSG("Unknown reader backend '%s' in the configuration", backend.c_str());
+	
+	return NULL;
+}
+
+/*virtual*/ void edna_reader::cancel()
+{
+}
+
+/*virtual*/ bool edna_reader::finished()
+{
+	return false;
+}
+
+/*virtual*/ bool edna_reader::direct_capdu_fetch()
+{
+	return false;
+}
@@ -0,0 +1,106 @@
+/*
+ * Copyright (c) 2013 Roland van Rijswijk-Deij
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+ * IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * The Emulator Daemon for NFC Applications (EDNA)
+ * Reader backend interface
+ */
+
+#ifndef _EDNA_READER_H
+#define _EDNA_READER_H
+
+#include "config.h"
+#include "edna_bytestring.h"
+#include <string>
+
+/*
+ * A reader backend exchanges SpringCard NFC'Roll control commands
+ * (escape commands) with an emulation device
+ */
+class edna_reader
+{
+public:
+	/**
+	 * Destructor
+	 */
+	virtual ~edna_reader();
+	
+	/**
+	 * Create the reader backend specified in the configuration
+	 * @param reader_name the reader to use (ignored by the simulator); if
+	 *                    empty, the reader specified in the configuration is used
+	 * @return the reader backend, or NULL if the configuration is invalid
+	 */
+	static edna_reader* create(const std::string& reader_name = "");
+	
+	/**
+	 * Connect to the reader
+	 * @return true if the reader is ready to accept control commands
+	 */
+	virtual bool connect() = 0;
+	
+	/**
+	 * Disconnect from the reader
+	 */
+	virtual void disconnect() = 0;
+	
+	/**
+	 * Exchange a control command
+	 * @param cmd the control command to send
+	 * @param rdata the data returned by the reader
+	 * @return true if the control command was exchanged successfully
+	 */
+	virtual bool control(const bytestring& cmd, bytestring& rdata) = 0;
+	
+	/**
+	 * Abort a pending control command (may be called from another thread)
+	 */
+	virtual void cancel();
+	
+	/**
+	 * Check if the reader has no more events to deliver (e.g. because a
+	 * simulation has ended)
+	 * @return true if emulation should stop
+	 */
+	virtual bool finished();
+	
+	/**
+	 * Check if the next C-APDU may be requested right after sending an
+	 * R-APDU, without waiting for the completion and C-APDU events; the
+	 * reader answers status 0x03 if the terminal has not sent one yet
+	 * @return true if direct C-APDU retrieval is supported
+	 */
+	virtual bool direct_capdu_fetch();
+	
+	/**
+	 * Get the name of the reader
+	 * @return the reader name
+	 */
+	virtual const std::string& name() = 0;
+};
+
+#endif /* !_EDNA_READER_H */
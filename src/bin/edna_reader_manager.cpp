@@ -0,0 +1,351 @@
+/*
+ * Copyright (c) 2013 Roland van Rijswijk-Deij
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+ * IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * The Emulator Daemon for NFC Applications (EDNA)
+ * Reader manager; runs an emulator on every matching reader and follows
+ * readers being plugged in and removed
+ */
+
+#include "config.h"
+#include "edna_reader_manager.h"
+#include "edna_config.h"
+#include "edna_log.h"
+#include "edna_time.h"
+#include <unistd.h>
+#include <string.h>
+#include <string>
+#include <set>
+
+#define RESCAN_INTERVAL				1000		/* ms between checks for new and stopped readers */
+#define MAX_START_BACKOFF			30000		/* ms between attempts to start emulation on a failing reader */
+#define MAX_START_FAILURES			5			/* attempts before waiting for the reader to be replugged */
+#define PNP_NOTIFICATION			"\\\\?PnP?\\Notification"
+
+edna_reader_manager::edna_reader_manager(edna_comm_thread* comm_thread)
+{
+	this->comm_thread = comm_thread;
+	pcsc_context = 0;
+	have_context = false;
+	hotplug = false;
+	should_cancel = false;
+}
+
+edna_reader_manager::~edna_reader_manager()
+{
+	stop_emulators();
+	
+	if (have_context)
+	{
+		SCardReleaseContext(pcsc_context);
+	}
+}
+
+void edna_reader_manager::run()
+{
+	std::string backend;
+	
+	edna_conf_get_string("emulation", "backend", backend, "pcsc");
+	
+	/* The simulator is a single reader that cannot be plugged in or removed */
+	if (backend == "pcsc")
+	{
+		if (edna_conf_get_string_array("emulation", "readers", reader_prefixes) != ERV_OK)
+		{
+			ERROR_MSG("Emulation readers must be specified as a list of strings");
+			
+			return;
+		}
+		
+		if (reader_prefixes.empty())
+		{
+			std::string reader_name;
+			
+			if ((edna_conf_get_string("emulation", "reader", reader_name, NULL) != ERV_OK) || reader_name.empty())
+			{
+				ERROR_MSG("No smart card reader configured, giving up!");
+				
+				return;
+			}
+			
+			reader_prefixes.push_back(reader_name);
+		}
+		
+		if (SCardEstablishContext(SCARD_SCOPE_USER, NULL, NULL, &pcsc_context) != SCARD_S_SUCCESS)
+		{
+			ERROR_MSG("Failed to establish a PC/SC context, giving up!");
+			
+			return;
+		}
+		
+		have_context = true;
+		hotplug = true;
+	}
+	
+	if (!hotplug)
+	{
+		start_emulator("");
+		
+		while (!should_cancel && !emulators.empty())
+		{
+			reap_emulators();
+			
+			usleep(RESCAN_INTERVAL * 1000);
+		}
+	}
+	else
+	{
+		while (!should_cancel)
+		{
+			reap_emulators();
+			
+			DWORD reader_count = scan_readers();
+			
+			if (should_cancel) break;
+			
+			wait_for_change(reader_count);
+		}
+	}
+	
+	stop_emulators();
+}
+
+void edna_reader_manager::cancel()
+{
+	should_cancel = true;
+	
+	if (have_context)
+	{
+		SCardCancel(pcsc_context);
+	}
+}
+
+void edna_reader_manager::start_emulator(const std::string& name)
+{
+	edna_emulator* emulator = new edna_emulator(comm_thread, name);
+	
+	if (!emulator->start())
+	{
+		ERROR_MSG("Failed to start emulation%s%s", name.empty() ? "" : " on reader ", name.c_str());
+		
+		delete emulator;
+		
+		return;
+	}
+	
+	emulators[name] = emulator;
+}
+
+void edna_reader_manager::reap_emulators()
+{
+	std::map<std::string, edna_emulator*>::iterator i = emulators.begin();
+	
+	while (i != emulators.end())
+	{
+		if (i->second->stopped())
+		{
+			if (!i->first.empty())
+			{
+				INFO_MSG("Emulation on reader %s has stopped", i->first.c_str());
+				
+				/* A reader that never entered emulation mode (e.g. not an NFC'Roll) would fail again straight away */
+				if (i->second->was_ready())
+				{
+					failed_readers.erase(i->first);
+				}
+				else
+				{
+					start_failed(i->first);
+				}
+			}
+			
+			i->second->terminate();
+			
+			delete i->second;
+			
+			emulators.erase(i++);
+		}
+		else
+		{
+			i++;
+		}
+	}
+}
+
+void edna_reader_manager::stop_emulators()
+{
+	for (std::map<std::string, edna_emulator*>::iterator i = emulators.begin(); i != emulators.end(); i++)
+	{
+		i->second->terminate();
+		
+		delete i->second;
+	}
+	
+	emulators.clear();
+}
+
+DWORD edna_reader_manager::scan_readers()
+{
+	std::vector<char> readers(1, '\0');
+	DWORD readers_len = 0;
+	LONG pcsc_rv = SCardListReaders(pcsc_context, NULL, NULL, &readers_len);
+	
+	if ((pcsc_rv == SCARD_S_SUCCESS) && (readers_len > 0))
+	{
+		readers.resize(readers_len);
+		
+		/* The list may have changed in between; try again at the next scan */
+		if (SCardListReaders(pcsc_context, NULL, &readers[0], &readers_len) != SCARD_S_SUCCESS)
+		{
+			return 0;
+		}
+	}
+	else if (pcsc_rv != SCARD_E_NO_READERS_AVAILABLE)
+	{
+		WARNING_MSG("Failed to list PC/SC readers (0x%08X)", (unsigned int) pcsc_rv);
+		
+		return 0;
+	}
+	
+	/* The reader names form a multi-string, terminated by an empty string */
+	std::set<std::string> present;
+	
+	for (const char* name = &readers[0]; (*name != '\0') && (name < &readers[0] + readers.size()); name += strlen(name) + 1)
+	{
+		present.insert(name);
+		
+		std::map<std::string, start_failures>::iterator failed = failed_readers.find(name);
+		
+		if ((failed != failed_readers.end()) && (failed->second.gave_up || (edna_time_ms() < failed->second.retry_at)))
+		{
+			continue;
+		}
+		
+		if (matches(name) && (emulators.find(name) == emulators.end()))
+		{
+			INFO_MSG("Starting emulation on reader %s", name);
+			
+			start_emulator(name);
+		}
+	}
+	
+	/* Replugging a reader gives it a fresh start */
+	std::map<std::string, start_failures>::iterator f = failed_readers.begin();
+	
+	while (f != failed_readers.end())
+	{
+		if (present.find(f->first) == present.end())
+		{
+			failed_readers.erase(f++);
+		}
+		else
+		{
+			f++;
+		}
+	}
+	
+	/* Emulators on readers that were removed would otherwise keep trying to recover them */
+	for (std::map<std::string, edna_emulator*>::iterator i = emulators.begin(); i != emulators.end(); i++)
+	{
+		if ((present.find(i->first) == present.end()) && !i->second->stopped())
+		{
+			INFO_MSG("Reader %s was removed", i->first.c_str());
+			
+			i->second->cancel();
+		}
+	}
+	
+	return present.size();
+}
+
+void edna_reader_manager::start_failed(const std::string& name)
+{
+	std::map<std::string, start_failures>::iterator i = failed_readers.find(name);
+	
+	if (i == failed_readers.end())
+	{
+		start_failures failures = { 0, 0, false };
+		
+		i = failed_readers.insert(std::make_pair(name, failures)).first;
+	}
+	
+	i->second.count++;
+	
+	if (i->second.count >= MAX_START_FAILURES)
+	{
+		WARNING_MSG("Emulation failed to start on reader %s %d times, not trying again until it is replugged", name.c_str(), i->second.count);
+		
+		i->second.gave_up = true;
+		
+		return;
+	}
+	
+	unsigned long long backoff = (unsigned long long) RESCAN_INTERVAL << i->second.count;
+	
+	if (backoff > MAX_START_BACKOFF) backoff = MAX_START_BACKOFF;
+	
+	i->second.retry_at = edna_time_ms() + backoff;
+	
+	INFO_MSG("Retrying emulation on reader %s in %llums", name.c_str(), backoff);
+}
+
+void edna_reader_manager::wait_for_change(DWORD reader_count)
+{
+	/* The upper 16 bits of the PnP state hold the number of readers last seen */
+	SCARD_READERSTATE pnp_state;
+	
+	memset(&pnp_state, 0, sizeof(pnp_state));
+	
+	pnp_state.szReader = PNP_NOTIFICATION;
+	pnp_state.dwCurrentState = reader_count << 16;
+	
+	LONG pcsc_rv = SCardGetStatusChange(pcsc_context, RESCAN_INTERVAL, &pnp_state, 1);
+	
+	switch(pcsc_rv)
+	{
+	case SCARD_S_SUCCESS:
+		DEBUG_MSG("PC/SC reader list changed");
+		break;
+	case SCARD_E_TIMEOUT:
+	case SCARD_E_CANCELLED:
+		break;
+	default:
+		/* Plug and play notification not supported, fall back to polling */
+		usleep(RESCAN_INTERVAL * 1000);
+		break;
+	}
+}
+
+bool edna_reader_manager::matches(const std::string& name)
+{
+	for (std::vector<std::string>::iterator i = reader_prefixes.begin(); i != reader_prefixes.end(); i++)
+	{
+		if (name.compare(0, i->size(), *i) == 0) return true;
+	}
+	
+	return false;
+}
@@ -0,0 +1,129 @@
+/*
+ * Copyright (c) 2013 Roland van Rijswijk-Deij
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+ * IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * The Emulator Daemon for NFC Applications (EDNA)
+ * Reader manager; runs an emulator on every matching reader and follows
+ * readers being plugged in and removed
+ */
+
+#ifndef _EDNA_READER_MANAGER_H
+#define _EDNA_READER_MANAGER_H
+
+#include "config.h"
+#include "edna_comm.h"
+#include "edna_emu.h"
+#include <winscard.h>
+#include <map>
+#include <vector>
+#include <string>
+
+class edna_reader_manager
+{
+public:
+	/**
+	 * Constructor
+	 * @param comm_thread pointer to the communications thread
+	 */
+	edna_reader_manager(edna_comm_thread* comm_thread);
+	
+	/**
+	 * Destructor
+	 */
+	~edna_reader_manager();
+	
+	/**
+	 * Run emulation on all matching readers until cancelled
+	 */
+	void run();
+	
+	/**
+	 * Cancel emulation (safe to call from a signal handler)
+	 */
+	void cancel();
+	
+private:
+	/**
+	 * Start an emulator on a reader
+	 * @param name the reader name
+	 */
+	void start_emulator(const std::string& name);
+	
+	/**
+	 * Clean up emulators that have stopped (e.g. because their reader was removed)
+	 */
+	void reap_emulators();
+	
+	/**
+	 * Stop all emulators
+	 */
+	void stop_emulators();
+	
+	/**
+	 * Start emulators on matching readers that are not in use yet
+	 * @return the number of readers known to PC/SC
+	 */
+	DWORD scan_readers();
+	
+	/**
+	 * Wait for a reader to be plugged in or removed
+	 * @param reader_count the number of readers at the last scan
+	 */
+	void wait_for_change(DWORD reader_count);
+	
+	/**
+	 * Check if a reader should be used for emulation
+	 * @param name the reader name
+	 * @return true if the name starts with one of the configured prefixes
+	 */
+	bool matches(const std::string& name);
+	
+	/**
+	 * Back off from a reader on which emulation failed to start
+	 * @param name the reader name
+	 */
+	void start_failed(const std::string& name);
+	
+	/* Readers on which emulation failed to start, until they are removed */
+	struct start_failures
+	{
+		int count;
+		unsigned long long retry_at;	/* edna_time_ms() */
+		bool gave_up;
+	};
+	
+	edna_comm_thread* comm_thread;
+	std::map<std::string, edna_emulator*> emulators;
+	std::map<std::string, start_failures> failed_readers;
+	std::vector<std::string> reader_prefixes;
+	SCARDCONTEXT pcsc_context;
+	bool have_context;
+	bool hotplug;
+	bool should_cancel;
+};
+
+#endif /* !_EDNA_READER_MANAGER_H */
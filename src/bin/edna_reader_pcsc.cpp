@@ -0,0 +1,152 @@
+/*
+ * Copyright (c) 2013 Roland van Rijswijk-Deij
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+ * IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * The Emulator Daemon for NFC Applications (EDNA)
+ * PC/SC reader backend
+ */
+
+#include "config.h"
+#include "edna_reader_pcsc.h"
+#include "edna_config.h"
+#include "edna_log.h"
+#include <winscard.h>
+#include <reader.h>
+#include <string>
+
+#define IOCTL_CCID_ESCAPE_DIRECT	SCARD_CTL_CODE(1)
+#define MAX_CONTROL_RSP				512
+
+edna_reader_pcsc::edna_reader_pcsc(const std::string& reader_name)
+{
+	this->reader_name = reader_name;
+	pcsc_context = 0;
+	pcsc_reader = 0;
+	connected = false;
+	
+	/* Whether the reader firmware hands out C-APDUs without a preceding event */
+	edna_conf_get_bool("emulation", "direct_capdu_fetch", direct_fetch, false);
+}
+
+/*virtual*/ edna_reader_pcsc::~edna_reader_pcsc()
+{
+	disconnect();
+}
+
+/*virtual*/ bool edna_reader_pcsc::connect()
+{
+	/* Determine the card reader to connect to, unless it was specified by the reader manager */
+	if (reader_name.empty() &&
+	    ((edna_conf_get_string("emulation", "reader", reader_name, NULL) != ERV_OK) || reader_name.empty()))
+	{
+		ERROR_MSG("No smart card reader configured, giving up!");
+		
+		return false;
+	}
+	
+	/* Establish PC/SC context and connect to the card reader */
+	DWORD pcsc_rv;
+	DWORD active_protocol;
+	
+	if ((pcsc_rv = SCardEstablishContext(SCARD_SCOPE_USER, NULL, NULL, &pcsc_context)) != SCARD_S_SUCCESS)
+	{
+		ERROR_MSG("Failed to establish a PC/SC context, giving up!");
+		
+		return false;
+	}
+	
+	if ((pcsc_rv = SCardConnect(pcsc_context, reader_name.c_str(), SCARD_SHARE_DIRECT, SCARD_PROTOCOL_T0 | SCARD_PROTOCOL_T1, &pcsc_reader, &active_protocol)) != SCARD_S_SUCCESS)
+	{
+		ERROR_MSG("Failed to connect to PC/SC reader %s", reader_name.c_str());
+		
+		SCardReleaseContext(pcsc_context);
+		
+		pcsc_context = 0;
+		
+		return false;
+	}
+	
+	connected = true;
+	
+	INFO_MSG("Connected to PC/SC reader %s", reader_name.c_str());
+	
+	return true;
+}
+
+/*virtual*/ void edna_reader_pcsc::disconnect()
+{
+	if (!connected) return;
+	
+	/* Disconnect from reader and release PC/SC context */
+	SCardDisconnect(pcsc_reader, SCARD_UNPOWER_CARD);
+	
+	SCardReleaseContext(pcsc_context);
+	
+	connected = false;
+	pcsc_context = 0;
+	
+	INFO_MSG("Disconnected from PC/SC reader %s", reader_name.c_str());
+}
+
+/*virtual*/ bool edna_reader_pcsc::control(const bytestring& cmd, bytestring& rdata)
+{
+	DWORD pcsc_rv;
+	DWORD rlen;
+	
+	if (!connected) return false;
+	
+	rdata.resize(MAX_CONTROL_RSP);
+	
+	if ((pcsc_rv = SCardControl(pcsc_reader, IOCTL_CCID_ESCAPE_DIRECT, cmd.const_byte_str(), cmd.size(), rdata.byte_str(), MAX_CONTROL_RSP, &rlen)) != SCARD_S_SUCCESS)
+	{
+		ERROR_MSG("Failed to exchange control command (0x%08X)", pcsc_rv);
+		
+		return false;
+	}
+	
+	rdata.resize(rlen);
+	
+	return true;
+}
+
+/*virtual*/ void edna_reader_pcsc::cancel()
+{
+	if (pcsc_context != 0)
+	{
+		SCardCancel(pcsc_context);
+	}
+}
+
+/*virtual*/ bool edna_reader_pcsc::direct_capdu_fetch()
+{
+	return direct_fetch;
+}
+
+/*virtual*/ const std::string& edna_reader_pcsc::name()
+{
+	return reader_name;
+}
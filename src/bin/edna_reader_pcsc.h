@@ -0,0 +1,76 @@
+/*
+ * Copyright (c) 2013 Roland van Rijswijk-Deij
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+ * IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * The Emulator Daemon for NFC Applications (EDNA)
+ * PC/SC reader backend
+ */
+
+#ifndef _EDNA_READER_PCSC_H
+#define _EDNA_READER_PCSC_H
+
+#include "config.h"
+#include "edna_reader.h"
+#include <winscard.h>
+#include <string>
+
+class edna_reader_pcsc : public edna_reader
+{
+public:
+	/**
+	 * Constructor
+	 * @param reader_name the PC/SC reader to use; if empty, the reader
+	 *                    specified in the configuration is used
+	 */
+	edna_reader_pcsc(const std::string& reader_name);
+	
+	/**
+	 * Destructor
+	 */
+	virtual ~edna_reader_pcsc();
+	
+	virtual bool connect();
+	
+	virtual void disconnect();
+	
+	virtual bool control(const bytestring& cmd, bytestring& rdata);
+	
+	virtual void cancel();
+	
+	virtual bool direct_capdu_fetch();
+	
+	virtual const std::string& name();
+	
+private:
+	std::string reader_name;
+	SCARDCONTEXT pcsc_context;
+	SCARDHANDLE pcsc_reader;
+	bool connected;
+	bool direct_fetch;
+};
+
+#endif /* !_EDNA_READER_PCSC_H */
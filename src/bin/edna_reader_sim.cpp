@@ -0,0 +1,441 @@
+/*
+ * Copyright (c) 2013 Roland van Rijswijk-Deij
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+ * IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * The Emulator Daemon for NFC Applications (EDNA)
+ * Simulated SpringCard NFC'Roll reader backend
+ */
+
+#include "config.h"
+#include "edna_reader_sim.h"
+#include "edna_config.h"
+#include "edna_log.h"
+#include "edna_time.h"
+#include "edna_apdu.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+
+/* NFC'Roll event codes returned by the wait event command */
+#define EVENT_NONE			0x00
+#define EVENT_SELECT		0x01
+#define EVENT_CAPDU			0x02
+#define EVENT_RAPDU_DONE	0x03
+#define EVENT_DESELECT		0x04
+
+/* NFC'Roll status codes */
+#define STATUS_OK			0x00
+#define STATUS_NO_CAPDU		0x03
+#define STATUS_WRONG_MODE	0x3B
+
+#define MAX_LINE			4096
+
+/* Check that a string is a valid hexadecimal byte string */
+static bool is_hex(const std::string& hex)
+{
+	return !hex.empty() && (hex.size() % 2 == 0) && (strspn(hex.c_str(), "0123456789abcdefABCDEF") == hex.size());
+}
+
+edna_reader_sim::edna_reader_sim()
+{
+	repeat = 1;
+	pos = 0;
+	iteration = 0;
+	waiting = false;
+	wait_until = 0;
+	done = false;
+	emulating = false;
+	capdu_pending = false;
+	rapdu_outstanding = false;
+	rapdu_complete = false;
+	vclock = 0;
+	reported = false;
+	start_us = 0;
+	capdu_us = 0;
+	total_latency_us = 0;
+	max_latency_us = 0;
+	apdu_count = 0;
+	mismatch_count = 0;
+	field_count = 0;
+}
+
+/*virtual*/ edna_reader_sim::~edna_reader_sim()
+{
+}
+
+bool edna_reader_sim::load_script(const std::string& script_path)
+{
+	FILE* script_file = fopen(script_path.c_str(), "r");
+	
+	if (script_file == NULL)
+	{
+		ERROR_MSG("Failed to open simulation script %s", script_path.c_str());
+		
+		return false;
+	}
+	
+	char line[MAX_LINE];
+	int line_no = 0;
+	bool rv = true;
+	
+	while (fgets(line, MAX_LINE, script_file) != NULL)
+	{
+		line_no++;
+		
+		/* Strip comments */
+		char* comment = strchr(line, '#');
+		
+		if (comment != NULL) *comment = '\0';
+		
+		char keyword[32] = { 0 };
+		char arg1[MAX_LINE] = { 0 };
+		char arg2[MAX_LINE] = { 0 };
+		
+		int fields = sscanf(line, "%31s %4095s %4095s", keyword, arg1, arg2);
+		
+		if (fields <= 0) continue;
+		
+		edna_sim_step step;
+		
+		if (!strcmp(keyword, "wait") && (fields == 2))
+		{
+			step.type = SIM_WAIT;
+			step.wait_ms = strtoul(arg1, NULL, 10);
+		}
+		else if (!strcmp(keyword, "select") && (fields == 1))
+		{
+			step.type = SIM_SELECT;
+		}
+		else if (!strcmp(keyword, "deselect") && (fields == 1))
+		{
+			step.type = SIM_DESELECT;
+		}
+		else if (!strcmp(keyword, "apdu") && is_hex(arg1) && ((fields == 2) || is_hex(arg2)))
+		{
+			step.type = SIM_APDU;
+			step.capdu = bytestring(arg1);
+			
+			if (fields == 3)
+			{
+				step.expect = bytestring(arg2);
+			}
+		}
+		else
+		{
+			ERROR_MSG("Invalid statement on line %d of simulation script %s", line_no, script_path.c_str());
+			
+			rv = false;
+			
+			break;
+		}
+		
+		script.push_back(step);
+	}
+	
+	fclose(script_file);
+	
+	return rv;
+}
+
+/*virtual*/ bool edna_reader_sim::connect()
+{
+	std::string script_path;
+	
+	if ((edna_conf_get_string("emulation", "sim_script", script_path, NULL) != ERV_OK) || script_path.empty())
+	{
+		ERROR_MSG("No simulation script configured, giving up!");
+		
+		return false;
+	}
+	
+	if ((edna_conf_get_int("emulation", "sim_repeat", repeat, 1) != ERV_OK) || (repeat < 1))
+	{
+		ERROR_MSG("Invalid simulation repeat count in the configuration");
+		
+		return false;
+	}
+	
+	if (!load_script(script_path))
+	{
+		return false;
+	}
+	
+	reader_name = "simulated NFC'Roll (" + script_path + ")";
+	
+	INFO_MSG("Loaded simulation script %s with %zd step(s), running it %d time(s)", script_path.c_str(), script.size(), repeat);
+	
+	done = script.empty();
+	start_us = edna_time_us();
+	
+	return true;
+}
+
+/*virtual*/ void edna_reader_sim::disconnect()
+{
+	report();
+}
+
+unsigned char edna_reader_sim::next_event(unsigned long timeout)
+{
+	/* The reader first signals completion of the previous exchange */
+	if (rapdu_complete)
+	{
+		rapdu_complete = false;
+		
+		return EVENT_RAPDU_DONE;
+	}
+	
+	/* A C-APDU that has not been retrieved yet is signalled again */
+	if (capdu_pending)
+	{
+		return EVENT_CAPDU;
+	}
+	
+	/*
+	 * The terminal waits for the response to the retrieved C-APDU; this
+	 * takes real time, as delayed R-APDUs are released in real time
+	 */
+	if (rapdu_outstanding)
+	{
+		usleep(timeout * 1000);
+		
+		vclock += timeout;
+		
+		return EVENT_NONE;
+	}
+	
+	while (!done)
+	{
+		if (pos >= script.size())
+		{
+			pos = 0;
+			
+			if (++iteration >= repeat)
+			{
+				done = true;
+				
+				report();
+				
+				break;
+			}
+			
+			continue;
+		}
+		
+		edna_sim_step& step = script[pos];
+		
+		switch(step.type)
+		{
+		case SIM_WAIT:
+			if (!waiting)
+			{
+				wait_until = vclock + step.wait_ms;
+				waiting = true;
+			}
+			
+			if (vclock + timeout < wait_until)
+			{
+				/* The wait command times out before the next event */
+				vclock += timeout;
+				
+				return EVENT_NONE;
+			}
+			
+			vclock = wait_until;
+			waiting = false;
+			pos++;
+			break;
+		case SIM_SELECT:
+			pos++;
+			field_count++;
+			
+			return EVENT_SELECT;
+		case SIM_DESELECT:
+			pos++;
+			
+			return EVENT_DESELECT;
+		case SIM_APDU:
+			capdu = step.capdu;
+			expect = step.expect;
+			capdu_pending = true;
+			capdu_us = edna_time_us();
+			pos++;
+			
+			return EVENT_CAPDU;
+		}
+	}
+	
+	/* Nothing left to do; the time still passes */
+	vclock += timeout;
+	
+	return EVENT_NONE;
+}
+
+/*virtual*/ bool edna_reader_sim::control(const bytestring& cmd, bytestring& rdata)
+{
+	rdata.resize(0);
+	
+	if (cmd.size() < 1)
+	{
+		return false;
+	}
+	
+	const unsigned char* cmd_bytes = cmd.const_byte_str();
+	
+	switch(cmd_bytes[0])
+	{
+	case 0x83:
+		if ((cmd.size() == 4) && (cmd_bytes[1] == 0x10))
+		{
+			/* Start or stop emulation */
+			emulating = (cmd_bytes[2] != 0x00);
+			
+			rdata += (unsigned char) STATUS_OK;
+		}
+		else if ((cmd.size() == 4) && (cmd_bytes[1] == 0x00))
+		{
+			/* Wait for an event; bytes 2 and 3 are the timeout in ms */
+			if (!emulating)
+			{
+				rdata += (unsigned char) STATUS_WRONG_MODE;
+				
+				break;
+			}
+			
+			rdata += (unsigned char) STATUS_OK;
+			rdata += next_event((cmd_bytes[2] << 8) + cmd_bytes[3]);
+			rdata += (unsigned char) 0x00;
+		}
+		else
+		{
+			return false;
+		}
+		break;
+	case 0x84:
+		if (!emulating)
+		{
+			rdata += (unsigned char) STATUS_WRONG_MODE;
+		}
+		else if (cmd.size() == 1)
+		{
+			/* A command that directly follows the previous response can be retrieved without events */
+			if (!capdu_pending && rapdu_complete && !waiting && (pos < script.size()) && (script[pos].type == SIM_APDU))
+			{
+				rapdu_complete = false;
+				
+				next_event(0);
+			}
+			
+			/* Retrieve the C-APDU */
+			if (!capdu_pending)
+			{
+				rdata += (unsigned char) STATUS_NO_CAPDU;
+				
+				break;
+			}
+			
+			rdata += (unsigned char) STATUS_OK;
+			rdata += capdu;
+			
+			capdu_pending = false;
+			rapdu_outstanding = true;
+		}
+		else
+		{
+			/* Send the R-APDU */
+			unsigned long long latency = edna_time_us() - capdu_us;
+			bytestring_view rapdu = bytestring_view(cmd).substr(1);
+			
+			apdu_count++;
+			total_latency_us += latency;
+			
+			if (latency > max_latency_us) max_latency_us = latency;
+			
+			if ((expect.size() > 0) &&
+			    (((expect.size() == 2) && (edna_apdu::status_word(rapdu) != edna_apdu::status_word(expect))) ||
+			     ((expect.size() != 2) && (rapdu != expect))))
+			{
+				WARNING_MSG("Simulated C-APDU %s: expected %s, got %s", capdu.hex_str().c_str(), expect.hex_str().c_str(), rapdu.hex_str().c_str());
+				
+				mismatch_count++;
+			}
+			
+			rapdu_outstanding = false;
+			rapdu_complete = true;
+			
+			rdata += (unsigned char) STATUS_OK;
+		}
+		break;
+	case 0x58:
+		/* Reader configuration (ATQ/SAK, buzzer); accepted as is */
+		rdata += (unsigned char) STATUS_OK;
+		break;
+	default:
+		ERROR_MSG("Simulated reader does not support control command %s", cmd.hex_str().c_str());
+		
+		return false;
+	}
+	
+	return true;
+}
+
+/*virtual*/ bool edna_reader_sim::finished()
+{
+	return done && !capdu_pending && !rapdu_outstanding && !rapdu_complete;
+}
+
+/*virtual*/ bool edna_reader_sim::direct_capdu_fetch()
+{
+	return true;
+}
+
+/*virtual*/ const std::string& edna_reader_sim::name()
+{
+	return reader_name;
+}
+
+void edna_reader_sim::report()
+{
+	if (reported || (start_us == 0)) return;
+	
+	reported = true;
+	
+	unsigned long long wall_us = edna_time_us() - start_us;
+	
+	INFO_MSG("Simulation: %lu field session(s), %lu APDU(s), %lu mismatch(es) in %llums virtual time", field_count, apdu_count, mismatch_count, vclock);
+	
+	if ((apdu_count > 0) && (wall_us > 0))
+	{
+		INFO_MSG("Simulation: %llu.%03llums wall time, %llu APDU/s, latency avg %lluus max %lluus",
+			wall_us / 1000, wall_us % 1000,
+			(unsigned long long) apdu_count * 1000000ULL / wall_us,
+			total_latency_us / apdu_count, max_latency_us);
+	}
+}
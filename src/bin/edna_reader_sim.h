@@ -0,0 +1,140 @@
+/*
+ * Copyright (c) 2013 Roland van Rijswijk-Deij
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+ * IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * The Emulator Daemon for NFC Applications (EDNA)
+ * Simulated SpringCard NFC'Roll reader backend
+ */
+
+#ifndef _EDNA_READER_SIM_H
+#define _EDNA_READER_SIM_H
+
+#include "config.h"
+#include "edna_reader.h"
+#include "edna_bytestring.h"
+#include "edna_apdu_buf.h"
+#include <string>
+#include <vector>
+
+/* Simulation script steps */
+#define SIM_WAIT			0			/* let virtual time pass without events */
+#define SIM_SELECT			1			/* ISO 14443A SELECT (card enters the field) */
+#define SIM_DESELECT		2			/* ISO 14443A DESELECT (card leaves the field) */
+#define SIM_APDU			3			/* C-APDU sent by the terminal */
+
+struct edna_sim_step
+{
+	int					type;
+	unsigned long		wait_ms;
+	bytestring			capdu;
+	bytestring			expect;		/* expected R-APDU or status word (optional) */
+};
+
+/*
+ * Simulated reader that plays a script of field events and C-APDUs on a
+ * virtual clock; wait commands advance the clock instead of sleeping, so
+ * scripts run at memory speed and always produce the same event sequence
+ */
+class edna_reader_sim : public edna_reader
+{
+public:
+	/**
+	 * Constructor
+	 */
+	edna_reader_sim();
+	
+	/**
+	 * Destructor
+	 */
+	virtual ~edna_reader_sim();
+	
+	virtual bool connect();
+	
+	virtual void disconnect();
+	
+	virtual bool control(const bytestring& cmd, bytestring& rdata);
+	
+	virtual bool finished();
+	
+	virtual bool direct_capdu_fetch();
+	
+	virtual const std::string& name();
+	
+private:
+	/**
+	 * Load the simulation script
+	 * @param script_path the file to load the script from
+	 * @return true if the script was loaded successfully
+	 */
+	bool load_script(const std::string& script_path);
+	
+	/**
+	 * Produce the next event for a wait event command
+	 * @param timeout the maximum (virtual) time to wait in milliseconds
+	 * @return the event code (0x00 if no event occurred)
+	 */
+	unsigned char next_event(unsigned long timeout);
+	
+	/**
+	 * Log the statistics of the simulation
+	 */
+	void report();
+	
+	std::string reader_name;
+	std::vector<edna_sim_step> script;
+	int repeat;
+	
+	/* Script position */
+	size_t pos;
+	int iteration;
+	bool waiting;
+	unsigned long long wait_until;
+	bool done;
+	
+	/* Emulation state */
+	bool emulating;
+	bool capdu_pending;
+	bool rapdu_outstanding;
+	bool rapdu_complete;
+	bytestring capdu;
+	edna_apdu_buf expect;
+	
+	/* Virtual clock in milliseconds */
+	unsigned long long vclock;
+	
+	/* Statistics */
+	bool reported;
+	unsigned long long start_us;
+	unsigned long long capdu_us;
+	unsigned long long total_latency_us;
+	unsigned long long max_latency_us;
+	unsigned long apdu_count;
+	unsigned long mismatch_count;
+	unsigned long field_count;
+};
+
+#endif /* !_EDNA_READER_SIM_H */
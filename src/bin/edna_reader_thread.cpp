@@ -0,0 +1,683 @@
+/*
+ * Copyright (c) 2013 Roland van Rijswijk-Deij
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+ * IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * The Emulator Daemon for NFC Applications (EDNA)
+ * Reader I/O thread
+ */
+
+#include "config.h"
+#include "edna_reader_thread.h"
+#include "edna_log.h"
+#include "edna_time.h"
+#include "edna_nfcroll.h"
+#include "edna_alloc_stats.h"
+#include <unistd.h>
+#include <string.h>
+
+#define REQUEST_WAIT			100			/* ms between checks for termination */
+#define ANSWER_WAIT				10			/* ms to wait for an R-APDU before checking the reader for events */
+#define ANSWER_POLL				1			/* ms the reader waits for an event while an R-APDU is outstanding */
+#define RECOVERY_MIN_BACKOFF	50			/* ms before the first attempt to recover the reader */
+#define RECOVERY_WAIT_STEP		10			/* ms between checks for termination while backing off */
+
+/* Outcome of retrieving a C-APDU */
+#define CAPDU_RECEIVED			0
+#define CAPDU_NONE				1			/* no (usable) C-APDU available */
+#define CAPDU_ABORT				2			/* the reader has failed */
+
+/* NFC'Roll escape commands */
+static const bytestring start_emu	= NFCROLL_START_EMU;
+static const bytestring end_emu		= NFCROLL_END_EMU;
+static const bytestring buzzer_off	= NFCROLL_BUZZER_OFF;
+static const bytestring get_capdu	= NFCROLL_GET_CAPDU;
+
+edna_reader_thread::edna_reader_thread(edna_reader* reader, unsigned short atq, unsigned char sak, unsigned int max_backoff)
+{
+	this->reader = reader;
+	this->max_backoff = (max_backoff < RECOVERY_MIN_BACKOFF) ? RECOVERY_MIN_BACKOFF : max_backoff;
+	should_run = true;
+	reader_failed = false;
+	rearm_count = 0;
+	rearm_total_us = 0;
+	rearm_max_us = 0;
+	capdu_outstanding = false;
+	stale_rapdus = 0;
+	rapdu_pending = false;
+	rapdu_release_us = 0;
+	
+	wait_event = NFCROLL_WAIT_EVENT;
+	poll_timeout = 0;
+	stats_interval = 0;
+	in_session = false;
+	polls_since = edna_time_ms();
+	poll_count = 0;
+	event_count = 0;
+	event_wait_total_us = 0;
+	event_wait_max_us = 0;
+	direct_fetch_hits = 0;
+	direct_fetch_misses = 0;
+	capdu_count = 0;
+	capdu_allocs = 0;
+	
+	set_poll_policy(DEFAULT_POLL_MIN, DEFAULT_POLL_MAX, 0);
+	
+	INFO_MSG("Setting emulator card ATQ to 0x%04X and SAK to 0x%02X", atq, sak);
+	
+	set_atq_sak = NFCROLL_SET_ATQ_SAK;
+	set_atq_sak += atq;
+	set_atq_sak += sak;
+}
+
+/*virtual*/ edna_reader_thread::~edna_reader_thread()
+{
+	if (should_run)
+	{
+		terminate();
+	}
+}
+
+void edna_reader_thread::set_poll_policy(unsigned int min_ms, unsigned int max_ms, unsigned int stats_interval)
+{
+	poll_min = (min_ms > 0) ? min_ms : 1;
+	poll_max = (max_ms > poll_min) ? max_ms : poll_min;
+	
+	if (poll_max > 0xFFFF) poll_max = 0xFFFF;
+	if (poll_min > poll_max) poll_min = poll_max;
+	
+	this->stats_interval = stats_interval;
+	
+	set_poll_timeout(poll_max);
+}
+
+void edna_reader_thread::set_poll_timeout(unsigned int timeout_ms)
+{
+	if (timeout_ms == poll_timeout) return;
+	
+	poll_timeout = timeout_ms;
+	
+	/* Only rebuild the command when the timeout changes */
+	wait_event.byte_str()[2] = (poll_timeout >> 8) & 0xFF;
+	wait_event.byte_str()[3] = poll_timeout & 0xFF;
+}
+
+void edna_reader_thread::account_poll(bool got_event, unsigned long long elapsed_us)
+{
+	poll_count++;
+	
+	if (got_event)
+	{
+		event_count++;
+		event_wait_total_us += elapsed_us;
+		
+		if (elapsed_us > event_wait_max_us) event_wait_max_us = elapsed_us;
+	}
+	
+	if ((stats_interval > 0) && (edna_time_ms() - polls_since >= stats_interval * 1000ULL))
+	{
+		report_polls();
+	}
+}
+
+void edna_reader_thread::report_polls()
+{
+	unsigned long long elapsed_ms = edna_time_ms() - polls_since;
+	
+	if (poll_count == 0) return;
+	
+	/*
+	 * The time a poll took to deliver an event is the detection latency for
+	 * readers that report events at the end of the wait, and an upper bound
+	 * for readers that report them immediately
+	 */
+	INFO_MSG("Reader %s: %.1f wakeup(s)/s, %lu event(s) in %lu poll(s), event wait avg %lluus max %lluus, timeout now %ums",
+		reader->name().c_str(),
+		(elapsed_ms > 0) ? (poll_count * 1000.0) / elapsed_ms : 0.0,
+		event_count,
+		poll_count,
+		(event_count > 0) ? event_wait_total_us / event_count : 0ULL,
+		event_wait_max_us,
+		poll_timeout);
+	
+	polls_since = edna_time_ms();
+	poll_count = 0;
+	event_count = 0;
+	event_wait_total_us = 0;
+	event_wait_max_us = 0;
+}
+
+bool edna_reader_thread::next_event(edna_reader_event& event, int timeout_ms)
+{
+	return events.wait_pop(event, timeout_ms);
+}
+
+void edna_reader_thread::respond(unsigned char type, const edna_apdu_buf& data /* = edna_apdu_buf() */, unsigned long long release_us /* = 0 */)
+{
+	edna_reader_request request;
+	
+	request.type = type;
+	request.data = data;
+	request.release_us = release_us;
+	
+	/* The reader thread waits for each answer, so the ring never fills up */
+	requests.push(request);
+}
+
+void edna_reader_thread::cancel()
+{
+	should_run = false;
+	
+	reader->cancel();
+	
+	requests.wake();
+	events.wake();
+}
+
+void edna_reader_thread::terminate()
+{
+	cancel();
+	
+	waitexit();
+}
+
+bool edna_reader_thread::control(const bytestring& cmd, bytestring& rdata)
+{
+	if (reader_failed) return false;
+	
+	if (!reader->control(cmd, rdata))
+	{
+		reader->disconnect();
+		
+		reader_failed = true;
+		
+		return false;
+	}
+	
+	return true;
+}
+
+bool edna_reader_thread::start_emulation()
+{
+	bytestring rdata;
+	
+	return control(set_atq_sak, rdata) && control(buzzer_off, rdata) && control(start_emu, rdata);
+}
+
+bool edna_reader_thread::rearm(unsigned char type)
+{
+	bytestring rdata;
+	
+	switch(type)
+	{
+	case READER_REQ_RESET:
+		// Reset the emulation in the hope that this makes
+		// everything more stable
+		if (!control(end_emu, rdata) || !start_emulation()) return false;
+		
+		INFO_MSG("Emulation successfully reset");
+		break;
+	case READER_REQ_REARM:
+		/* The ATQ, SAK and buzzer settings survive leaving emulation mode */
+		if (!control(end_emu, rdata) || !control(start_emu, rdata)) return false;
+		break;
+	case READER_REQ_CONTINUE:
+	default:
+		break;
+	}
+	
+	return true;
+}
+
+void edna_reader_thread::post_event(unsigned char type, const bytestring_view& data /* = bytestring_view() */)
+{
+	edna_reader_event event;
+	
+	event.type = type;
+	event.data.assign(data.const_byte_str(), data.size());
+	
+	/* Only wait for room if the dispatch side falls far behind */
+	while (!events.push(event) && should_run)
+	{
+		usleep(1000);
+	}
+}
+
+bool edna_reader_thread::pop_request(edna_reader_request& request, int timeout_ms)
+{
+	while (requests.wait_pop(request, timeout_ms))
+	{
+		/* The dispatch side still answers C-APDUs after the card has left */
+		if ((request.type == READER_REQ_RAPDU) && (stale_rapdus > 0))
+		{
+			stale_rapdus--;
+			
+			continue;
+		}
+		
+		return true;
+	}
+	
+	return false;
+}
+
+bool edna_reader_thread::wait_request(edna_reader_request& request)
+{
+	while (should_run)
+	{
+		if (pop_request(request, REQUEST_WAIT))
+		{
+			return true;
+		}
+	}
+	
+	return false;
+}
+
+int edna_reader_thread::retrieve_capdu(bytestring& rdata)
+{
+	if (!control(get_capdu, rdata)) return CAPDU_ABORT;
+	
+	if (rdata.size() == 0) return CAPDU_NONE;
+	
+	if (rdata[0] == 0x00) return CAPDU_RECEIVED;
+	
+	/* Check status byte */
+	bool abort = false;
+	
+	switch(rdata[0])
+	{
+	case 0x03:	// No C-APDU available
+		break;
+	case 0x13:	// FIFO overflow
+		ERROR_MSG("Card reader received APDU exceeding 280 bytes");
+		break;
+	case 0x3B:	// Wrong mode
+		ERROR_MSG("Card reader is in wrong mode, aborting");
+		abort = true;
+		break;
+	case 0x3C:	// Wrong parameter
+		ERROR_MSG("Card reader reported wrong parameter set, aborting");
+		abort = true;
+		break;
+	case 0x70:	// Buffer overflow
+		ERROR_MSG("Reader internal buffer overflow");
+		break;
+	case 0x7D:	// Wrong length
+		ERROR_MSG("Reader reports wrong length");
+		break;
+	}
+	
+	/* Let the dispatch side keep track of the reader's health */
+	if (rdata[0] != 0x03)
+	{
+		post_event(READER_EVENT_ERROR, bytestring_view(rdata).substr(0, 1));
+	}
+	
+	if (abort)
+	{
+		/* Start over from a fresh connection */
+		reader->disconnect();
+		
+		reader_failed = true;
+		
+		return CAPDU_ABORT;
+	}
+	
+	return CAPDU_NONE;
+}
+
+void edna_reader_thread::exchange_capdu(const bytestring& rdata)
+{
+	unsigned long long allocs = edna_thread_allocs();
+	
+	/* Hand the C-APDU (without the status byte) to the dispatch side */
+	post_event(READER_EVENT_CAPDU, bytestring_view(rdata).substr(1));
+	
+	capdu_outstanding = true;
+	
+	capdu_allocs += edna_thread_allocs() - allocs;
+}
+
+bool edna_reader_thread::prepare_rapdu(const edna_reader_request& request)
+{
+	unsigned long long allocs = edna_thread_allocs();
+	
+	/* Build the command in place; the buffers keep their storage between APDUs */
+	send_rapdu.resize(NFCROLL_SEND_RAPDU.size() + request.data.size());
+	
+	memcpy(send_rapdu.byte_str(), NFCROLL_SEND_RAPDU.bytes, NFCROLL_SEND_RAPDU.size());
+	
+	if (request.data.size() > 0)
+	{
+		memcpy(send_rapdu.byte_str() + NFCROLL_SEND_RAPDU.size(), request.data.const_byte_str(), request.data.size());
+	}
+	
+	capdu_count++;
+	capdu_allocs += edna_thread_allocs() - allocs;
+	
+	/* Injected latency; the event loop keeps polling the reader meanwhile, so a DESELECT is not missed */
+	if (request.release_us > edna_time_us())
+	{
+		rapdu_pending = true;
+		rapdu_release_us = request.release_us;
+		
+		return true;
+	}
+	
+	return send_prepared_rapdu();
+}
+
+bool edna_reader_thread::send_prepared_rapdu()
+{
+	rapdu_pending = false;
+	
+	return control(send_rapdu, send_rapdu_rsp);
+}
+
+void edna_reader_thread::emulate()
+{
+	bytestring rdata;
+	
+	bool direct_fetch = reader->direct_capdu_fetch();
+	bool fetch_next = false;
+	
+	/* An answer still outstanding from before the reader failed is of no use anymore */
+	if (capdu_outstanding)
+	{
+		capdu_outstanding = false;
+		stale_rapdus++;
+	}
+	
+	rapdu_pending = false;
+	
+	/* This loop only talks to the reader; all decisions are made on the dispatch side */
+	while (should_run && !reader->finished())
+	{
+		/*
+		 * The terminal usually sends the next command right after the
+		 * response; asking for it straight away saves the round trips
+		 * for the R-APDU completion and C-APDU events
+		 */
+		if (capdu_outstanding)
+		{
+			edna_reader_request request;
+			
+			if (pop_request(request, ANSWER_WAIT))
+			{
+				capdu_outstanding = false;
+				
+				if (!prepare_rapdu(request)) break;
+				
+				if (!rapdu_pending)
+				{
+					set_poll_timeout(poll_min);
+					
+					fetch_next = direct_fetch;
+				}
+				
+				continue;
+			}
+			
+			/* Keep watching the field while the application takes its time */
+			set_poll_timeout(ANSWER_POLL);
+		}
+		else if (rapdu_pending)
+		{
+			unsigned long long now = edna_time_us();
+			
+			if (now >= rapdu_release_us)
+			{
+				if (!send_prepared_rapdu()) break;
+				
+				set_poll_timeout(poll_min);
+				
+				fetch_next = direct_fetch;
+				
+				continue;
+			}
+			
+			/* Poll for events, but no longer than until the R-APDU is due */
+			unsigned long long due_ms = (rapdu_release_us - now + 999) / 1000;
+			
+			set_poll_timeout((due_ms < poll_min) ? (unsigned int) due_ms : poll_min);
+		}
+		else if (fetch_next)
+		{
+			fetch_next = false;
+			
+			int rv = retrieve_capdu(rdata);
+			
+			if (rv == CAPDU_ABORT) break;
+			
+			if (rv == CAPDU_RECEIVED)
+			{
+				direct_fetch_hits++;
+				
+				exchange_capdu(rdata);
+				
+				continue;
+			}
+			
+			direct_fetch_misses++;
+		}
+		
+		unsigned long long poll_start = edna_time_us();
+		
+		if (!control(wait_event, rdata)) break;
+		
+		bool got_event = (rdata.size() == 3) && (rdata[1] != 0x00);
+		
+		account_poll(got_event, edna_time_us() - poll_start);
+		
+		if (!got_event)
+		{
+			/* Back off while no card is in the field */
+			if (!in_session && (poll_timeout < poll_max))
+			{
+				set_poll_timeout((poll_timeout * 2 < poll_max) ? poll_timeout * 2 : poll_max);
+			}
+			
+			continue;
+		}
+		
+		unsigned char event = rdata[1];
+		
+		/* Respond quickly while a card is in the field, and to the next tap */
+		set_poll_timeout(poll_min);
+		
+		if (event == READER_EVENT_SELECT)
+		{
+			in_session = true;
+		}
+		else if (event == READER_EVENT_DESELECT)
+		{
+			in_session = false;
+		}
+		
+		if (capdu_outstanding && ((event == READER_EVENT_SELECT) || (event == READER_EVENT_DESELECT)))
+		{
+			DEBUG_MSG("Reader %s: the card left the field before the application answered, abandoning the exchange", reader->name().c_str());
+			
+			capdu_outstanding = false;
+			stale_rapdus++;
+		}
+		
+		if (rapdu_pending && ((event == READER_EVENT_SELECT) || (event == READER_EVENT_DESELECT)))
+		{
+			DEBUG_MSG("Reader %s: the card left the field before the delayed R-APDU was due, dropping it", reader->name().c_str());
+			
+			rapdu_pending = false;
+		}
+		
+		if ((event == READER_EVENT_SELECT) || (event == READER_EVENT_RAPDU_DONE))
+		{
+			post_event(event);
+		}
+		else if (event == READER_EVENT_DESELECT)
+		{
+			edna_reader_request request;
+			unsigned long long deselected = edna_time_us();
+			
+			post_event(event);
+			
+			if (!wait_request(request)) break;
+			
+			if (!rearm(request.type)) break;
+			
+			unsigned long long rearm_us = edna_time_us() - deselected;
+			
+			rearm_count++;
+			rearm_total_us += rearm_us;
+			
+			if (rearm_us > rearm_max_us) rearm_max_us = rearm_us;
+			
+			DEBUG_MSG("Reader %s ready for the next tap %lluus after DESELECT", reader->name().c_str(), rearm_us);
+		}
+		else if (event == READER_EVENT_CAPDU)
+		{
+			int rv = retrieve_capdu(rdata);
+			
+			if (rv == CAPDU_ABORT) break;
+			
+			if (rv == CAPDU_NONE) continue;
+			
+			exchange_capdu(rdata);
+		}
+	}
+}
+
+bool edna_reader_thread::recover()
+{
+	unsigned long long failed_at = edna_time_ms();
+	unsigned int backoff = RECOVERY_MIN_BACKOFF;
+	int attempts = 0;
+	
+	WARNING_MSG("Lost reader %s, trying to recover", reader->name().c_str());
+	
+	post_event(READER_EVENT_LOST);
+	
+	while (should_run)
+	{
+		for (unsigned int waited = 0; (waited < backoff) && should_run; waited += RECOVERY_WAIT_STEP)
+		{
+			usleep(RECOVERY_WAIT_STEP * 1000);
+		}
+		
+		if (!should_run) break;
+		
+		attempts++;
+		
+		if (reader->connect())
+		{
+			reader_failed = false;
+			
+			/* On failure, this disconnects again and marks the reader as failed */
+			if (start_emulation())
+			{
+				INFO_MSG("Recovered reader %s after %llums (%d attempt(s))", reader->name().c_str(), edna_time_ms() - failed_at, attempts);
+				
+				post_event(READER_EVENT_READY);
+				
+				return true;
+			}
+		}
+		
+		backoff = (backoff * 2 > max_backoff) ? max_backoff : backoff * 2;
+		
+		DEBUG_MSG("Attempt %d to recover reader %s failed, retrying in %ums", attempts, reader->name().c_str(), backoff);
+	}
+	
+	return false;
+}
+
+/*virtual*/ void edna_reader_thread::threadproc()
+{
+	bytestring rdata;
+	
+	if (!reader->connect())
+	{
+		post_event(READER_EVENT_STOPPED);
+		
+		return;
+	}
+	
+	INFO_MSG("Entering emulation mode on reader %s", reader->name().c_str());
+	
+	if (!start_emulation())
+	{
+		post_event(READER_EVENT_STOPPED);
+		
+		return;
+	}
+	
+	INFO_MSG("Startup: reader %s ready for emulation after %llums", reader->name().c_str(), edna_uptime_ms());
+	
+	post_event(READER_EVENT_READY);
+	
+	polls_since = edna_time_ms();
+	
+	while (should_run)
+	{
+		emulate();
+		
+		if (!should_run || !reader_failed) break;
+		
+		/* Recover from reader failures (e.g. a USB glitch) without disturbing the applications */
+		if (!recover()) break;
+	}
+	
+	report_polls();
+	
+	if (direct_fetch_hits + direct_fetch_misses > 0)
+	{
+		INFO_MSG("Reader %s: %lu of %lu C-APDU(s) fetched directly after the previous R-APDU", reader->name().c_str(), direct_fetch_hits, direct_fetch_hits + direct_fetch_misses);
+	}
+	
+#ifdef EDNA_ALLOC_STATS
+	if (capdu_count > 0)
+	{
+		INFO_MSG("Reader %s: %llu heap allocation(s) for %lu C-APDU(s) on the reader thread", reader->name().c_str(), capdu_allocs, capdu_count);
+	}
+#endif // EDNA_ALLOC_STATS
+	
+	if (rearm_count > 0)
+	{
+		INFO_MSG("Reader %s re-armed %lu time(s), time-to-ready avg %lluus max %lluus", reader->name().c_str(), rearm_count, rearm_total_us / rearm_count, rearm_max_us);
+	}
+	
+	/* Leave emulation mode */
+	if (!reader_failed)
+	{
+		INFO_MSG("Leaving emulation mode on reader %s", reader->name().c_str());
+		
+		control(end_emu, rdata);
+		
+		reader->disconnect();
+	}
+	
+	post_event(READER_EVENT_STOPPED);
+}
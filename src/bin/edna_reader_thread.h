@@ -0,0 +1,319 @@
+/*
+ * Copyright (c) 2013 Roland van Rijswijk-Deij
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+ * IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * The Emulator Daemon for NFC Applications (EDNA)
+ * Reader I/O thread
+ */
+
+#ifndef _EDNA_READER_THREAD_H
+#define _EDNA_READER_THREAD_H
+
+#include "config.h"
+#include "edna_thread.h"
+#include "edna_reader.h"
+#include "edna_bytestring.h"
+#include "edna_bytestring_view.h"
+#include "edna_apdu_buf.h"
+#include "edna_ring.h"
+#include <atomic>
+
+/* Events delivered by the reader thread (the values match the NFC'Roll event codes) */
+#define READER_EVENT_SELECT		0x01		/* ISO 14443A SELECT */
+#define READER_EVENT_CAPDU		0x02		/* C-APDU received; a READER_REQ_RAPDU must follow */
+#define READER_EVENT_RAPDU_DONE	0x03		/* R-APDU processing complete */
+#define READER_EVENT_DESELECT	0x04		/* ISO 14443A DESELECT; a READER_REQ_CONTINUE, READER_REQ_REARM or READER_REQ_RESET must follow */
+#define READER_EVENT_READY		0x10		/* the reader is in emulation mode */
+#define READER_EVENT_ERROR		0x20		/* the reader reported an error; the data holds the status byte */
+#define READER_EVENT_LOST		0x21		/* the reader failed; the thread tries to recover it and sends READER_EVENT_READY once it has */
+#define READER_EVENT_STOPPED	0xFF		/* the reader thread has stopped */
+
+/* Requests to the reader thread */
+#define READER_REQ_RAPDU		0x01		/* send the R-APDU */
+#define READER_REQ_CONTINUE		0x02		/* continue waiting for events */
+#define READER_REQ_RESET		0x03		/* reconfigure the card and reset emulation mode, then continue */
+#define READER_REQ_REARM		0x04		/* leave and re-enter emulation mode, then continue */
+
+#define READER_RING_SIZE		64
+
+/* Bounds for the time the reader waits for an event in one poll */
+#define DEFAULT_POLL_MIN		20			/* ms, used during a field session */
+#define DEFAULT_POLL_MAX		500			/* ms, reached after a while without events */
+
+/* APDUs are held inline, so passing them between the threads does not allocate */
+struct edna_reader_event
+{
+	unsigned char	type;
+	edna_apdu_buf	data;
+};
+
+struct edna_reader_request
+{
+	unsigned char		type;
+	edna_apdu_buf		data;
+	unsigned long long	release_us;		/* do not send the R-APDU before this time (edna_time_us()) */
+};
+
+class edna_reader_thread : public edna_thread
+{
+public:
+	/**
+	 * Constructor
+	 * @param reader the reader backend (the thread becomes its only user)
+	 * @param atq the ATQ of the emulated card
+	 * @param sak the SAK of the emulated card
+	 * @param max_backoff the maximum time in milliseconds between attempts to recover a failed reader
+	 */
+	edna_reader_thread(edna_reader* reader, unsigned short atq, unsigned char sak, unsigned int max_backoff);
+	
+	/**
+	 * Destructor
+	 */
+	virtual ~edna_reader_thread();
+	
+	/**
+	 * Wait for the next reader event (dispatch side)
+	 * @param event receives the event
+	 * @param timeout_ms the maximum time to wait in milliseconds
+	 * @return true if an event was received
+	 */
+	bool next_event(edna_reader_event& event, int timeout_ms);
+	
+	/**
+	 * Answer an event that requires a response (dispatch side)
+	 * @param type the request type
+	 * @param data the R-APDU (for READER_REQ_RAPDU)
+	 * @param release_us the time (edna_time_us()) at which to send the R-APDU; the
+	 *                   reader thread holds it back without blocking the dispatch side
+	 */
+	void respond(unsigned char type, const edna_apdu_buf& data = edna_apdu_buf(), unsigned long long release_us = 0);
+	
+	/**
+	 * Set the bounds for the event wait timeout (call before starting
+	 * the thread); the timeout stays at the minimum during a field
+	 * session and doubles with every idle poll up to the maximum
+	 * @param min_ms the minimum timeout in milliseconds
+	 * @param max_ms the maximum timeout in milliseconds
+	 * @param stats_interval log polling statistics every stats_interval
+	 *                       seconds (0 = only when emulation ends)
+	 */
+	void set_poll_policy(unsigned int min_ms, unsigned int max_ms, unsigned int stats_interval);
+	
+	/**
+	 * Stop talking to the reader as soon as possible; safe to call
+	 * from a signal handler
+	 */
+	void cancel();
+	
+	/**
+	 * Stop the thread and wait for it to leave emulation mode
+	 */
+	void terminate();
+	
+protected:
+	/**
+	 * The thread body
+	 */
+	virtual void threadproc();
+	
+private:
+	/**
+	 * Exchange a control command; on failure the reader is disconnected
+	 * @param cmd the control command
+	 * @param rdata the data returned by the reader
+	 * @return true if the command was exchanged successfully
+	 */
+	bool control(const bytestring& cmd, bytestring& rdata);
+	
+	/**
+	 * Handle reader events until the reader fails or the thread stops
+	 */
+	void emulate();
+	
+	/**
+	 * Reconnect to a failed reader with exponential backoff and re-enter
+	 * emulation mode
+	 * @return true if the reader was recovered, false if the thread is stopping
+	 */
+	bool recover();
+	
+	/**
+	 * Retrieve a C-APDU from the reader
+	 * @param rdata receives the status byte followed by the C-APDU
+	 * @return CAPDU_RECEIVED, CAPDU_NONE or CAPDU_ABORT (the reader has failed)
+	 */
+	int retrieve_capdu(bytestring& rdata);
+	
+	/**
+	 * Hand a C-APDU to the dispatch side; the event loop keeps polling
+	 * the reader until the answer arrives, and passes it to prepare_rapdu
+	 * @param rdata the status byte followed by the C-APDU
+	 */
+	void exchange_capdu(const bytestring& rdata);
+	
+	/**
+	 * Build the R-APDU command from the answer of the dispatch side and
+	 * send it; an R-APDU with a later release time is held back, and sent
+	 * from the event loop once the time has come
+	 * @param request the answer of the dispatch side
+	 * @return false if the reader failed
+	 */
+	bool prepare_rapdu(const edna_reader_request& request);
+	
+	/**
+	 * Send the R-APDU prepared by exchange_capdu to the reader
+	 * @return false if the reader failed
+	 */
+	bool send_prepared_rapdu();
+	
+	/**
+	 * Configure the emulated card and enter emulation mode
+	 * @return true if the reader is in emulation mode
+	 */
+	bool start_emulation();
+	
+	/**
+	 * Queue an event for the dispatch side
+	 * @param type the event type
+	 * @param data the event data (copied into the event)
+	 */
+	void post_event(unsigned char type, const bytestring_view& data = bytestring_view());
+	
+	/**
+	 * Take the next answer of the dispatch side, skipping the R-APDUs of
+	 * exchanges that were abandoned
+	 * @param request receives the answer
+	 * @param timeout_ms the maximum time to wait in milliseconds
+	 * @return true if an answer was received
+	 */
+	bool pop_request(edna_reader_request& request, int timeout_ms);
+	
+	/**
+	 * Wait for the dispatch side to answer an event
+	 * @param request receives the answer
+	 * @return true if an answer was received, false if the thread is stopping
+	 */
+	bool wait_request(edna_reader_request& request);
+	
+	/**
+	 * Change the event wait timeout
+	 * @param timeout_ms the new timeout in milliseconds
+	 */
+	void set_poll_timeout(unsigned int timeout_ms);
+	
+	/**
+	 * Account for a completed poll and log statistics when due
+	 * @param got_event true if the poll returned an event
+	 * @param elapsed_us the duration of the poll
+	 */
+	void account_poll(bool got_event, unsigned long long elapsed_us);
+	
+	/**
+	 * Log the polling statistics
+	 */
+	void report_polls();
+	
+	/**
+	 * Perform the re-arm action requested after a DESELECT
+	 * @param type the request type
+	 * @return false if the reader failed
+	 */
+	bool rearm(unsigned char type);
+	
+	edna_reader* reader;
+	
+	bytestring set_atq_sak;
+	
+	/* Command and response buffers for sending R-APDUs */
+	bytestring send_rapdu;
+	
+	bytestring send_rapdu_rsp;
+	
+	/* Set while the dispatch side prepares the R-APDU for the last C-APDU */
+	bool capdu_outstanding;
+	
+	/* R-APDUs still to come for exchanges abandoned because the card left the field */
+	unsigned long stale_rapdus;
+	
+	/* Set while the prepared R-APDU is held back until rapdu_release_us (edna_time_us()) */
+	bool rapdu_pending;
+	
+	unsigned long long rapdu_release_us;
+	
+	/* Time from DESELECT until the reader accepts the next tap */
+	unsigned long rearm_count;
+	
+	unsigned long long rearm_total_us;
+	
+	unsigned long long rearm_max_us;
+	
+	/* Event polling */
+	bytestring wait_event;
+	
+	unsigned int poll_min;
+	
+	unsigned int poll_max;
+	
+	unsigned int poll_timeout;
+	
+	unsigned int stats_interval;
+	
+	bool in_session;
+	
+	unsigned long long polls_since;
+	
+	unsigned long poll_count;
+	
+	unsigned long event_count;
+	
+	unsigned long long event_wait_total_us;
+	
+	unsigned long long event_wait_max_us;
+	
+	/* C-APDUs fetched without waiting for an event, and attempts that found none */
+	unsigned long direct_fetch_hits;
+	
+	unsigned long direct_fetch_misses;
+	
+	/* C-APDUs exchanged, and the heap allocations made doing so (see edna_alloc_stats.h) */
+	unsigned long capdu_count;
+	
+	unsigned long long capdu_allocs;
+	
+	/* Cleared by cancel(), which may be called from another thread or a signal handler */
+	std::atomic<bool> should_run;
+	
+	std::atomic<bool> reader_failed;
+	
+	unsigned int max_backoff;
+	
+	edna_ring<edna_reader_event, READER_RING_SIZE> events;
+	
+	edna_ring<edna_reader_request, READER_RING_SIZE> requests;
+};
+
+#endif /* !_EDNA_READER_THREAD_H */
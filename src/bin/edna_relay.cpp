@@ -0,0 +1,258 @@
+/*
+ * Copyright (c) 2013 Roland van Rijswijk-Deij
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+ * IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * The Emulator Daemon for NFC Applications (EDNA)
+ * Built-in relay applet; forwards APDUs to a card in a PC/SC reader
+ */
+
+#include "config.h"
+#include "edna_relay.h"
+#include "edna_config.h"
+#include "edna_log.h"
+#include "edna_time.h"
+#include "edna_proto.h"
+#include <string.h>
+#include <string>
+#include <vector>
+
+edna_relay::edna_relay()
+{
+	pcsc_context = 0;
+	pcsc_card = 0;
+	active_protocol = 0;
+	connected = false;
+	apdu_count = 0;
+	total_overhead_us = 0;
+	max_overhead_us = 0;
+	total_card_us = 0;
+}
+
+edna_relay::~edna_relay()
+{
+	report();
+	
+	disconnect();
+}
+
+bool edna_relay::load_config()
+{
+	std::vector<std::string> aid_strings;
+	
+	if ((edna_conf_get_string("relay", "reader", reader_name, NULL) != ERV_OK) || reader_name.empty())
+	{
+		return false;
+	}
+	
+	if (edna_conf_get_string_array("relay", "aids", aid_strings) != ERV_OK)
+	{
+		ERROR_MSG("Relayed AIDs must be specified as a list of strings");
+		
+		return false;
+	}
+	
+	for (std::vector<std::string>::iterator i = aid_strings.begin(); i != aid_strings.end(); i++)
+	{
+		bytestring aid(i->c_str());
+		
+		if ((aid.size() == 0) || (aid.size() * 2 != i->size()))
+		{
+			ERROR_MSG("Invalid relayed AID \"%s\", ignoring", i->c_str());
+			
+			continue;
+		}
+		
+		relay_aids.push_back(aid);
+	}
+	
+	if (relay_aids.empty())
+	{
+		WARNING_MSG("Relay to reader %s has no AIDs to relay", reader_name.c_str());
+		
+		return false;
+	}
+	
+	INFO_MSG("Relaying %zd AID(s) to the card in reader %s", relay_aids.size(), reader_name.c_str());
+	
+	return true;
+}
+
+const std::vector<bytestring>& edna_relay::aids()
+{
+	return relay_aids;
+}
+
+bool edna_relay::connect()
+{
+	if (connected) return true;
+	
+	if ((pcsc_context == 0) && (SCardEstablishContext(SCARD_SCOPE_USER, NULL, NULL, &pcsc_context) != SCARD_S_SUCCESS))
+	{
+		ERROR_MSG("Failed to establish a PC/SC context for the relay");
+		
+		pcsc_context = 0;
+		
+		return false;
+	}
+	
+	LONG pcsc_rv = SCardConnect(pcsc_context, reader_name.c_str(), SCARD_SHARE_EXCLUSIVE, SCARD_PROTOCOL_T0 | SCARD_PROTOCOL_T1, &pcsc_card, &active_protocol);
+	
+	if (pcsc_rv != SCARD_S_SUCCESS)
+	{
+		ERROR_MSG("Failed to connect to the relayed card in reader %s (0x%08X)", reader_name.c_str(), (unsigned int) pcsc_rv);
+		
+		return false;
+	}
+	
+	connected = true;
+	
+	INFO_MSG("Connected to the relayed card in reader %s using T=%d", reader_name.c_str(), (active_protocol == SCARD_PROTOCOL_T1) ? 1 : 0);
+	
+	return true;
+}
+
+void edna_relay::disconnect()
+{
+	if (connected)
+	{
+		SCardDisconnect(pcsc_card, SCARD_RESET_CARD);
+		
+		connected = false;
+	}
+	
+	if (pcsc_context != 0)
+	{
+		SCardReleaseContext(pcsc_context);
+		
+		pcsc_context = 0;
+	}
+}
+
+bool edna_relay::transmit(const edna_apdu& apdu, edna_apdu_buf& rdata, unsigned long long& card_us)
+{
+	relay_mutex.lock();
+	
+	card_us = 0;
+	
+	if (!connect())
+	{
+		relay_mutex.unlock();
+		
+		return false;
+	}
+	
+	const SCARD_IO_REQUEST* send_pci = (active_protocol == SCARD_PROTOCOL_T1) ? SCARD_PCI_T1 : SCARD_PCI_T0;
+	DWORD rlen = MAX_RELAY_RAPDU;
+	unsigned long long start_us = edna_time_us();
+	
+	LONG pcsc_rv = SCardTransmit(pcsc_card, send_pci, apdu.bytes().const_byte_str(), apdu.bytes().size(), NULL, rapdu_buf, &rlen);
+	
+	card_us = edna_time_us() - start_us;
+	
+	if ((pcsc_rv != SCARD_S_SUCCESS) || (rlen < 2))
+	{
+		ERROR_MSG("Failed to relay APDU to the card in reader %s (0x%08X)", reader_name.c_str(), (unsigned int) pcsc_rv);
+		
+		/* Reconnect for the next command, e.g. after the card was swapped */
+		SCardDisconnect(pcsc_card, SCARD_LEAVE_CARD);
+		
+		connected = false;
+		
+		relay_mutex.unlock();
+		
+		return false;
+	}
+	
+	rdata.assign(rapdu_buf, rlen);
+	
+	relay_mutex.unlock();
+	
+	return true;
+}
+
+void edna_relay::power(unsigned char cmd)
+{
+	relay_mutex.lock();
+	
+	if (cmd == POWER_UP)
+	{
+		/* Connect ahead of the first command */
+		connect();
+	}
+	else if (connected)
+	{
+		/* Give the next session a freshly reset card, like a card that left the field */
+		DWORD protocol;
+		
+		if (SCardReconnect(pcsc_card, SCARD_SHARE_EXCLUSIVE, SCARD_PROTOCOL_T0 | SCARD_PROTOCOL_T1, SCARD_RESET_CARD, &protocol) == SCARD_S_SUCCESS)
+		{
+			active_protocol = protocol;
+		}
+		else
+		{
+			SCardDisconnect(pcsc_card, SCARD_LEAVE_CARD);
+			
+			connected = false;
+		}
+	}
+	
+	relay_mutex.unlock();
+}
+
+void edna_relay::record(unsigned long long total_us, unsigned long long card_us)
+{
+	unsigned long long overhead_us = (total_us > card_us) ? total_us - card_us : 0;
+	
+	DEBUG_MSG("Relayed APDU in %lluus, card %lluus, relay overhead %lluus", total_us, card_us, overhead_us);
+	
+	relay_mutex.lock();
+	
+	apdu_count++;
+	total_card_us += card_us;
+	total_overhead_us += overhead_us;
+	
+	if (overhead_us > max_overhead_us) max_overhead_us = overhead_us;
+	
+	relay_mutex.unlock();
+}
+
+const std::string& edna_relay::name()
+{
+	return reader_name;
+}
+
+void edna_relay::report()
+{
+	if (apdu_count == 0) return;
+	
+	INFO_MSG("Relayed %lu APDU(s) to reader %s, card avg %lluus, relay overhead avg %lluus max %lluus",
+		apdu_count,
+		reader_name.c_str(),
+		total_card_us / apdu_count,
+		total_overhead_us / apdu_count,
+		max_overhead_us);
+}
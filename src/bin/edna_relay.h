@@ -0,0 +1,139 @@
+/*
+ * Copyright (c) 2013 Roland van Rijswijk-Deij
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+ * IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * The Emulator Daemon for NFC Applications (EDNA)
+ * Built-in relay applet; forwards APDUs to a card in a PC/SC reader
+ */
+
+#ifndef _EDNA_RELAY_H
+#define _EDNA_RELAY_H
+
+#include "config.h"
+#include "edna_bytestring.h"
+#include "edna_apdu.h"
+#include "edna_apdu_buf.h"
+#include "edna_mutex.h"
+#include <winscard.h>
+#include <vector>
+#include <string>
+
+/* Largest response to an extended length APDU, including the status word */
+#define MAX_RELAY_RAPDU			65538
+
+class edna_relay
+{
+public:
+	/**
+	 * Constructor
+	 */
+	edna_relay();
+	
+	/**
+	 * Destructor
+	 */
+	~edna_relay();
+	
+	/**
+	 * Load the relay reader and AIDs from the configuration
+	 * @return true if a relay is configured
+	 */
+	bool load_config();
+	
+	/**
+	 * Get the AIDs to relay
+	 * @return the AIDs
+	 */
+	const std::vector<bytestring>& aids();
+	
+	/**
+	 * Forward an APDU to the card
+	 * @param apdu the APDU
+	 * @param rdata the response of the card
+	 * @param card_us receives the time the card (and PC/SC) took in microseconds
+	 * @return true if the card responded
+	 */
+	bool transmit(const edna_apdu& apdu, edna_apdu_buf& rdata, unsigned long long& card_us);
+	
+	/**
+	 * Follow the power state of the emulated card
+	 * @param cmd POWER_UP or POWER_DOWN
+	 */
+	void power(unsigned char cmd);
+	
+	/**
+	 * Account for a relayed APDU
+	 * @param total_us the time from receiving the C-APDU until the R-APDU was ready
+	 * @param card_us the time the card took
+	 */
+	void record(unsigned long long total_us, unsigned long long card_us);
+	
+	/**
+	 * Get the name of the reader holding the card
+	 * @return the reader name
+	 */
+	const std::string& name();
+	
+private:
+	/**
+	 * Connect to the card
+	 * @return true if the card is connected
+	 */
+	bool connect();
+	
+	/**
+	 * Disconnect from the card
+	 */
+	void disconnect();
+	
+	/**
+	 * Log the relay statistics
+	 */
+	void report();
+	
+	std::string reader_name;
+	std::vector<bytestring> relay_aids;
+	
+	/* The card is shared by all readers that emulate it */
+	edna_mutex relay_mutex;
+	
+	SCARDCONTEXT pcsc_context;
+	SCARDHANDLE pcsc_card;
+	DWORD active_protocol;
+	bool connected;
+	
+	/* Responses are received here, so relaying does not allocate */
+	unsigned char rapdu_buf[MAX_RELAY_RAPDU];
+	
+	/* Statistics */
+	unsigned long apdu_count;
+	unsigned long long total_overhead_us;
+	unsigned long long max_overhead_us;
+	unsigned long long total_card_us;
+};
+
+#endif /* !_EDNA_RELAY_H */
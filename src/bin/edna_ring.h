@@ -0,0 +1,172 @@
+/*
+ * Copyright (c) 2013 Roland van Rijswijk-Deij
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+ * IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * The Emulator Daemon for NFC Applications (EDNA)
+ * Single-producer single-consumer ring buffer
+ */
+
+#ifndef _EDNA_RING_H
+#define _EDNA_RING_H
+
+#include "config.h"
+#include <atomic>
+#include <stddef.h>
+#include <errno.h>
+#include <time.h>
+#include <semaphore.h>
+
+/*
+ * Lock-free ring buffer for passing items from exactly one producer
+ * thread to exactly one consumer thread; SIZE must be a power of two.
+ * A semaphore counts the queued items so the consumer can sleep until
+ * an item arrives instead of polling.
+ */
+template <typename T, size_t SIZE>
+class edna_ring
+{
+public:
+	/**
+	 * Constructor
+	 */
+	edna_ring() : head(0), tail(0)
+	{
+		static_assert((SIZE > 0) && ((SIZE & (SIZE - 1)) == 0), "ring size must be a power of two");
+		
+		sem_init(&items, 0, 0);
+	}
+	
+	/**
+	 * Destructor
+	 */
+	~edna_ring()
+	{
+		sem_destroy(&items);
+	}
+	
+	/**
+	 * Add an item to the ring (producer only)
+	 * @param item the item to add
+	 * @return false if the ring is full
+	 */
+	bool push(const T& item)
+	{
+		size_t cur_tail = tail.load(std::memory_order_relaxed);
+		
+		if (cur_tail - head.load(std::memory_order_acquire) >= SIZE)
+		{
+			return false;
+		}
+		
+		slots[cur_tail & (SIZE - 1)] = item;
+		
+		tail.store(cur_tail + 1, std::memory_order_release);
+		
+		sem_post(&items);
+		
+		return true;
+	}
+	
+	/**
+	 * Take an item from the ring without waiting (consumer only)
+	 * @param item receives the item
+	 * @return false if the ring is empty
+	 */
+	bool pop(T& item)
+	{
+		size_t cur_head = head.load(std::memory_order_relaxed);
+		
+		if (cur_head == tail.load(std::memory_order_acquire))
+		{
+			return false;
+		}
+		
+		item = slots[cur_head & (SIZE - 1)];
+		slots[cur_head & (SIZE - 1)] = T();
+		
+		head.store(cur_head + 1, std::memory_order_release);
+		
+		return true;
+	}
+	
+	/**
+	 * Take an item from the ring, waiting for one to arrive if the
+	 * ring is empty (consumer only)
+	 * @param item receives the item
+	 * @param timeout_ms the maximum time to wait in milliseconds
+	 * @return false if no item arrived in time or the wait was interrupted
+	 */
+	bool wait_pop(T& item, int timeout_ms)
+	{
+		if (pop(item))
+		{
+			/* Consume the matching semaphore count (may already be taken by a wake-up) */
+			sem_trywait(&items);
+			
+			return true;
+		}
+		
+		struct timespec deadline;
+		
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		
+		deadline.tv_sec += timeout_ms / 1000;
+		deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+		
+		if (deadline.tv_nsec >= 1000000000L)
+		{
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+		
+		while (sem_timedwait(&items, &deadline) != 0)
+		{
+			if (errno != EINTR) return false;
+		}
+		
+		return pop(item);
+	}
+	
+	/**
+	 * Wake up a consumer that is waiting for an item (e.g. on cancellation)
+	 */
+	void wake()
+	{
+		sem_post(&items);
+	}
+	
+private:
+	T slots[SIZE];
+	
+	std::atomic<size_t> head;
+	
+	std::atomic<size_t> tail;
+	
+	sem_t items;
+};
+
+#endif /* !_EDNA_RING_H */
@@ -0,0 +1,227 @@
+/*
+ * Copyright (c) 2013 Roland van Rijswijk-Deij
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+ * IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * The Emulator Daemon for NFC Applications (EDNA)
+ * APDU routing table
+ */
+
+#include "config.h"
+#include "edna_route.h"
+#include "edna_config.h"
+#include "edna_log.h"
+#include <string.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+#include <sstream>
+
+#define MAX_ROUTES			1024
+
+/* Check that a string is a non-empty, byte-aligned hexadecimal value */
+static bool is_hex(const std::string& str)
+{
+	return !str.empty() && (str.size() % 2 == 0) && (strspn(str.c_str(), "0123456789abcdefABCDEF") == str.size());
+}
+
+edna_router::edna_router()
+{
+	default_route.pattern = 0;
+	default_route.mask = 0;
+	default_route.target = ROUTE_SELECTED;
+	
+	compile();
+}
+
+edna_router::~edna_router()
+{
+}
+
+bool edna_router::parse_rule(const std::string& rule, edna_route& compiled)
+{
+	std::istringstream tokens(rule);
+	std::string header;
+	std::string mask;
+	std::string target;
+	std::string trailing;
+	
+	if (!(tokens >> header >> target) || (tokens >> trailing))
+	{
+		return false;
+	}
+	
+	size_t slash = header.find('/');
+	
+	if (slash != std::string::npos)
+	{
+		mask = header.substr(slash + 1);
+		header = header.substr(0, slash);
+	}
+	
+	/* The header covers CLA, INS, P1 and P2; omitted bytes are wildcards */
+	if (!is_hex(header) || (header.size() > 8))
+	{
+		return false;
+	}
+	
+	if (mask.empty())
+	{
+		mask = std::string(header.size(), 'F');
+	}
+	else if (!is_hex(mask) || (mask.size() != header.size()))
+	{
+		return false;
+	}
+	
+	header.resize(8, '0');
+	mask.resize(8, '0');
+	
+	compiled.mask = strtoul(mask.c_str(), NULL, 16);
+	compiled.pattern = strtoul(header.c_str(), NULL, 16) & compiled.mask;
+	
+	if (target == "selected")
+	{
+		compiled.target = ROUTE_SELECTED;
+	}
+	else if (target == "select")
+	{
+		compiled.target = ROUTE_SELECT;
+	}
+	else if ((target.compare(0, 4, "aid:") == 0) && is_hex(target.substr(4)))
+	{
+		compiled.target = ROUTE_AID;
+		compiled.aid = bytestring(target.substr(4).c_str());
+	}
+	else if ((target.compare(0, 3, "sw:") == 0) && is_hex(target.substr(3)) && (target.size() == 7))
+	{
+		compiled.target = ROUTE_SW;
+		compiled.rsp = bytestring(target.substr(3).c_str());
+	}
+	else
+	{
+		return false;
+	}
+	
+	return true;
+}
+
+bool edna_router::load_config()
+{
+	std::vector<std::string> rules;
+	bool rv = true;
+	
+	routes.clear();
+	
+	if (edna_conf_get_string_array("routing", "rules", rules) != ERV_OK)
+	{
+		ERROR_MSG("Routing rules must be specified as a list of strings");
+		
+		rv = false;
+	}
+	
+	for (std::vector<std::string>::iterator i = rules.begin(); i != rules.end(); i++)
+	{
+		edna_route compiled;
+		
+		if (routes.size() >= MAX_ROUTES)
+		{
+			ERROR_MSG("Too many routing rules, ignoring all rules from \"%s\" onwards", i->c_str());
+			
+			rv = false;
+			
+			break;
+		}
+		
+		if (!parse_rule(*i, compiled))
+		{
+			ERROR_MSG("Invalid routing rule \"%s\", ignoring", i->c_str());
+			
+			rv = false;
+			
+			continue;
+		}
+		
+		DEBUG_MSG("Routing APDUs matching %08lX/%08lX to target %d", compiled.pattern, compiled.mask, compiled.target);
+		
+		routes.push_back(compiled);
+	}
+	
+	INFO_MSG("Loaded %zd routing rule(s)", routes.size());
+	
+	compile();
+	
+	return rv;
+}
+
+void edna_router::compile()
+{
+	/* The built-in SELECT by AID route comes after the configured ones */
+	edna_route select_route;
+	
+	select_route.pattern = 0x00A40400;
+	select_route.mask = 0xFFFFFF00;
+	select_route.target = ROUTE_SELECT;
+	
+	routes.push_back(select_route);
+	
+	/* Bucket the routes by CLA byte so dispatch only visits candidates */
+	cla_index.clear();
+	
+	for (unsigned long cla = 0; cla < 256; cla++)
+	{
+		cla_start[cla] = (unsigned int) cla_index.size();
+		
+		for (size_t i = 0; i < routes.size(); i++)
+		{
+			unsigned long cla_mask = (routes[i].mask >> 24) & 0xff;
+			
+			if ((cla & cla_mask) == ((routes[i].pattern >> 24) & 0xff))
+			{
+				cla_index.push_back((unsigned int) i);
+			}
+		}
+	}
+	
+	cla_start[256] = (unsigned int) cla_index.size();
+}
+
+const edna_route& edna_router::route(unsigned long header) const
+{
+	unsigned long cla = (header >> 24) & 0xff;
+	
+	for (unsigned int i = cla_start[cla]; i < cla_start[cla + 1]; i++)
+	{
+		const edna_route& candidate = routes[cla_index[i]];
+		
+		if ((header & candidate.mask) == candidate.pattern)
+		{
+			return candidate;
+		}
+	}
+	
+	return default_route;
+}
@@ -0,0 +1,105 @@
+/*
+ * Copyright (c) 2013 Roland van Rijswijk-Deij
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+ * IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * The Emulator Daemon for NFC Applications (EDNA)
+ * APDU routing table
+ */
+
+#ifndef _EDNA_ROUTE_H
+#define _EDNA_ROUTE_H
+
+#include "config.h"
+#include "edna_bytestring.h"
+#include <vector>
+#include <string>
+
+/* Route targets */
+#define ROUTE_SELECTED		0x00		/* forward to the currently selected application */
+#define ROUTE_SELECT		0x01		/* built-in SELECT by AID handler */
+#define ROUTE_AID			0x02		/* forward to the application registered for an AID */
+#define ROUTE_SW			0x03		/* respond with a fixed status word */
+
+struct edna_route
+{
+	unsigned long	pattern;	/* CLA/INS/P1/P2 pattern (big-endian) */
+	unsigned long	mask;		/* mask applied before comparing to the pattern */
+	int				target;		/* one of the ROUTE_... values */
+	bytestring		aid;		/* target AID for ROUTE_AID */
+	bytestring		rsp;		/* fixed response for ROUTE_SW */
+};
+
+class edna_router
+{
+public:
+	/**
+	 * Constructor; the table initially only holds the built-in routes
+	 */
+	edna_router();
+	
+	/**
+	 * Destructor
+	 */
+	~edna_router();
+	
+	/**
+	 * Compile the routing rules from the configuration into the table
+	 * @return true if all rules were compiled successfully
+	 */
+	bool load_config();
+	
+	/**
+	 * Find the route for an APDU; this does not allocate memory
+	 * @param header the APDU header as a big-endian CLA/INS/P1/P2 value
+	 * @return the first route with a matching pattern
+	 */
+	const edna_route& route(unsigned long header) const;
+	
+private:
+	/**
+	 * Parse a single rule of the form "<header>[/<mask>] <target>"
+	 * @param rule the rule text
+	 * @param compiled the compiled route
+	 * @return true if the rule was parsed successfully
+	 */
+	bool parse_rule(const std::string& rule, edna_route& compiled);
+	
+	/**
+	 * Rebuild the per-CLA index over the routes
+	 */
+	void compile();
+
+	std::vector<edna_route> routes;
+	
+	/* Route indices, bucketed per CLA byte; bucket c spans [cla_start[c], cla_start[c + 1]) */
+	std::vector<unsigned int> cla_index;
+	unsigned int cla_start[257];
+	
+	edna_route default_route;
+};
+
+#endif /* !_EDNA_ROUTE_H */
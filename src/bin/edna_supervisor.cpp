@@ -0,0 +1,346 @@
+/*
+ * Copyright (c) 2013 Roland van Rijswijk-Deij
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+ * IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * The Emulator Daemon for NFC Applications (EDNA)
+ * Applet process supervisor
+ */
+
+#include "config.h"
+#include "edna_supervisor.h"
+#include "edna_config.h"
+#include "edna_log.h"
+#include "edna_time.h"
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <string>
+#include <vector>
+
+#define SUPERVISE_INTERVAL		10000		/* us between checks for exited applets */
+#define DEFAULT_RESTART_DELAY	1000		/* ms */
+#define STOP_TIMEOUT			1000		/* ms to wait for applets to exit before killing them */
+
+edna_supervisor::edna_supervisor()
+{
+	should_run = true;
+	restart_delay = DEFAULT_RESTART_DELAY;
+	handing_over = false;
+	handed_off = false;
+}
+
+edna_supervisor::~edna_supervisor()
+{
+}
+
+bool edna_supervisor::load_config()
+{
+	std::vector<std::string> applets;
+	int spares = 0;
+	int max_standby = 0;
+	
+	if (edna_conf_get_string_array("supervisor", "applets", applets) != ERV_OK)
+	{
+		ERROR_MSG("Supervised applets must be specified as a list of strings");
+		
+		return false;
+	}
+	
+	edna_conf_get_int("supervisor", "spares", spares, 1);
+	edna_conf_get_int("supervisor", "restart_delay", restart_delay, DEFAULT_RESTART_DELAY);
+	edna_conf_get_int("comm", "max_standby", max_standby, 0);
+	
+	if (spares < 0) spares = 0;
+	
+	if (max_standby < 0) max_standby = 0;
+	
+	/* The daemon rejects spares beyond comm.max_standby, which would only make them exit and be restarted */
+	if (spares > max_standby)
+	{
+		WARNING_MSG("Supervisor spares (%d) exceed comm.max_standby (%d), keeping %d spare(s) per applet", spares, max_standby, max_standby);
+		
+		spares = max_standby;
+	}
+	
+	/* Each applet runs as one active process plus its warm spares */
+	for (std::vector<std::string>::iterator i = applets.begin(); i != applets.end(); i++)
+	{
+		for (int j = 0; j <= spares; j++)
+		{
+			applet_slot slot;
+			
+			slot.command = *i;
+			slot.pid = -1;
+			slot.started = 0;
+			slot.adopted = false;
+			
+			slots.push_back(slot);
+		}
+		
+		INFO_MSG("Supervising applet \"%s\" with %d spare(s)", i->c_str(), spares);
+	}
+	
+	return !slots.empty();
+}
+
+void edna_supervisor::adopt(const std::vector<edna_handoff_fd>& handed_over)
+{
+	for (std::vector<edna_handoff_fd>::const_iterator i = handed_over.begin(); i != handed_over.end(); i++)
+	{
+		if (i->type != HANDOFF_APPLET) continue;
+		
+		std::vector<applet_slot>::iterator slot = slots.begin();
+		
+		while ((slot != slots.end()) && ((slot->pid > 0) || (slot->command != i->command)))
+		{
+			slot++;
+		}
+		
+		if (slot == slots.end())
+		{
+			/* The applet is no longer configured, or has fewer spares now */
+			WARNING_MSG("Stopping handed over applet \"%s\" with process ID %d, it is not configured", i->command.c_str(), i->pid);
+			
+			::kill(i->pid, SIGTERM);
+			
+			continue;
+		}
+		
+		slot->pid = i->pid;
+		slot->started = edna_time_ms();
+		slot->adopted = true;
+		
+		INFO_MSG("Adopted applet \"%s\" with process ID %d", slot->command.c_str(), slot->pid);
+	}
+}
+
+void edna_supervisor::hand_over(std::vector<edna_handoff_fd>& fds)
+{
+	supervise_mutex.lock();
+	
+	/* Do not restart or stop applets while the new daemon takes them over */
+	handing_over = true;
+	
+	for (std::vector<applet_slot>::iterator i = slots.begin(); i != slots.end(); i++)
+	{
+		if (i->pid <= 0) continue;
+		
+		edna_handoff_fd applet;
+		
+		applet.type = HANDOFF_APPLET;
+		applet.pid = i->pid;
+		applet.command = i->command;
+		
+		fds.push_back(applet);
+	}
+	
+	supervise_mutex.unlock();
+}
+
+void edna_supervisor::hand_over_done(bool sent)
+{
+	supervise_mutex.lock();
+	
+	if (sent)
+	{
+		handed_off = true;
+		should_run = false;
+	}
+	
+	handing_over = false;
+	
+	supervise_mutex.unlock();
+}
+
+void edna_supervisor::terminate()
+{
+	should_run = false;
+	
+	waitexit();
+}
+
+void edna_supervisor::spawn(applet_slot& slot)
+{
+	/* Prepare everything before forking; the child may only call async-signal-safe functions */
+	std::string exec_command = "exec " + slot.command;
+	long max_fd = sysconf(_SC_OPEN_MAX);
+	
+	pid_t pid = fork();
+	
+	if (pid < 0)
+	{
+		ERROR_MSG("Failed to start applet \"%s\" (%d)", slot.command.c_str(), errno);
+		
+		return;
+	}
+	
+	if (pid == 0)
+	{
+		/* Child; do not leak the daemon's sockets into the applet */
+		for (long fd = 3; fd < max_fd; fd++)
+		{
+			close(fd);
+		}
+		
+		execl("/bin/sh", "sh", "-c", exec_command.c_str(), (char*) NULL);
+		
+		_exit(127);
+	}
+	
+	slot.pid = pid;
+	slot.started = edna_time_ms();
+	
+	INFO_MSG("Started applet \"%s\" with process ID %d", slot.command.c_str(), pid);
+}
+
+bool edna_supervisor::has_exited(applet_slot& slot, int& status)
+{
+	if (!slot.adopted)
+	{
+		return (waitpid(slot.pid, &status, WNOHANG) == slot.pid);
+	}
+	
+	/* Adopted applets are not our children and cannot be waited for */
+	if ((::kill(slot.pid, 0) != 0) && (errno == ESRCH))
+	{
+		status = 0;
+		
+		return true;
+	}
+	
+	return false;
+}
+
+void edna_supervisor::stop_all()
+{
+	for (std::vector<applet_slot>::iterator i = slots.begin(); i != slots.end(); i++)
+	{
+		if (i->pid > 0) ::kill(i->pid, SIGTERM);
+	}
+	
+	unsigned long long stop_start = edna_time_ms();
+	
+	for (std::vector<applet_slot>::iterator i = slots.begin(); i != slots.end(); i++)
+	{
+		while (i->pid > 0)
+		{
+			int status = 0;
+			
+			if (has_exited(*i, status))
+			{
+				i->pid = -1;
+			}
+			else if (edna_time_ms() - stop_start > STOP_TIMEOUT)
+			{
+				WARNING_MSG("Applet with process ID %d did not exit, killing it", i->pid);
+				
+				::kill(i->pid, SIGKILL);
+				
+				if (!i->adopted) waitpid(i->pid, NULL, 0);
+				
+				i->pid = -1;
+			}
+			else
+			{
+				usleep(SUPERVISE_INTERVAL);
+			}
+		}
+	}
+}
+
+/*virtual*/ void edna_supervisor::threadproc()
+{
+	DEBUG_MSG("Entering supervisor thread");
+	
+	supervise_mutex.lock();
+	
+	while (should_run)
+	{
+		for (std::vector<applet_slot>::iterator i = slots.begin(); (i != slots.end()) && !handing_over; i++)
+		{
+			int status = 0;
+			
+			if ((i->pid > 0) && has_exited(*i, status))
+			{
+				/* 
+				 * The daemon notices the hang-up on the applet's socket and promotes
+				 * a spare; all that is left here is to start a replacement spare
+				 */
+				if (i->adopted)
+				{
+					WARNING_MSG("Applet with process ID %d exited", i->pid);
+				}
+				else if (WIFEXITED(status))
+				{
+					WARNING_MSG("Applet with process ID %d exited with status %d", i->pid, WEXITSTATUS(status));
+				}
+				else
+				{
+					WARNING_MSG("Applet with process ID %d was terminated by signal %d", i->pid, WTERMSIG(status));
+				}
+				
+				i->pid = -1;
+				i->adopted = false;
+			}
+			
+			/* Restart exited applets, but not more often than the restart delay */
+			if ((i->pid <= 0) && (edna_time_ms() - i->started >= (unsigned long long) restart_delay))
+			{
+				spawn(*i);
+			}
+		}
+		
+		supervise_mutex.unlock();
+		
+		usleep(SUPERVISE_INTERVAL);
+		
+		supervise_mutex.lock();
+	}
+	
+	if (handed_off)
+	{
+		/* The new daemon supervises the applets from now on */
+		size_t running = 0;
+		
+		for (std::vector<applet_slot>::iterator i = slots.begin(); i != slots.end(); i++)
+		{
+			if (i->pid > 0) running++;
+		}
+		
+		INFO_MSG("Leaving %zd applet(s) running for the new daemon", running);
+	}
+	else
+	{
+		stop_all();
+	}
+	
+	supervise_mutex.unlock();
+	
+	DEBUG_MSG("Leaving supervisor thread");
+}
@@ -0,0 +1,137 @@
+/*
+ * Copyright (c) 2013 Roland van Rijswijk-Deij
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+ * IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * The Emulator Daemon for NFC Applications (EDNA)
+ * Applet process supervisor
+ */
+
+#ifndef _EDNA_SUPERVISOR_H
+#define _EDNA_SUPERVISOR_H
+
+#include "config.h"
+#include "edna_thread.h"
+#include "edna_mutex.h"
+#include "edna_handoff.h"
+#include <sys/types.h>
+#include <string>
+#include <vector>
+
+class edna_supervisor : public edna_thread
+{
+public:
+	/**
+	 * Constructor
+	 */
+	edna_supervisor();
+	
+	/**
+	 * Destructor
+	 */
+	~edna_supervisor();
+	
+	/**
+	 * Read the applets to supervise from the configuration
+	 * @return true if there is at least one applet to supervise
+	 */
+	bool load_config();
+	
+	/**
+	 * Take over the applets that a previous daemon handed over instead
+	 * of starting new ones; call before starting the thread
+	 * @param handed_over the descriptors and applets received in the handoff
+	 */
+	void adopt(const std::vector<edna_handoff_fd>& handed_over);
+	
+	/**
+	 * Suspend supervision and add the running applets to a handoff
+	 * @param fds the descriptors to hand over, to which the applets are added
+	 */
+	void hand_over(std::vector<edna_handoff_fd>& fds);
+	
+	/**
+	 * Finish a handoff started with hand_over
+	 * @param sent true if the new daemon has taken over the applets, in which
+	 *             case they are left running when the thread ends
+	 */
+	void hand_over_done(bool sent);
+	
+	/**
+	 * End the thread and stop all supervised applets
+	 */
+	void terminate();
+	
+protected:
+	/**
+	 * The thread body
+	 */
+	virtual void threadproc();
+	
+private:
+	/* A single supervised applet process */
+	struct applet_slot
+	{
+		std::string			command;
+		pid_t				pid;
+		unsigned long long	started;
+		bool				adopted;	/* not our child; started by a previous daemon */
+	};
+	
+	/**
+	 * Start the applet process for a slot
+	 * @param slot the slot to start the process for
+	 */
+	void spawn(applet_slot& slot);
+	
+	/**
+	 * Check whether the applet process for a slot has exited
+	 * @param slot the slot to check
+	 * @param status receives the wait status if the process was our child
+	 * @return true if the process has exited
+	 */
+	bool has_exited(applet_slot& slot, int& status);
+	
+	/**
+	 * Stop all running applet processes
+	 */
+	void stop_all();
+
+	std::vector<applet_slot> slots;
+	
+	int restart_delay;
+	
+	bool should_run;
+	
+	/* Protects the slots against a handoff by the communication thread */
+	edna_mutex supervise_mutex;
+	
+	bool handing_over;
+	
+	bool handed_off;
+};
+
+#endif /* !_EDNA_SUPERVISOR_H */
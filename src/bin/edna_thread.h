@@ -47,7 +47,7 @@ public:
 	/**
 	 * Destructor
 	 */
-	~edna_thread();
+	virtual ~edna_thread();
 	
 	/**
 	 * Start the thread
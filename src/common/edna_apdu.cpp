@@ -0,0 +1,213 @@
+/*
+ * Copyright (c) 2013 Roland van Rijswijk-Deij
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+ * IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * The Emulator Daemon for NFC Applications (EDNA)
+ * Parsed APDU class
+ */
+
+#include "config.h"
+#include "edna_apdu.h"
+
+// Constructor
+edna_apdu::edna_apdu()
+{
+	is_valid = false;
+	is_extended = false;
+	le_present = false;
+	data_offset = 4;
+	nc = 0;
+	ne = 0;
+}
+
+// Decode and validate a command APDU (ISO 7816-4 cases 1, 2, 3 and 4 in short and extended form)
+bool edna_apdu::parse(const unsigned char* apdu, const size_t apdu_len)
+{
+	raw.assign(apdu, apdu_len);
+	is_valid = false;
+	is_extended = false;
+	le_present = false;
+	data_offset = 4;
+	nc = 0;
+	ne = 0;
+
+	if (apdu_len < 4)
+	{
+		return false;
+	}
+
+	if (apdu_len == 4)
+	{
+		// Case 1: header only
+		is_valid = true;
+	}
+	else if (apdu_len == 5)
+	{
+		// Case 2S: Le only
+		le_present = true;
+		ne = (apdu[4] == 0) ? 256 : apdu[4];
+		is_valid = true;
+	}
+	else if (apdu[4] != 0)
+	{
+		// Case 3S or 4S: short Lc followed by data and optionally Le
+		nc = apdu[4];
+		data_offset = 5;
+
+		if (apdu_len == 5 + nc)
+		{
+			is_valid = true;
+		}
+		else if (apdu_len == 6 + nc)
+		{
+			le_present = true;
+			ne = (apdu[apdu_len - 1] == 0) ? 256 : apdu[apdu_len - 1];
+			is_valid = true;
+		}
+	}
+	else if (apdu_len == 7)
+	{
+		// Case 2E: extended Le only
+		is_extended = true;
+		le_present = true;
+		ne = (apdu[5] << 8) + apdu[6];
+		if (ne == 0) ne = 65536;
+		is_valid = true;
+	}
+	else if (apdu_len > 7)
+	{
+		// Case 3E or 4E: extended Lc followed by data and optionally Le
+		is_extended = true;
+		nc = (apdu[5] << 8) + apdu[6];
+		data_offset = 7;
+
+		if (nc == 0)
+		{
+			is_valid = false;
+		}
+		else if (apdu_len == 7 + nc)
+		{
+			is_valid = true;
+		}
+		else if (apdu_len == 9 + nc)
+		{
+			le_present = true;
+			ne = (apdu[apdu_len - 2] << 8) + apdu[apdu_len - 1];
+			if (ne == 0) ne = 65536;
+			is_valid = true;
+		}
+	}
+
+	if (!is_valid)
+	{
+		nc = 0;
+		ne = 0;
+		le_present = false;
+	}
+
+	return is_valid;
+}
+
+bool edna_apdu::valid() const
+{
+	return is_valid;
+}
+
+// Header fields
+unsigned char edna_apdu::cla() const
+{
+	return (raw.size() > 0) ? raw.const_byte_str()[0] : 0;
+}
+
+unsigned char edna_apdu::ins() const
+{
+	return (raw.size() > 1) ? raw.const_byte_str()[1] : 0;
+}
+
+unsigned char edna_apdu::p1() const
+{
+	return (raw.size() > 2) ? raw.const_byte_str()[2] : 0;
+}
+
+unsigned char edna_apdu::p2() const
+{
+	return (raw.size() > 3) ? raw.const_byte_str()[3] : 0;
+}
+
+unsigned long edna_apdu::header() const
+{
+	return ((unsigned long) cla() << 24) + ((unsigned long) ins() << 16) + ((unsigned long) p1() << 8) + p2();
+}
+
+// Command data
+const unsigned char* edna_apdu::data() const
+{
+	return (nc > 0) ? raw.const_byte_str() + data_offset : NULL;
+}
+
+bytestring_view edna_apdu::data_view() const
+{
+	return bytestring_view(data(), nc);
+}
+
+size_t edna_apdu::lc() const
+{
+	return nc;
+}
+
+size_t edna_apdu::le() const
+{
+	return ne;
+}
+
+bool edna_apdu::has_le() const
+{
+	return le_present;
+}
+
+bool edna_apdu::extended() const
+{
+	return is_extended;
+}
+
+const edna_apdu_buf& edna_apdu::bytes() const
+{
+	return raw;
+}
+
+// Return the status word of a response APDU
+/*static*/ unsigned short edna_apdu::status_word(const bytestring_view& rapdu)
+{
+	if (rapdu.size() < 2)
+	{
+		return 0;
+	}
+
+	const unsigned char* sw = rapdu.const_byte_str() + rapdu.size() - 2;
+
+	return (sw[0] << 8) + sw[1];
+}
@@ -0,0 +1,103 @@
+/*
+ * Copyright (c) 2013 Roland van Rijswijk-Deij
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+ * IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * The Emulator Daemon for NFC Applications (EDNA)
+ * Parsed APDU class
+ */
+
+#ifndef _EDNA_APDU_H
+#define _EDNA_APDU_H
+
+#include <cstddef>
+#include "config.h"
+#include "edna_bytestring.h"
+#include "edna_bytestring_view.h"
+#include "edna_apdu_buf.h"
+#include "edna_hex.h"
+
+// Status words the daemon responds with on behalf of applications
+constexpr auto SW_WRONG_LENGTH			= edna_hex("6700");
+constexpr auto SW_INS_NOT_SUPPORTED		= edna_hex("6d00");
+constexpr auto SW_UNKNOWN				= edna_hex("6f00");
+
+class edna_apdu
+{
+public:
+	// Constructor
+	edna_apdu();
+
+	// Decode and validate a command APDU; returns false if it is malformed
+	bool parse(const unsigned char* apdu, const size_t apdu_len);
+
+	// Is this a well-formed command APDU?
+	bool valid() const;
+
+	// Header fields
+	unsigned char cla() const;
+	unsigned char ins() const;
+	unsigned char p1() const;
+	unsigned char p2() const;
+
+	// Return the header as a big-endian CLA/INS/P1/P2 value
+	unsigned long header() const;
+
+	// Return the command data (Nc bytes, part of the raw APDU)
+	const unsigned char* data() const;
+
+	// Return the command data as a view into the raw APDU
+	bytestring_view data_view() const;
+
+	// Return the number of command data bytes (Nc)
+	size_t lc() const;
+
+	// Return the maximum number of expected response bytes (Ne, 0 if absent)
+	size_t le() const;
+
+	// Is an Le field present?
+	bool has_le() const;
+
+	// Does the APDU use extended length fields?
+	bool extended() const;
+
+	// Return the raw APDU
+	const edna_apdu_buf& bytes() const;
+
+	// Return the status word of a response APDU (0 if it has none)
+	static unsigned short status_word(const bytestring_view& rapdu);
+
+private:
+	edna_apdu_buf raw;
+	bool is_valid;
+	bool is_extended;
+	bool le_present;
+	size_t data_offset;
+	size_t nc;
+	size_t ne;
+};
+
+#endif // !_EDNA_APDU_H
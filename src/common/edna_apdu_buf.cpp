@@ -0,0 +1,178 @@
+/*
+ * Copyright (c) 2013 Roland van Rijswijk-Deij
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+ * IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * The Emulator Daemon for NFC Applications (EDNA)
+ * Small-buffer APDU byte string
+ */
+
+#include <atomic>
+#include <new>
+#include <string>
+#include <stdlib.h>
+#include <string.h>
+#include "config.h"
+#include "edna_apdu_buf.h"
+
+// Overflows to the heap, over all buffers
+static std::atomic<unsigned long> apdu_buf_heap_allocations(0);
+
+// Constructors
+edna_apdu_buf::edna_apdu_buf() : heap_buf(NULL), capacity(APDU_BUF_INLINE), len(0)
+{
+}
+
+edna_apdu_buf::edna_apdu_buf(const unsigned char* bytes, const size_t len) : heap_buf(NULL), capacity(APDU_BUF_INLINE), len(0)
+{
+	assign(bytes, len);
+}
+
+edna_apdu_buf::edna_apdu_buf(const edna_apdu_buf& in) : heap_buf(NULL), capacity(APDU_BUF_INLINE), len(0)
+{
+	assign(in.const_byte_str(), in.size());
+}
+
+// Destructor
+edna_apdu_buf::~edna_apdu_buf()
+{
+	free(heap_buf);
+}
+
+// Assignment
+edna_apdu_buf& edna_apdu_buf::operator=(const edna_apdu_buf& in)
+{
+	if (&in != this)
+	{
+		assign(in.const_byte_str(), in.size());
+	}
+
+	return *this;
+}
+
+edna_apdu_buf& edna_apdu_buf::operator=(const bytestring& in)
+{
+	assign(in.const_byte_str(), in.size());
+
+	return *this;
+}
+
+// Replace the contents
+void edna_apdu_buf::assign(const unsigned char* bytes, const size_t len)
+{
+	// The bytes may be part of this buffer, so only free the old storage after copying them
+	unsigned char* released = reserve(len);
+
+	if (len > 0)
+	{
+		memmove(byte_str(), bytes, len);
+	}
+
+	free(released);
+
+	this->len = len;
+}
+
+// Append data
+void edna_apdu_buf::append(const unsigned char* bytes, const size_t len)
+{
+	unsigned char* released = reserve(this->len + len);
+
+	if (len > 0)
+	{
+		memmove(byte_str() + this->len, bytes, len);
+	}
+
+	free(released);
+
+	this->len += len;
+}
+
+// Resize; the contents up to the new size are kept
+void edna_apdu_buf::resize(const size_t new_size)
+{
+	free(reserve(new_size));
+
+	len = new_size;
+}
+
+// Make room for the specified number of bytes, keeping the contents
+unsigned char* edna_apdu_buf::reserve(const size_t new_capacity)
+{
+	if (new_capacity <= capacity) return NULL;
+
+	// Grow geometrically, so appending stays linear
+	size_t grow_to = (capacity * 2 > new_capacity) ? capacity * 2 : new_capacity;
+	unsigned char* grown = (unsigned char*) malloc(grow_to);
+
+	if (grown == NULL) throw std::bad_alloc();
+
+	memcpy(grown, const_byte_str(), len);
+
+	unsigned char* released = heap_buf;
+
+	heap_buf = grown;
+	capacity = grow_to;
+
+	apdu_buf_heap_allocations.fetch_add(1, std::memory_order_relaxed);
+
+	return released;
+}
+
+// Return a hexadecimal character representation of the string
+std::string edna_apdu_buf::hex_str() const
+{
+	static const char hex_digits[] = "0123456789ABCDEF";
+	const unsigned char* bytes = const_byte_str();
+	std::string rv;
+
+	rv.reserve(len * 2);
+
+	for (size_t i = 0; i < len; i++)
+	{
+		rv += hex_digits[bytes[i] >> 4];
+		rv += hex_digits[bytes[i] & 0x0F];
+	}
+
+	return rv;
+}
+
+// Comparison
+bool edna_apdu_buf::operator==(const edna_apdu_buf& compare_to) const
+{
+	return (len == compare_to.len) && ((len == 0) || (memcmp(const_byte_str(), compare_to.const_byte_str(), len) == 0));
+}
+
+bool edna_apdu_buf::operator!=(const edna_apdu_buf& compare_to) const
+{
+	return !(*this == compare_to);
+}
+
+// Return the number of times any buffer overflowed to the heap
+/*static*/ unsigned long edna_apdu_buf::heap_allocations()
+{
+	return apdu_buf_heap_allocations.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,127 @@
+/*
+ * Copyright (c) 2013 Roland van Rijswijk-Deij
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+ * IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * The Emulator Daemon for NFC Applications (EDNA)
+ * Small-buffer APDU byte string
+ */
+
+#ifndef _EDNA_APDU_BUF_H
+#define _EDNA_APDU_BUF_H
+
+#include <cstddef>
+#include <string>
+#include "config.h"
+#include "edna_bytestring.h"
+#include "edna_bytestring_view.h"
+#include "edna_hex.h"
+
+// Bytes stored inline: a short C-APDU (up to 261 bytes) plus a reader status or command byte
+#define APDU_BUF_INLINE		264
+
+/*
+ * Byte string for the per-APDU path; short APDUs are stored inline, so
+ * only extended length APDUs allocate memory. The class has no virtual
+ * functions, and copies only copy the bytes in use.
+ */
+class edna_apdu_buf
+{
+public:
+	// Constructors
+	edna_apdu_buf();
+
+	edna_apdu_buf(const unsigned char* bytes, const size_t len);
+
+	edna_apdu_buf(const edna_apdu_buf& in);
+
+	template <size_t N> edna_apdu_buf(const edna_hex_bytes<N>& hex) : heap_buf(NULL), capacity(APDU_BUF_INLINE), len(0)
+	{
+		assign(hex.bytes, N);
+	}
+
+	// Destructor
+	~edna_apdu_buf();
+
+	// Assignment
+	edna_apdu_buf& operator=(const edna_apdu_buf& in);
+
+	edna_apdu_buf& operator=(const bytestring& in);
+
+	template <size_t N> edna_apdu_buf& operator=(const edna_hex_bytes<N>& hex)
+	{
+		assign(hex.bytes, N);
+
+		return *this;
+	}
+
+	// Replace the contents
+	void assign(const unsigned char* bytes, const size_t len);
+
+	// Append data
+	void append(const unsigned char* bytes, const size_t len);
+
+	// Array operator
+	unsigned char& operator[](size_t pos) { return byte_str()[pos]; }
+
+	unsigned char operator[](size_t pos) const { return const_byte_str()[pos]; }
+
+	// Return the bytes
+	unsigned char* byte_str() { return (heap_buf != NULL) ? heap_buf : inline_buf; }
+
+	const unsigned char* const_byte_str() const { return (heap_buf != NULL) ? heap_buf : inline_buf; }
+
+	// Return the size in bytes
+	size_t size() const { return len; }
+
+	// Return a view of the bytes, valid until the buffer is changed
+	operator bytestring_view() const { return bytestring_view(const_byte_str(), len); }
+
+	// Resize; the contents up to the new size are kept
+	void resize(const size_t new_size);
+
+	// Return a hexadecimal character representation of the string
+	std::string hex_str() const;
+
+	// Comparison
+	bool operator==(const edna_apdu_buf& compare_to) const;
+	bool operator!=(const edna_apdu_buf& compare_to) const;
+
+	// Return the number of times any buffer overflowed to the heap
+	static unsigned long heap_allocations();
+
+private:
+	// Make room for the specified number of bytes, keeping the contents; returns
+	// the old heap storage (or NULL), which the caller must free after use
+	unsigned char* reserve(const size_t new_capacity);
+
+	unsigned char inline_buf[APDU_BUF_INLINE];
+	unsigned char* heap_buf;
+	size_t capacity;
+	size_t len;
+};
+
+#endif // !_EDNA_APDU_BUF_H
@@ -39,18 +39,15 @@
 #include "edna_bytestring.h"
 
 // Constructors
-bytestring::bytestring()
+bytestring::bytestring() : offset(0)
 {
 }
 
-bytestring::bytestring(const unsigned char* bytes, const size_t bytesLen)
+bytestring::bytestring(const unsigned char* bytes, const size_t bytesLen) : byteString(bytes, bytes + bytesLen), offset(0)
 {
-	byteString.resize(bytesLen);
-
-	memcpy(&byteString[0], bytes, bytesLen);
 }
 
-bytestring::bytestring(const char* hexString)
+bytestring::bytestring(const char* hexString) : offset(0)
 {
 	std::string hex = std::string(hexString);
 
@@ -71,7 +68,7 @@ bytestring::bytestring(const char* hexString)
 	}
 }
 
-bytestring::bytestring(const unsigned long longValue)
+bytestring::bytestring(const unsigned long longValue) : offset(0)
 {
 	unsigned long setValue = longValue;
 
@@ -94,25 +91,58 @@ bytestring::bytestring(const unsigned long longValue)
 		setValue >>= 8;
 	}
 
-	byteString.resize(8);
-	memcpy(&byteString[0], byteStrIn, 8);
+	byteString.assign(byteStrIn, byteStrIn + 8);
+}
+
+bytestring::bytestring(const bytestring& in) : byteString(in.byteString.begin() + in.offset, in.byteString.end()), offset(0)
+{
+}
+
+bytestring::bytestring(bytestring&& in) noexcept : byteString(std::move(in.byteString)), offset(in.offset)
+{
+	in.byteString.clear();
+	in.offset = 0;
+}
+
+// Assignment
+bytestring& bytestring::operator=(const bytestring& in)
+{
+	if (this != &in)
+	{
+		byteString.assign(in.byteString.begin() + in.offset, in.byteString.end());
+		offset = 0;
+	}
+
+	return *this;
 }
 
-bytestring::bytestring(const bytestring& in)
+bytestring& bytestring::operator=(bytestring&& in) noexcept
 {
-	this->byteString = in.byteString;
+	if (this != &in)
+	{
+		byteString = std::move(in.byteString);
+		offset = in.offset;
+
+		in.byteString.clear();
+		in.offset = 0;
+	}
+
+	return *this;
 }
 
 // Append data
 bytestring& bytestring::operator+=(const bytestring& append)
 {
 	size_t curLen = byteString.size();
-	size_t toAdd = append.byteString.size();
-	size_t newLen = curLen + toAdd;
+	size_t toAdd = append.size();
 
-	byteString.resize(newLen);
+	// Resize first, so appending a string to itself copies from the new storage
+	byteString.resize(curLen + toAdd);
 
-	memcpy(&byteString[curLen], &append.byteString[0], toAdd);
+	if (toAdd > 0)
+	{
+		memcpy(&byteString[curLen], append.const_byte_str(), toAdd);
+	}
 
 	return *this;
 }
@@ -128,6 +158,8 @@ bytestring& bytestring::operator+=(const unsigned short ushort_val)
 {
 	this->operator+=((unsigned char) ((ushort_val >> 8) & 0xff));
 	this->operator+=((unsigned char) (ushort_val & 0xff));
+
+	return *this;
 }
 
 // XORing
@@ -137,7 +169,7 @@ bytestring& bytestring::operator^=(const bytestring& rhs)
 
 	for (size_t i = 0; i < xorLen; i++)
 	{
-		byteString[i] ^= rhs.const_byte_str()[i];
+		byteString[offset + i] ^= rhs.const_byte_str()[i];
 	}
 
 	return *this;
@@ -146,22 +178,22 @@ bytestring& bytestring::operator^=(const bytestring& rhs)
 // Return a substring
 bytestring bytestring::substr(const size_t start, const size_t len /* = SIZE_T_MAX */) const
 {
-	size_t retLen = std::min(len, byteString.size() - start);
-
-	if (start >= byteString.size())
+	if (start >= size())
 	{
 		return bytestring();
 	}
 	else
 	{
-		return bytestring(&byteString[start], retLen);
+		return bytestring(const_byte_str() + start, std::min(len, size() - start));
 	}
 }
 
 // Add data
 bytestring operator+(const bytestring& lhs, const bytestring& rhs)
 {
-	bytestring rv = lhs;
+	bytestring rv;
+	rv.reserve(lhs.size() + rhs.size());
+	rv += lhs;
 	rv += rhs;
 
 	return rv;
@@ -186,19 +218,19 @@ bytestring operator+(const bytestring& lhs, const unsigned char rhs)
 // Array operator
 unsigned char& bytestring::operator[](size_t pos)
 {
-	return byteString[pos];
+	return byteString[offset + pos];
 }
 
 // Return the byte string data
 unsigned char* bytestring::byte_str()
 {
-	return &byteString[0];
+	return byteString.data() + offset;
 }
 
 // Return the const byte string
 const unsigned char* bytestring::const_byte_str() const
 {
-	return (const unsigned char*) &byteString[0];
+	return byteString.data() + offset;
 }
 
 // Return a hexadecimal character representation of the string
@@ -207,7 +239,7 @@ std::string bytestring::hex_str() const
 	std::string rv;
 	char hex[3];
 
-	for (size_t i = 0; i < byteString.size(); i++)
+	for (size_t i = offset; i < byteString.size(); i++)
 	{
 		sprintf(hex, "%02X", byteString[i]);
 
@@ -222,29 +254,37 @@ bytestring bytestring::split(size_t len)
 {
 	bytestring rv = substr(0, len);
 
-	size_t newSize = (byteString.size() > len) ? (byteString.size() - len) : 0;
+	consume(len);
 
-	if (newSize > 0)
-	{
-		for (size_t i = 0; i < newSize; i++)
-		{
-			byteString[i] = byteString[i + len];
-		}
-	}
+	return rv;
+}
 
-	byteString.resize(newSize);
+// Drop the specified number of bytes from the front of the string
+void bytestring::consume(size_t len)
+{
+	offset += std::min(len, size());
 
-	return rv;
+	// Only move the remainder down once it is smaller than what was consumed, which keeps consuming a string front to back linear
+	if (offset == byteString.size())
+	{
+		byteString.clear();
+		offset = 0;
+	}
+	else if (offset >= byteString.size() - offset)
+	{
+		byteString.erase(byteString.begin(), byteString.begin() + offset);
+		offset = 0;
+	}
 }
 
 // The size of the byte string in bits
 size_t bytestring::bits() const
 {
-	size_t bits = byteString.size() * 8;
+	size_t bits = size() * 8;
 
 	if (bits == 0) return 0;
 
-	for (size_t i = 0; i < byteString.size(); i++)
+	for (size_t i = offset; i < byteString.size(); i++)
 	{
 		unsigned char byte = byteString[i];
 
@@ -267,19 +307,29 @@ size_t bytestring::bits() const
 // The size of the byte string in bytes
 size_t bytestring::size() const
 {
-	return byteString.size();
+	return byteString.size() - offset;
 }
 
 void bytestring::resize(const size_t newSize)
 {
-	byteString.resize(newSize);
+	byteString.resize(offset + newSize);
+}
+
+void bytestring::reserve(const size_t newCapacity)
+{
+	byteString.reserve(offset + newCapacity);
 }
 
 void bytestring::wipe(const size_t newSize /* = 0 */)
 {
-	this->resize(newSize);
+	// Also clear the bytes that were split off
+	if (!byteString.empty())
+	{
+		memset(byteString.data(), 0x00, byteString.size());
+	}
 
-	memset(&byteString[0], 0x00, byteString.size());
+	byteString.assign(newSize, 0x00);
+	offset = 0;
 }
 
 // Comparison
@@ -290,7 +340,7 @@ bool bytestring::operator==(const bytestring& compareTo) const
 		return false;
 	}
 
-	return (memcmp(&byteString[0], &compareTo.byteString[0], this->size()) == 0);
+	return (this->size() == 0) || (memcmp(const_byte_str(), compareTo.const_byte_str(), this->size()) == 0);
 }
 
 bool bytestring::operator!=(const bytestring& compareTo) const
@@ -300,17 +350,35 @@ bool bytestring::operator!=(const bytestring& compareTo) const
 		return true;
 	}
 
-	return (memcmp(&byteString[0], &compareTo.byteString[0], this->size()) != 0);
+	return (this->size() > 0) && (memcmp(const_byte_str(), compareTo.const_byte_str(), this->size()) != 0);
 }
 
+// Lexicographic ordering; a string is ordered before any longer string it is a prefix of
 bool bytestring::operator<(const bytestring& compareTo) const
 {
-	return this->hex_str() < compareTo.hex_str();
+	size_t commonLen = std::min(this->size(), compareTo.size());
+	int rv = (commonLen > 0) ? memcmp(const_byte_str(), compareTo.const_byte_str(), commonLen) : 0;
+
+	return (rv < 0) || ((rv == 0) && (this->size() < compareTo.size()));
 }
 
 bool bytestring::operator>(const bytestring& compareTo) const
 {
-	return this->hex_str() > compareTo.hex_str();
+	return compareTo < *this;
+}
+
+// Hash the contents (FNV-1a)
+size_t bytestring_hash_bytes(const unsigned char* bytes, const size_t len)
+{
+	unsigned long long hash = 0xcbf29ce484222325ULL;
+
+	for (size_t i = 0; i < len; i++)
+	{
+		hash ^= bytes[i];
+		hash *= 0x100000001b3ULL;
+	}
+
+	return (size_t) hash;
 }
 
 // XOR data
@@ -36,10 +36,12 @@
 #include <cstddef>
 #include <vector>
 #include <string>
+#include <functional>
 #include <stdlib.h>
 #include <limits.h>
 #include <gmpxx.h>
 #include "config.h"
+#include "edna_hex.h"
 
 #ifndef SIZE_T_MAX
 #define SIZE_T_MAX ((size_t) -1)
@@ -58,15 +60,27 @@ public:
 	bytestring(const unsigned long longValue);
 
 	bytestring(const bytestring& in);
-	
+
+	bytestring(bytestring&& in) noexcept;
+
+	// Construct from a compile-time hex literal
+	template <size_t N> bytestring(const edna_hex_bytes<N>& hex) : byteString(hex.bytes, hex.bytes + N), offset(0) { }
+
 	// Destructor
 	virtual ~bytestring() { }
 
+	// Assignment
+	bytestring& operator=(const bytestring& in);
+	bytestring& operator=(bytestring&& in) noexcept;
+
 	// Append data
 	bytestring& operator+=(const bytestring& append);
 	bytestring& operator+=(const unsigned char byte);
 	bytestring& operator+=(const unsigned short ushort_val);
 
+	// Assign a compile-time hex literal, reusing the storage
+	template <size_t N> bytestring& operator=(const edna_hex_bytes<N>& hex) { byteString.assign(hex.bytes, hex.bytes + N); offset = 0; return *this; }
+
 	// Return a substring
 	bytestring substr(const size_t start, const size_t len = SIZE_T_MAX) const;
 
@@ -85,6 +99,9 @@ public:
 	// Split of the specified part of the string as a separate byte string
 	bytestring split(size_t len);
 
+	// Drop the specified number of bytes from the front of the string; amortised O(1) per byte
+	void consume(size_t len);
+
 	// Return the size in bits
 	size_t bits() const;
 
@@ -94,6 +111,9 @@ public:
 	// Resize
 	void resize(const size_t newSize);
 
+	// Reserve room for the specified number of bytes
+	void reserve(const size_t newCapacity);
+
 	// Wipe
 	void wipe(const size_t newSize = 0);
 
@@ -108,6 +128,9 @@ public:
 
 private:
 	std::vector<unsigned char> byteString;
+
+	// Start of the string in byteString; the bytes before it were split off
+	size_t offset;
 };
 
 // Add data
@@ -118,5 +141,16 @@ bytestring operator+(const bytestring& lhs, const unsigned char rhs);
 // XOR data
 bytestring operator^(const bytestring& lhs, const bytestring& rhs);
 
+// Hash a byte string; equal contents give equal hashes, however they are stored
+size_t bytestring_hash_bytes(const unsigned char* bytes, const size_t len);
+
+namespace std
+{
+	template <> struct hash<bytestring>
+	{
+		size_t operator()(const bytestring& in) const { return bytestring_hash_bytes(in.const_byte_str(), in.size()); }
+	};
+}
+
 #endif // !_EDNA_BYTESTRING_H
 
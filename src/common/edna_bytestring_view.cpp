@@ -0,0 +1,95 @@
+/*
+ * Copyright (c) 2013 Roland van Rijswijk-Deij
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+ * IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * The Emulator Daemon for NFC Applications (EDNA)
+ * Non-owning view of a byte string
+ */
+
+#include <algorithm>
+#include <string>
+#include <string.h>
+#include "config.h"
+#include "edna_bytestring_view.h"
+
+// Return a view of part of the bytes
+bytestring_view bytestring_view::substr(const size_t start, const size_t sub_len /* = SIZE_T_MAX */) const
+{
+	if (start >= len)
+	{
+		return bytestring_view();
+	}
+
+	return bytestring_view(bytes + start, std::min(sub_len, len - start));
+}
+
+// Return a copy of the bytes
+bytestring bytestring_view::copy() const
+{
+	return (len > 0) ? bytestring(bytes, len) : bytestring();
+}
+
+// Return a hexadecimal character representation of the bytes
+std::string bytestring_view::hex_str() const
+{
+	static const char hex_digits[] = "0123456789ABCDEF";
+	std::string rv;
+
+	rv.reserve(len * 2);
+
+	for (size_t i = 0; i < len; i++)
+	{
+		rv += hex_digits[bytes[i] >> 4];
+		rv += hex_digits[bytes[i] & 0x0F];
+	}
+
+	return rv;
+}
+
+// Comparison
+bool bytestring_view::operator==(const bytestring_view& compare_to) const
+{
+	return (len == compare_to.len) && ((len == 0) || (memcmp(bytes, compare_to.bytes, len) == 0));
+}
+
+bool bytestring_view::operator!=(const bytestring_view& compare_to) const
+{
+	return !(*this == compare_to);
+}
+
+bool bytestring_view::operator<(const bytestring_view& compare_to) const
+{
+	size_t common_len = std::min(len, compare_to.len);
+	int rv = (common_len > 0) ? memcmp(bytes, compare_to.bytes, common_len) : 0;
+
+	return (rv < 0) || ((rv == 0) && (len < compare_to.len));
+}
+
+bool bytestring_view::operator>(const bytestring_view& compare_to) const
+{
+	return compare_to < *this;
+}
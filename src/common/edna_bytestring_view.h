@@ -0,0 +1,104 @@
+/*
+ * Copyright (c) 2013 Roland van Rijswijk-Deij
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+ * IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * The Emulator Daemon for NFC Applications (EDNA)
+ * Non-owning view of a byte string
+ */
+
+#ifndef _EDNA_BYTESTRING_VIEW_H
+#define _EDNA_BYTESTRING_VIEW_H
+
+#include <cstddef>
+#include <string>
+#include "config.h"
+#include "edna_bytestring.h"
+
+/*
+ * Read-only pointer and length into bytes owned by someone else (a
+ * bytestring, an APDU buffer or a plain array). Slicing a view does not
+ * copy; the view must not outlive the bytes it points to.
+ */
+class bytestring_view
+{
+public:
+	// Constructors
+	bytestring_view() : bytes(NULL), len(0) { }
+
+	bytestring_view(const unsigned char* bytes, const size_t len) : bytes(bytes), len(len) { }
+
+	bytestring_view(const bytestring& in) : bytes((in.size() > 0) ? in.const_byte_str() : NULL), len(in.size()) { }
+
+	// Array operator
+	unsigned char operator[](size_t pos) const { return bytes[pos]; }
+
+	// Return the bytes
+	const unsigned char* const_byte_str() const { return bytes; }
+
+	// Return the size in bytes
+	size_t size() const { return len; }
+
+	// Return a view of part of the bytes
+	bytestring_view substr(const size_t start, const size_t sub_len = SIZE_T_MAX) const;
+
+	// Return a copy of the bytes
+	bytestring copy() const;
+
+	// Return a hexadecimal character representation of the bytes
+	std::string hex_str() const;
+
+	// Comparison; the ordering is lexicographic, with a prefix ordered before longer strings
+	bool operator==(const bytestring_view& compare_to) const;
+	bool operator!=(const bytestring_view& compare_to) const;
+	bool operator<(const bytestring_view& compare_to) const;
+	bool operator>(const bytestring_view& compare_to) const;
+
+private:
+	const unsigned char* bytes;
+	size_t len;
+};
+
+/*
+ * Transparent ordering for containers keyed on bytestring, so that they
+ * can be searched with a view (e.g. an AID in a C-APDU) without copying
+ */
+struct bytestring_less
+{
+	typedef void is_transparent;
+
+	bool operator()(const bytestring_view& lhs, const bytestring_view& rhs) const { return lhs < rhs; }
+};
+
+namespace std
+{
+	template <> struct hash<bytestring_view>
+	{
+		size_t operator()(const bytestring_view& in) const { return bytestring_hash_bytes(in.const_byte_str(), in.size()); }
+	};
+}
+
+#endif // !_EDNA_BYTESTRING_VIEW_H
@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2013 Roland van Rijswijk-Deij
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+ * IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * The Emulator Daemon for NFC Applications (EDNA)
+ * Compile-time hexadecimal literals
+ */
+
+#ifndef _EDNA_HEX_H
+#define _EDNA_HEX_H
+
+#include <cstddef>
+#include "config.h"
+
+/*
+ * A fixed-size byte array produced by edna_hex(); constant commands and
+ * status words declared as constexpr need no parsing or allocation at
+ * run time
+ */
+template <size_t N>
+struct edna_hex_bytes
+{
+	unsigned char bytes[N];
+
+	// Return the number of bytes
+	constexpr size_t size() const { return N; }
+
+	// Array operator
+	constexpr unsigned char operator[](size_t pos) const { return bytes[pos]; }
+};
+
+// Deliberately not constexpr, so an invalid digit in a literal fails to compile
+inline unsigned char edna_hex_invalid_digit() { return 0; }
+
+// Return the value of a hexadecimal digit
+constexpr unsigned char edna_hex_nibble(const char c)
+{
+	return ((c >= '0') && (c <= '9')) ? (unsigned char) (c - '0') :
+	       ((c >= 'a') && (c <= 'f')) ? (unsigned char) (c - 'a' + 10) :
+	       ((c >= 'A') && (c <= 'F')) ? (unsigned char) (c - 'A' + 10) :
+	       edna_hex_invalid_digit();
+}
+
+// Convert a hexadecimal string literal, e.g. constexpr auto cmd = edna_hex("83100100")
+template <size_t L>
+constexpr edna_hex_bytes<(L - 1) / 2> edna_hex(const char (&hex)[L])
+{
+	static_assert((L > 1) && ((L - 1) % 2 == 0), "hex literals must have an even, non-zero number of digits");
+
+	edna_hex_bytes<(L - 1) / 2> rv = { };
+
+	for (size_t i = 0; i < (L - 1) / 2; i++)
+	{
+		rv.bytes[i] = (unsigned char) ((edna_hex_nibble(hex[2 * i]) << 4) | edna_hex_nibble(hex[2 * i + 1]));
+	}
+
+	return rv;
+}
+
+#endif // !_EDNA_HEX_H
@@ -0,0 +1,187 @@
+/*
+ * Copyright (c) 2013 Roland van Rijswijk-Deij
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+ * IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * The Emulator Daemon for NFC Applications (EDNA)
+ * Network transport helpers
+ */
+
+#include "config.h"
+#include "edna_net.h"
+#include "edna_proto.h"
+#include <string>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+/* Split a "host:port" or "[v6-address]:port" string; the port is optional */
+bool edna_split_host_port(const char* host_port, std::string& host, std::string& port)
+{
+	if (host_port == NULL)
+	{
+		return false;
+	}
+
+	std::string in(host_port);
+	size_t port_sep = std::string::npos;
+
+	if (!in.empty() && (in[0] == '['))
+	{
+		size_t end_bracket = in.find(']');
+
+		if (end_bracket == std::string::npos)
+		{
+			return false;
+		}
+
+		host = in.substr(1, end_bracket - 1);
+
+		if (end_bracket + 1 < in.size())
+		{
+			if (in[end_bracket + 1] != ':') return false;
+
+			port_sep = end_bracket + 1;
+		}
+	}
+	else
+	{
+		port_sep = in.rfind(':');
+
+		host = in.substr(0, port_sep);
+	}
+
+	port = (port_sep != std::string::npos) ? in.substr(port_sep + 1) : std::string(EDNA_TCP_PORT);
+
+	return !host.empty() && !port.empty();
+}
+
+/* Set the options used for TCP connections between the daemon and applets */
+void edna_set_tcp_options(int socket_fd)
+{
+	int on = 1;
+
+	/* APDUs are small and latency-sensitive; never wait to coalesce them */
+	setsockopt(socket_fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+	/* Detect peers that vanished without closing the connection */
+	setsockopt(socket_fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+
+#ifdef TCP_KEEPIDLE
+	int keep_idle = EDNA_TCP_KEEPIDLE;
+	int keep_intvl = EDNA_TCP_KEEPINTVL;
+	int keep_cnt = EDNA_TCP_KEEPCNT;
+
+	setsockopt(socket_fd, IPPROTO_TCP, TCP_KEEPIDLE, &keep_idle, sizeof(keep_idle));
+	setsockopt(socket_fd, IPPROTO_TCP, TCP_KEEPINTVL, &keep_intvl, sizeof(keep_intvl));
+	setsockopt(socket_fd, IPPROTO_TCP, TCP_KEEPCNT, &keep_cnt, sizeof(keep_cnt));
+#endif // TCP_KEEPIDLE
+}
+
+/* Read exactly the specified number of bytes; fails on errors and if the peer closed the connection */
+bool edna_read_fully(int fd, unsigned char* buf, size_t len)
+{
+	while (len > 0)
+	{
+		ssize_t received = read(fd, buf, len);
+
+		if ((received < 0) && (errno == EINTR)) continue;
+
+		/* Error or connection closed by the peer */
+		if (received <= 0) return false;
+
+		buf += received;
+		len -= received;
+	}
+
+	return true;
+}
+
+/* Receive the length and command or status byte of a frame; data_len is the size of the data that follows */
+bool edna_recv_frame_header(int fd, unsigned char& type, size_t& data_len)
+{
+	unsigned char hdr_buf[3];
+
+	if (!edna_read_fully(fd, hdr_buf, 3))
+	{
+		return false;
+	}
+
+	size_t frame_len = (hdr_buf[0] << 8) + hdr_buf[1];
+
+	/* The length includes the command or status byte */
+	if (frame_len < 1)
+	{
+		return false;
+	}
+
+	type = hdr_buf[2];
+	data_len = frame_len - 1;
+
+	return true;
+}
+
+/* Send a frame in one go without copying the data; a closed connection fails with EPIPE instead of raising SIGPIPE */
+bool edna_send_frame(int fd, unsigned char type, const unsigned char* data, size_t data_len)
+{
+	if (data_len + 1 > 0xffff) return false;
+
+	unsigned short frame_len = (unsigned short) (data_len + 1);
+	unsigned char hdr_buf[3];
+
+	hdr_buf[0] = frame_len >> 8;
+	hdr_buf[1] = frame_len & 0xff;
+	hdr_buf[2] = type;
+
+	struct iovec tx_iov[2];
+
+	tx_iov[0].iov_base = hdr_buf;
+	tx_iov[0].iov_len = 3;
+	tx_iov[1].iov_base = (void*) data;
+	tx_iov[1].iov_len = data_len;
+
+	struct msghdr msg;
+
+	memset(&msg, 0, sizeof(msg));
+
+	msg.msg_iov = tx_iov;
+	msg.msg_iovlen = (data_len > 0) ? 2 : 1;
+
+	ssize_t tx_sent = 0;
+
+	do
+	{
+		tx_sent = sendmsg(fd, &msg, MSG_NOSIGNAL);
+	}
+	while ((tx_sent < 0) && (errno == EINTR));
+
+	return (tx_sent == (ssize_t) (data_len + 3));
+}
@@ -0,0 +1,61 @@
+/*
+ * Copyright (c) 2013 Roland van Rijswijk-Deij
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+ * IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * The Emulator Daemon for NFC Applications (EDNA)
+ * Network transport helpers
+ */
+
+#ifndef _EDNA_NET_H
+#define _EDNA_NET_H
+
+#include "config.h"
+#include <string>
+#include <stddef.h>
+
+/* Split a "host:port" or "[v6-address]:port" string; the port is optional */
+bool edna_split_host_port(const char* host_port, std::string& host, std::string& port);
+
+/* Set the options used for TCP connections between the daemon and applets */
+void edna_set_tcp_options(int socket_fd);
+
+/*
+ * Framing shared by the daemon, its applications and the loopback driver:
+ * a 16-bit big-endian length followed by a command or status byte and
+ * the data that goes with it
+ */
+
+/* Read exactly the specified number of bytes; fails on errors and if the peer closed the connection */
+bool edna_read_fully(int fd, unsigned char* buf, size_t len);
+
+/* Receive the length and command or status byte of a frame; data_len is the size of the data that follows */
+bool edna_recv_frame_header(int fd, unsigned char& type, size_t& data_len);
+
+/* Send a frame in one go without copying the data; a closed connection fails with EPIPE instead of raising SIGPIPE */
+bool edna_send_frame(int fd, unsigned char type, const unsigned char* data, size_t data_len);
+
+#endif /* !_EDNA_NET_H */
@@ -36,6 +36,17 @@
 /* UNIX domain socket name */
 #define EDNA_SOCKET			"/tmp/edna-comm"
 
+/* UNIX domain socket for the loopback reader driver */
+#define EDNA_LOOPBACK_SOCKET	"/tmp/edna-loopback"
+
+/* Default TCP port for remote applets */
+#define EDNA_TCP_PORT		"7816"
+
+/* TCP keepalive settings for remote applets (seconds, seconds, probes) */
+#define EDNA_TCP_KEEPIDLE	10
+#define EDNA_TCP_KEEPINTVL	2
+#define EDNA_TCP_KEEPCNT	3
+
 #ifndef UNIX_PATH_MAX
 #define UNIX_PATH_MAX 		80 			/* should be safe */
 #endif // !UNIX_PATH_MAX
@@ -48,10 +59,11 @@
 #define REGISTER_AID		0x02
 #define DISCONNECT			0x03
 
-/* Virtual card-side API commands */
+/* Virtual card-side API commands (also sent by the loopback reader driver) */
 #define POWER_UP			0x01
 #define POWER_DOWN			0x02
 #define TRANSCEIVE_APDU		0x03
+#define PING				0x04
 
 /* API return values */
 #define EDNA_OK				0x00
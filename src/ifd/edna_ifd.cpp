@@ -0,0 +1,415 @@
+/*
+ * Copyright (c) 2013 Roland van Rijswijk-Deij
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+ * IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * The Emulator Daemon for NFC Applications (EDNA)
+ * Loopback IFD handler; presents the daemon as a virtual contactless
+ * card reader to pcsc-lite, so local PC/SC applications can send APDUs
+ * to the registered applications without NFC hardware
+ */
+
+#include "config.h"
+#include "edna_proto.h"
+#include "edna_net.h"
+#include <ifdhandler.h>
+#include <reader.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/* Number of virtual readers (one slot each) the driver can serve */
+#define EDNA_IFD_MAX_READERS	4
+
+/*
+ * ATR of an ISO 14443-4 card without historical bytes, as constructed
+ * by PC/SC compliant contactless readers (PC/SC part 3, section 3.1.3.2.3.1)
+ */
+static const UCHAR edna_ifd_atr[] = { 0x3B, 0x80, 0x80, 0x01, 0x01 };
+
+struct edna_ifd_reader
+{
+	edna_ifd_reader() : in_use(false), fd(-1), powered(false)
+	{
+		socket_path[0] = '\0';
+		
+		pthread_mutex_init(&mutex, NULL);
+	}
+	
+	bool in_use;
+	char socket_path[UNIX_PATH_MAX];
+	int fd;
+	bool powered;
+	
+	/* pcscd may call the driver for different readers from different threads; only calls for the same reader are serialised */
+	pthread_mutex_t mutex;
+};
+
+static edna_ifd_reader edna_ifd_readers[EDNA_IFD_MAX_READERS];
+
+/* Get the reader for a logical unit number; only slot 0 exists */
+static edna_ifd_reader* edna_ifd_get_reader(DWORD Lun)
+{
+	DWORD reader_index = (Lun >> 16) & 0xffff;
+	
+	if ((reader_index >= EDNA_IFD_MAX_READERS) || ((Lun & 0xffff) != 0))
+	{
+		return NULL;
+	}
+	
+	return &edna_ifd_readers[reader_index];
+}
+
+/* Connect to the daemon if not connected; the card is present while connected */
+static bool edna_ifd_connect(edna_ifd_reader* reader)
+{
+	if (reader->fd >= 0) return true;
+	
+	int fd = socket(PF_UNIX, SOCK_STREAM, 0);
+	
+	if (fd < 0) return false;
+	
+	struct sockaddr_un addr;
+	
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	snprintf(addr.sun_path, UNIX_PATH_MAX, "%s", reader->socket_path);
+	
+	if (connect(fd, (struct sockaddr*) &addr, sizeof(struct sockaddr_un)) != 0)
+	{
+		close(fd);
+		
+		return false;
+	}
+	
+	reader->fd = fd;
+	reader->powered = false;
+	
+	return true;
+}
+
+static void edna_ifd_disconnect(edna_ifd_reader* reader)
+{
+	if (reader->fd >= 0)
+	{
+		close(reader->fd);
+	}
+	
+	reader->fd = -1;
+	reader->powered = false;
+}
+
+/*
+ * Send a command to the daemon and receive its response into rx (at most
+ * rx_len bytes); a broken connection is closed, so the card disappears
+ */
+static bool edna_ifd_exchange(edna_ifd_reader* reader, UCHAR cmd, const UCHAR* tx, DWORD tx_len, UCHAR* rx, DWORD* rx_len)
+{
+	if (!edna_ifd_connect(reader)) return false;
+	
+	unsigned char status;
+	size_t len;
+	
+	if (!edna_send_frame(reader->fd, cmd, tx, tx_len) || !edna_recv_frame_header(reader->fd, status, len))
+	{
+		edna_ifd_disconnect(reader);
+		
+		return false;
+	}
+	
+	if ((len > *rx_len) || (status != EDNA_OK))
+	{
+		edna_ifd_disconnect(reader);
+		
+		return false;
+	}
+	
+	*rx_len = len;
+	
+	if ((*rx_len > 0) && !edna_read_fully(reader->fd, rx, *rx_len))
+	{
+		edna_ifd_disconnect(reader);
+		
+		return false;
+	}
+	
+	return true;
+}
+
+/* pcscd looks up the handler functions by their C names */
+extern "C"
+{
+
+RESPONSECODE IFDHCreateChannelByName(DWORD Lun, LPSTR DeviceName)
+{
+	RESPONSECODE rv = IFD_COMMUNICATION_ERROR;
+	
+	edna_ifd_reader* reader = edna_ifd_get_reader(Lun);
+	
+	if (reader == NULL) return rv;
+	
+	pthread_mutex_lock(&reader->mutex);
+	
+	/* The device name is the path of the loopback socket of the daemon */
+	if (!reader->in_use)
+	{
+		const char* socket_path = ((DeviceName != NULL) && (DeviceName[0] != '\0')) ? DeviceName : EDNA_LOOPBACK_SOCKET;
+		
+		if (strlen(socket_path) < UNIX_PATH_MAX)
+		{
+			reader->in_use = true;
+			reader->fd = -1;
+			reader->powered = false;
+			
+			snprintf(reader->socket_path, UNIX_PATH_MAX, "%s", socket_path);
+			
+			/* The daemon need not be running yet; the card appears once it is */
+			edna_ifd_connect(reader);
+			
+			rv = IFD_SUCCESS;
+		}
+	}
+	
+	pthread_mutex_unlock(&reader->mutex);
+	
+	return rv;
+}
+
+RESPONSECODE IFDHCreateChannel(DWORD Lun, DWORD Channel)
+{
+	return IFDHCreateChannelByName(Lun, NULL);
+}
+
+RESPONSECODE IFDHCloseChannel(DWORD Lun)
+{
+	edna_ifd_reader* reader = edna_ifd_get_reader(Lun);
+	
+	if (reader == NULL) return IFD_COMMUNICATION_ERROR;
+	
+	pthread_mutex_lock(&reader->mutex);
+	
+	edna_ifd_disconnect(reader);
+	
+	reader->in_use = false;
+	
+	pthread_mutex_unlock(&reader->mutex);
+	
+	return IFD_SUCCESS;
+}
+
+RESPONSECODE IFDHGetCapabilities(DWORD Lun, DWORD Tag, PDWORD Length, PUCHAR Value)
+{
+	if (edna_ifd_get_reader(Lun) == NULL) return IFD_COMMUNICATION_ERROR;
+	
+	switch(Tag)
+	{
+	case TAG_IFD_ATR:
+	case SCARD_ATTR_ATR_STRING:
+		if (*Length < sizeof(edna_ifd_atr)) return IFD_ERROR_INSUFFICIENT_BUFFER;
+		
+		memcpy(Value, edna_ifd_atr, sizeof(edna_ifd_atr));
+		*Length = sizeof(edna_ifd_atr);
+		
+		return IFD_SUCCESS;
+	case TAG_IFD_SLOTS_NUMBER:
+	case TAG_IFD_SIMULTANEOUS_ACCESS:
+		if (*Length < 1) return IFD_ERROR_INSUFFICIENT_BUFFER;
+		
+		/* One slot per reader; readers are served independently */
+		Value[0] = (Tag == TAG_IFD_SLOTS_NUMBER) ? 1 : EDNA_IFD_MAX_READERS;
+		*Length = 1;
+		
+		return IFD_SUCCESS;
+	case TAG_IFD_THREAD_SAFE:
+		if (*Length < 1) return IFD_ERROR_INSUFFICIENT_BUFFER;
+		
+		Value[0] = 1;
+		*Length = 1;
+		
+		return IFD_SUCCESS;
+	default:
+		return IFD_ERROR_TAG;
+	}
+}
+
+RESPONSECODE IFDHSetCapabilities(DWORD Lun, DWORD Tag, DWORD Length, PUCHAR Value)
+{
+	return IFD_NOT_SUPPORTED;
+}
+
+RESPONSECODE IFDHSetProtocolParameters(DWORD Lun, DWORD Protocol, UCHAR Flags, UCHAR PTS1, UCHAR PTS2, UCHAR PTS3)
+{
+	/* Contactless cards are always presented as T=1 */
+	return (Protocol == SCARD_PROTOCOL_T1) ? IFD_SUCCESS : IFD_PROTOCOL_NOT_SUPPORTED;
+}
+
+RESPONSECODE IFDHPowerICC(DWORD Lun, DWORD Action, PUCHAR Atr, PDWORD AtrLength)
+{
+	RESPONSECODE rv = IFD_SUCCESS;
+	UCHAR rsp[1];
+	DWORD rsp_len = 0;
+	
+	edna_ifd_reader* reader = edna_ifd_get_reader(Lun);
+	
+	*AtrLength = 0;
+	
+	if (reader == NULL) return IFD_COMMUNICATION_ERROR;
+	
+	pthread_mutex_lock(&reader->mutex);
+	
+	if (!reader->in_use)
+	{
+		rv = IFD_COMMUNICATION_ERROR;
+	}
+	else if (Action == IFD_POWER_DOWN)
+	{
+		/* The daemon powers down when the connection is gone as well */
+		if (reader->powered && (reader->fd >= 0))
+		{
+			edna_ifd_exchange(reader, POWER_DOWN, NULL, 0, rsp, &rsp_len);
+		}
+		
+		reader->powered = false;
+	}
+	else if ((Action == IFD_POWER_UP) || (Action == IFD_RESET))
+	{
+		/* The daemon handles a power up of a powered card as a reset */
+		if (edna_ifd_exchange(reader, POWER_UP, NULL, 0, rsp, &rsp_len))
+		{
+			reader->powered = true;
+			
+			memcpy(Atr, edna_ifd_atr, sizeof(edna_ifd_atr));
+			*AtrLength = sizeof(edna_ifd_atr);
+		}
+		else
+		{
+			rv = IFD_ERROR_POWER_ACTION;
+		}
+	}
+	else
+	{
+		rv = IFD_NOT_SUPPORTED;
+	}
+	
+	pthread_mutex_unlock(&reader->mutex);
+	
+	return rv;
+}
+
+RESPONSECODE IFDHTransmitToICC(DWORD Lun, SCARD_IO_HEADER SendPci, PUCHAR TxBuffer, DWORD TxLength, PUCHAR RxBuffer, PDWORD RxLength, PSCARD_IO_HEADER RecvPci)
+{
+	RESPONSECODE rv = IFD_SUCCESS;
+	
+	edna_ifd_reader* reader = edna_ifd_get_reader(Lun);
+	
+	if (reader == NULL)
+	{
+		*RxLength = 0;
+		
+		return IFD_COMMUNICATION_ERROR;
+	}
+	
+	pthread_mutex_lock(&reader->mutex);
+	
+	if (!reader->in_use || !reader->powered)
+	{
+		*RxLength = 0;
+		
+		rv = IFD_COMMUNICATION_ERROR;
+	}
+	else if (!edna_ifd_exchange(reader, TRANSCEIVE_APDU, TxBuffer, TxLength, RxBuffer, RxLength))
+	{
+		*RxLength = 0;
+		
+		rv = IFD_COMMUNICATION_ERROR;
+	}
+	else if (RecvPci != NULL)
+	{
+		RecvPci->Protocol = 1;
+		RecvPci->Length = 0;
+	}
+	
+	pthread_mutex_unlock(&reader->mutex);
+	
+	return rv;
+}
+
+RESPONSECODE IFDHControl(DWORD Lun, DWORD dwControlCode, PUCHAR TxBuffer, DWORD TxLength, PUCHAR RxBuffer, DWORD RxLength, LPDWORD pdwBytesReturned)
+{
+	*pdwBytesReturned = 0;
+	
+	return IFD_ERROR_NOT_SUPPORTED;
+}
+
+RESPONSECODE IFDHICCPresence(DWORD Lun)
+{
+	RESPONSECODE rv = IFD_ICC_NOT_PRESENT;
+	
+	edna_ifd_reader* reader = edna_ifd_get_reader(Lun);
+	
+	if (reader == NULL) return IFD_COMMUNICATION_ERROR;
+	
+	pthread_mutex_lock(&reader->mutex);
+	
+	if (!reader->in_use)
+	{
+		rv = IFD_COMMUNICATION_ERROR;
+	}
+	else if (reader->powered)
+	{
+		/* Do not disturb a card session; a lost daemon shows on the next exchange */
+		rv = IFD_ICC_PRESENT;
+	}
+	else
+	{
+		/* A card that was removed (the daemon went away) is inserted again when it is back */
+		if (reader->fd >= 0)
+		{
+			UCHAR probe;
+			ssize_t peeked = recv(reader->fd, &probe, 1, MSG_PEEK | MSG_DONTWAIT);
+			
+			if ((peeked == 0) || ((peeked < 0) && (errno != EAGAIN) && (errno != EWOULDBLOCK)))
+			{
+				edna_ifd_disconnect(reader);
+			}
+		}
+		
+		if (edna_ifd_connect(reader))
+		{
+			rv = IFD_ICC_PRESENT;
+		}
+	}
+	
+	pthread_mutex_unlock(&reader->mutex);
+	
+	return rv;
+}
+
+} // extern "C"
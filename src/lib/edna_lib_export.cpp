@@ -42,6 +42,10 @@
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <sys/types.h>
+#include <netdb.h>
+#include <time.h>
+#include <string>
+#include "edna_net.h"
 
 
 /* Library status */
@@ -54,6 +58,21 @@ static bool edna_lib_must_cancel = false;
 /* Connection to the daemon */
 int daemon_socket = -1;
 
+/* Automatic reconnection */
+#define RECONNECT_MIN_BACKOFF		50			/* ms */
+#define RECONNECT_DEFAULT_MAX		5000		/* ms */
+
+static bool edna_lib_reconnect = false;
+
+static unsigned int edna_lib_max_backoff = RECONNECT_DEFAULT_MAX;
+
+/* Parameters of the last successful connection, used to reconnect */
+static std::string edna_lib_tcp_host_port;
+
+static std::vector<unsigned char> edna_lib_aid;
+
+static edna_rv edna_lib_register(const unsigned char* aid_data, size_t aid_len);
+
 edna_rv edna_lib_init(void)
 {
 	if (edna_lib_initialised)
@@ -95,30 +114,14 @@ int send_to_daemon(const std::vector<unsigned char> tx)
 		return -1;
 	}
 	
-	if (tx.size() > 0xffff) return -1;
-	
-	/* 
-	 * Prepare the data for transmission by prepending a 16-bit
-	 * value indicating the command length 
-	 */
-	unsigned short tx_size = (unsigned short) tx.size();
-	
-	std::vector<unsigned char> tx_buf;
-	tx_buf.resize(tx.size() + 2);
-	
-	tx_buf[0] = tx_size >> 8;
-	tx_buf[1] = tx_size & 0xff;
-	
-	memcpy(&tx_buf[2], &tx[0], tx.size());
+	if (tx.empty() || (tx.size() > 0xffff)) return -1;
 	
 	/* 
-	 * Transmit the command
-	 * 
-	 * FIXME: this will fail if the process receives a POSIX signal! 
+	 * Transmit the command, prepended by its 16-bit length; if the daemon
+	 * has gone away this fails with EPIPE rather than raising SIGPIPE, so
+	 * that the application gets the chance to reconnect
 	 */
-	int tx_sent = 0;
-	 
-	if ((tx_sent = write(daemon_socket, &tx_buf[0], tx_buf.size())) != tx_buf.size())
+	if (!edna_send_frame(daemon_socket, tx[0], (tx.size() > 1) ? &tx[1] : NULL, tx.size() - 1))
 	{
 		close(daemon_socket);
 		
@@ -138,19 +141,14 @@ int recv_from_daemon(std::vector<unsigned char>& rx)
 		return -1;
 	}
 	
-	unsigned short rx_size = 0;
+	unsigned char len_buf[2];
 	
-	size_t rx_index = 0;
-	
-	unsigned char buf[512] = { 0 };
-	
-	/*
-	 * Read the length of the data to receive
-	 * 
-	 * FIXME: this will fail if the process receives a signal!
+	/* 
+	 * Read the length of the data to receive and then the data itself;
+	 * reads interrupted by a signal are retried, and the daemon closing
+	 * the connection counts as a disconnect
 	 */
-	if ((read(daemon_socket, &buf[0], 1) != 1) ||
-	    (read(daemon_socket, &buf[1], 1) != 1))
+	if (!edna_read_fully(daemon_socket, len_buf, 2))
 	{
 		close(daemon_socket);
 		
@@ -160,33 +158,18 @@ int recv_from_daemon(std::vector<unsigned char>& rx)
 		return -2;
 	}
 	
-	rx_size = (buf[0] << 8) + buf[1];
+	size_t rx_size = (len_buf[0] << 8) + len_buf[1];
 	
 	rx.resize(rx_size);
 	
-	/* 
-	 * Now receive the actual data 
-	 * 
-	 * FIXME: again, will not deal well with POSIX signals!
-	 */
-	while (rx_size > 0)
+	if ((rx_size > 0) && !edna_read_fully(daemon_socket, &rx[0], rx_size))
 	{
-		int received = read(daemon_socket, &buf[0], (rx_size < 512) ? rx_size : 512);
-		
-		if (received < 0)
-		{
-			close(daemon_socket);
-		
-			edna_lib_connected = false;
-			daemon_socket = -1;
-			
-			return -2;
-		}
+		close(daemon_socket);
 		
-		memcpy(&rx[rx_index], buf, received);
+		edna_lib_connected = false;
+		daemon_socket = -1;
 		
-		rx_index += received;
-		rx_size -= received;
+		return -2;
 	}
 	
 	return 0;
@@ -223,6 +206,71 @@ edna_rv edna_lib_connect(const unsigned char* aid_data, size_t aid_len)
 		return ERV_CONNECT_FAILED;
 	}
 	
+	edna_lib_tcp_host_port.clear();
+	
+	return edna_lib_register(aid_data, aid_len);
+}
+
+edna_rv edna_lib_connect_tcp(const char* host_port, const unsigned char* aid_data, size_t aid_len)
+{
+	if (edna_lib_connected)
+	{
+		return ERV_ALREADY_CONNECTED;
+	}
+	
+	std::string host;
+	std::string port;
+	
+	if (!edna_split_host_port(host_port, host, port))
+	{
+		return ERV_PARAM_INVALID;
+	}
+	
+	/* Attempt to connect to the daemon on any of the addresses of the host */
+	struct addrinfo hints;
+	struct addrinfo* res = NULL;
+	
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	
+	if (getaddrinfo(host.c_str(), port.c_str(), &hints, &res) != 0)
+	{
+		return ERV_CONNECT_FAILED;
+	}
+	
+	daemon_socket = -1;
+	
+	for (struct addrinfo* ai = res; ai != NULL; ai = ai->ai_next)
+	{
+		daemon_socket = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		
+		if (daemon_socket < 0) continue;
+		
+		if (connect(daemon_socket, ai->ai_addr, ai->ai_addrlen) == 0) break;
+		
+		close(daemon_socket);
+		
+		daemon_socket = -1;
+	}
+	
+	freeaddrinfo(res);
+	
+	if (daemon_socket < 0)
+	{
+		return ERV_CONNECT_FAILED;
+	}
+	
+	edna_set_tcp_options(daemon_socket);
+	
+	edna_lib_tcp_host_port = host_port;
+	
+	return edna_lib_register(aid_data, aid_len);
+}
+
+/* Perform the protocol handshake on a connected socket and register the AID */
+static edna_rv edna_lib_register(const unsigned char* aid_data, size_t aid_len)
+{
 	edna_lib_connected = true;
 	
 	/* Request the API version from the daemon */
@@ -299,9 +347,67 @@ edna_rv edna_lib_connect(const unsigned char* aid_data, size_t aid_len)
 		return ERV_ALREADY_REGISTERED;
 	}
 	
+	edna_lib_aid.assign(aid_data, aid_data + aid_len);
+	
+	return ERV_OK;
+}
+
+edna_rv edna_lib_set_reconnect(int enable, unsigned int max_backoff_ms)
+{
+	if (!edna_lib_initialised)
+	{
+		return ERV_NOT_INITIALISED;
+	}
+	
+	edna_lib_reconnect = (enable != 0);
+	edna_lib_max_backoff = (max_backoff_ms > 0) ? max_backoff_ms : RECONNECT_DEFAULT_MAX;
+	
+	if (edna_lib_max_backoff < RECONNECT_MIN_BACKOFF)
+	{
+		edna_lib_max_backoff = RECONNECT_MIN_BACKOFF;
+	}
+	
 	return ERV_OK;
 }
 
+/* Reconnect to the daemon and re-register the AID; returns false if the loop was cancelled */
+static bool edna_lib_reestablish(void)
+{
+	unsigned int backoff = RECONNECT_MIN_BACKOFF;
+	unsigned int seed = (unsigned int) getpid() ^ (unsigned int) time(NULL);
+	std::vector<unsigned char> aid = edna_lib_aid;
+	
+	while (!edna_lib_must_cancel)
+	{
+		/*
+		 * Wait a random time of up to the current backoff, so applications
+		 * that lost their connection at the same moment (e.g. because the
+		 * daemon restarted) do not all come back at once
+		 */
+		unsigned int delay = (backoff / 2) + (rand_r(&seed) % ((backoff / 2) + 1));
+		
+		for (unsigned int waited = 0; (waited < delay) && !edna_lib_must_cancel; waited += 10)
+		{
+			usleep(10000);
+		}
+		
+		if (edna_lib_must_cancel) break;
+		
+		edna_rv rv = edna_lib_tcp_host_port.empty() ? 
+		             edna_lib_connect(&aid[0], aid.size()) :
+		             edna_lib_connect_tcp(edna_lib_tcp_host_port.c_str(), &aid[0], aid.size());
+		
+		if (rv == ERV_OK)
+		{
+			return true;
+		}
+		
+		backoff = (backoff * 2 > edna_lib_max_backoff) ? edna_lib_max_backoff : backoff * 2;
+	}
+	
+	return false;
+}
+
 edna_rv edna_lib_disconnect(void)
 {
 	if (!edna_lib_connected)
@@ -317,6 +423,9 @@ edna_rv edna_lib_disconnect(void)
 	
 	close(daemon_socket);
 	edna_lib_connected = false;
+	daemon_socket = -1;
+	
+	edna_lib_aid.clear();
 	
 	return ERV_OK;
 }
@@ -330,8 +439,29 @@ edna_rv edna_lib_loop_and_process(handle_apdu process_cb, power_up power_up_cb,
 	
 	edna_lib_must_cancel = false;
 	
+	bool powered = false;
+	
 	while (!edna_lib_must_cancel)
 	{
+		/* Reconnect if the connection was lost (only when enabled) */
+		if (!edna_lib_connected)
+		{
+			if (!edna_lib_reconnect || edna_lib_aid.empty())
+			{
+				return ERV_DISCONNECTED;
+			}
+			
+			if (powered)
+			{
+				/* The card session ended along with the connection */
+				(power_down_cb)();
+				
+				powered = false;
+			}
+			
+			if (!edna_lib_reestablish()) break;
+		}
+		
 		fd_set daemon_fds;
 	
 		do
@@ -352,12 +482,12 @@ edna_rv edna_lib_loop_and_process(handle_apdu process_cb, power_up power_up_cb,
 		
 		if ((recv_from_daemon(cmd) != 0) || (cmd.size() < 1))
 		{
-			close(daemon_socket);
+			if (daemon_socket >= 0) close(daemon_socket);
 			
 			daemon_socket = -1;
 			edna_lib_connected = false;
 			
-			return ERV_DISCONNECTED;
+			continue;
 		}
 		
 		/* Perform processing based on the type of command */
@@ -367,10 +497,15 @@ edna_rv edna_lib_loop_and_process(handle_apdu process_cb, power_up power_up_cb,
 		{
 		case POWER_UP:
 			(power_up_cb)();
+			powered = true;
 			rsp.push_back(EDNA_OK);
 			break;
 		case POWER_DOWN:
 			(power_down_cb)();
+			powered = false;
+			rsp.push_back(EDNA_OK);
+			break;
+		case PING:
 			rsp.push_back(EDNA_OK);
 			break;
 		case TRANSCEIVE_APDU:
@@ -399,12 +534,8 @@ edna_rv edna_lib_loop_and_process(handle_apdu process_cb, power_up power_up_cb,
 		/* Transmit the response data to the daemon */
 		if (send_to_daemon(rsp) != 0)
 		{
-			close(daemon_socket);
-			
-			daemon_socket = -1;
-			edna_lib_connected = false;
-			
-			return ERV_DISCONNECTED;
+			/* The connection has already been closed */
+			continue;
 		}
 	}
 	
@@ -0,0 +1,155 @@
+/*
+ * Copyright (c) 2013 Roland van Rijswijk-Deij
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+ * IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * The Emulator Daemon for NFC Applications (EDNA)
+ * Byte string lookup benchmark
+ */
+
+#include "config.h"
+#include "edna_bytestring.h"
+#include "edna_bytestring_view.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <map>
+#include <unordered_map>
+#include <vector>
+
+/*
+ * This benchmark measures lookups in a registry of AIDs, like the one
+ * the daemon searches on every SELECT. It compares the ordering that
+ * bytestring used to have (comparing hex strings) with the memcmp
+ * ordering, searching with a copy of the AID versus a view into the
+ * C-APDU, and a hashed registry. Pass the number of lookups as the
+ * first argument (default 1000000)
+ */
+
+#define NUM_AIDS		64
+#define DEFAULT_LOOKUPS	1000000
+
+/* The ordering bytestring used before it compared with memcmp */
+struct hex_str_less
+{
+	bool operator()(const bytestring& lhs, const bytestring& rhs) const { return lhs.hex_str() < rhs.hex_str(); }
+};
+
+static double elapsed_ns(std::chrono::steady_clock::time_point start, long lookups)
+{
+	return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / lookups;
+}
+
+int main(int argc, char* argv[])
+{
+	long lookups = (argc > 1) ? atol(argv[1]) : DEFAULT_LOOKUPS;
+
+	if (lookups <= 0) lookups = DEFAULT_LOOKUPS;
+
+	/* Registered AIDs share a prefix, as AIDs of one issuer do */
+	std::vector<bytestring> aids;
+	std::vector<bytestring> capdus;
+
+	for (int i = 0; i < NUM_AIDS; i++)
+	{
+		unsigned char aid[] = { 0xA0, 0x00, 0x00, 0x00, 0x04, 0x10, (unsigned char) i, (unsigned char) (i * 7) };
+		unsigned char select[] = { 0x00, 0xA4, 0x04, 0x00, sizeof(aid) };
+
+		aids.push_back(bytestring(aid, sizeof(aid)));
+		capdus.push_back(bytestring(select, sizeof(select)) + aids.back());
+	}
+
+	std::map<bytestring, int, hex_str_less> hex_registry;
+	std::map<bytestring, int, bytestring_less> registry;
+	std::unordered_map<bytestring, int> hashed_registry;
+
+	for (int i = 0; i < NUM_AIDS; i++)
+	{
+		hex_registry[aids[i]] = i;
+		registry[aids[i]] = i;
+		hashed_registry[aids[i]] = i;
+	}
+
+	long found = 0;
+
+	printf("%ld lookups in a registry of %d AIDs\n", lookups, NUM_AIDS);
+
+	/* Old ordering, with the AID copied out of the C-APDU */
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+	for (long i = 0; i < lookups; i++)
+	{
+		const bytestring& capdu = capdus[i % NUM_AIDS];
+
+		found += hex_registry.count(capdu.substr(5));
+	}
+
+	printf("hex string ordering, AID copied:  %8.1f ns/lookup\n", elapsed_ns(start, lookups));
+
+	/* memcmp ordering, with the AID copied out of the C-APDU */
+	start = std::chrono::steady_clock::now();
+
+	for (long i = 0; i < lookups; i++)
+	{
+		const bytestring& capdu = capdus[i % NUM_AIDS];
+
+		found += registry.count(capdu.substr(5));
+	}
+
+	printf("memcmp ordering, AID copied:      %8.1f ns/lookup\n", elapsed_ns(start, lookups));
+
+	/* memcmp ordering, searching with a view into the C-APDU */
+	start = std::chrono::steady_clock::now();
+
+	for (long i = 0; i < lookups; i++)
+	{
+		const bytestring& capdu = capdus[i % NUM_AIDS];
+
+		found += registry.count(bytestring_view(capdu).substr(5));
+	}
+
+	printf("memcmp ordering, AID viewed:      %8.1f ns/lookup\n", elapsed_ns(start, lookups));
+
+	/* Hashed registry, searching with a key that is already a bytestring */
+	start = std::chrono::steady_clock::now();
+
+	for (long i = 0; i < lookups; i++)
+	{
+		found += hashed_registry.count(aids[i % NUM_AIDS]);
+	}
+
+	printf("std::hash<bytestring>:            %8.1f ns/lookup\n", elapsed_ns(start, lookups));
+
+	/* Every lookup should have found its AID */
+	if (found != 4 * lookups)
+	{
+		fprintf(stderr, "Lookups found %ld of %ld AIDs\n", found, 4 * lookups);
+
+		return 1;
+	}
+
+	return 0;
+}
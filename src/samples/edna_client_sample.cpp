@@ -39,7 +39,8 @@
 
 /*
  * This simple sample application connects to the daemon and registers
- * the AID listed below. It then outputs all commands it receives to
+ * the AID listed below (if a "host:port" argument is given, it connects
+ * to the daemon over TCP instead). It then outputs all commands it receives to
  * the standard output and responds with the status word 0x9000 (OK)
  * to all commands
  */
@@ -101,8 +102,17 @@ int main(int argc, char* argv[])
 		return -1;
 	}
 	
-	/* Connect to the daemon */
-	if ((rv = edna_lib_connect(AID, sizeof(AID))) != ERV_OK)
+	/* Connect to the daemon; optionally to a remote daemon over TCP */
+	if (argc > 1)
+	{
+		rv = edna_lib_connect_tcp(argv[1], AID, sizeof(AID));
+	}
+	else
+	{
+		rv = edna_lib_connect(AID, sizeof(AID));
+	}
+	
+	if (rv != ERV_OK)
 	{
 		fprintf(stderr, "Failed to connect to the edna daemon (0x%08X)\n", (unsigned int) rv);
 		